@@ -0,0 +1,229 @@
+#include <sys/types.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <iostream>
+#include "commands.h"
+#include "log.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+MailStore *mailStore = NULL;        // shared by all workers
+
+///////////////////////////////////////////////////////////////////////////////
+
+int processSend(const string &sender, const string &receiver, const string &subject, const MessageBody &message){
+   if(mailStore->append(receiver, sender, subject, message)==-1){
+      return -1;
+   }
+
+   // bodies are private mail: only with --log-bodies, and only what is
+   // still in memory of a large one
+   if (logBodies) {
+      LOG(LEVEL_DEBUG, "Message from: %s to: %s Subject: %s Message: %s", sender.c_str(), receiver.c_str(), subject.c_str(), message.buffered().c_str());
+   } else {
+      LOG(LEVEL_DEBUG, "Message from: %s to: %s Subject: %s (%llu bytes)", sender.c_str(), receiver.c_str(), subject.c_str(), (unsigned long long)message.size());
+   }
+   return 1;
+}
+
+//Check if number of message is in fact a positive int
+int parseMessageNr(const string &messageNr, uint32_t &number){
+   char *p;
+   long converted = strtol(messageNr.c_str(), &p, 10);
+   if (*p || messageNr.empty() || converted < 1 || converted > UINT32_MAX) {
+      return -1;
+   }
+   number = converted;
+   return 0;
+}
+
+
+// ./twmailer-server 1234 Users
+// ./twmailer-client 127.0.0.1 1234 port kann alles sein muss einfach nur matchen
+
+// Queue message number and subject for the client
+static void appendSummaries(const vector<MessageSummary> &messages, string &reply) {
+   for (const MessageSummary &message : messages) {
+      reply += to_string(message.number);
+      reply += ". Subject: "; // Add a period to distinguish the subject
+      reply += message.subject;
+      reply += "\n"; // Add a newline
+   }
+}
+
+// reads a whole non-negative number out of text, -1 if there is none
+static int parseCount(const string &text, uint64_t &value) {
+   char *p;
+   if (text.empty() || text[0] < '0' || text[0] > '9') {
+      return -1;
+   }
+   errno = 0;
+   value = strtoull(text.c_str(), &p, 10);
+   return *p || errno == ERANGE ? -1 : 0;
+}
+
+// "<generation>.<sequence>" as handed out by LIST SINCE; "0" starts afresh
+int parseSyncToken(const string &text, SyncToken &token) {
+   if (text == "0") {
+      token.generation = token.sequence = 0;
+      return 0;
+   }
+   size_t dot = text.find('.');
+   if (dot == string::npos ||
+       parseCount(text.substr(0, dot), token.generation) == -1 ||
+       parseCount(text.substr(dot + 1), token.sequence) == -1) {
+      return -1;
+   }
+   return 0;
+}
+
+string formatSyncToken(const SyncToken &token) {
+   return to_string(token.generation) + "." + to_string(token.sequence);
+}
+
+int processList(const string &username, const string &arguments, string &reply) {
+   if (arguments.compare(0, 6, "SINCE ") == 0) {
+      return processListSince(username, arguments.substr(6), reply);
+   }
+   vector<MessageSummary> messages;
+   if (arguments.empty()) {
+      LOG(LEVEL_DEBUG, "Listing messages for user: %s", username.c_str());
+      if (mailStore->list(username, messages) == -1) {
+         LOG(LEVEL_DEBUG, "User file not found for user: %s", username.c_str());
+         return -1;
+      }
+      appendSummaries(messages, reply);
+      return 0;
+   }
+
+   // a page: "<offset> <count>", offset counting from 0
+   size_t space = arguments.find(' ');
+   uint64_t offset, count;
+   if (space == string::npos ||
+       parseCount(arguments.substr(0, space), offset) == -1 ||
+       parseCount(arguments.substr(space + 1), count) == -1) {
+      reply += "Invalid LIST arguments!\n";
+      return -1;
+   }
+   LOG(LEVEL_DEBUG, "Listing messages %llu+%llu for user: %s",
+       (unsigned long long)offset, (unsigned long long)count, username.c_str());
+
+   size_t total;
+   if (mailStore->listPage(username, offset, count, messages, total) == -1) {
+      LOG(LEVEL_DEBUG, "User file not found for user: %s", username.c_str());
+      return -1;
+   }
+   appendSummaries(messages, reply);
+   reply += "Total: " + to_string(total) + "\n";
+   return 0;
+}
+
+int processListSince(const string &username, const string &token, string &reply) {
+   SyncToken since;
+   if (parseSyncToken(token, since) == -1) {
+      reply += "Invalid sync token!\n";
+      return -1;
+   }
+   LOG(LEVEL_DEBUG, "Listing changes since %s for user: %s", token.c_str(), username.c_str());
+
+   MailboxChanges changes;
+   if (mailStore->listChanges(username, since, changes) == -1) {
+      LOG(LEVEL_DEBUG, "User file not found for user: %s", username.c_str());
+      return -1;
+   }
+   // the client starts over with the messages that follow
+   if (changes.reset) {
+      reply += "Reset\n";
+   }
+   appendSummaries(changes.added, reply);
+   for (uint32_t number : changes.deleted) {
+      reply += to_string(number) + ". Deleted\n";
+   }
+   reply += "Token: " + formatSyncToken(changes.token) + "\n";
+   return 0;
+}
+
+int processRead(const string &username, const string &messageNr, string &reply, FileRange &body){
+   uint32_t number;
+   if (parseMessageNr(messageNr, number) == -1) {
+      return -1;
+   }
+   LOG(LEVEL_DEBUG, "Trying to find: %s %u", username.c_str(), number);
+
+   Message message;
+   int result = mailStore->readFile(username, number, message, body);
+   if (result == STORE_NO_MESSAGE) {
+      //if message was not found
+      reply += "Message nr. "+messageNr+" doesn't exist!\n";
+      return -1;
+   }
+   if (result == -1) {
+      LOG(LEVEL_DEBUG, "User file not found for user: %s", username.c_str());
+      return -1;
+   }
+
+   //Queue the specific message for the client
+   reply += message.sender;
+   reply += "\n";
+   reply += message.subject;
+   reply += "\n";
+   reply += message.body;
+   // a large body stays in its file and is sent from there with sendfile();
+   // a small one costs less to copy than a syscall of its own
+   if (body.file && body.length < MIN_SENDFILE) {
+      size_t start = reply.size();
+      reply.resize(start + body.length);
+      ssize_t got;
+      for (size_t done = 0; done < body.length; done += got) {
+         got = pread(body.file->fd, &reply[start + done], body.length - done, body.offset + done);
+         if (got <= 0) {
+            return -1;
+         }
+      }
+      body = FileRange();   // the framed reply counts its length
+   }
+   return 0;
+}
+
+int processDel(const string &username, const string &messageNr, string &reply) {
+   uint32_t number;
+   if (parseMessageNr(messageNr, number) == -1) {
+      return -1;
+   }
+   LOG(LEVEL_DEBUG, "Trying to find: %s %u", username.c_str(), number);
+
+   int result = mailStore->remove(username, number);
+   if (result == -1) {
+      LOG(LEVEL_DEBUG, "User file not found for user: %s", username.c_str());
+   }
+   if (result != 0) {
+      return -1;
+   }
+   reply += "Message " + messageNr + " deleted successfully.\n";
+   return 0;
+}
+
+int processSearch(const string &username, const string &query, string &reply) {
+   TermScanner scanner;
+   scanner.feed(query.data(), query.size());
+   const vector<string> &terms = scanner.finish();
+   if (terms.empty()) {
+      reply += "No search terms!\n";
+      return -1;
+   }
+   LOG(LEVEL_DEBUG, "Searching messages of user: %s for %zu terms", username.c_str(), terms.size());
+
+   vector<MessageSummary> messages;
+   if (mailStore->search(username, terms, messages) == -1) {
+      LOG(LEVEL_DEBUG, "User file not found for user: %s", username.c_str());
+      return -1;
+   }
+   // the same lines as LIST, for the matching messages only
+   appendSummaries(messages, reply);
+   return 0;
+}
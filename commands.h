@@ -0,0 +1,36 @@
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include <stdint.h>
+#include <string>
+#include "mailstore.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// COMMANDS
+// SEND, LIST, READ, DEL and SEARCH on top of the mail store, independent of any
+// socket: the answer text is appended to reply and a READ body may be left
+// in its file as body, for the caller to queue or send. The server wraps the
+// result in its wire protocol; benchmarks call these directly.
+
+#define MIN_SENDFILE (16 * 1024)      // smaller bodies are copied into the reply
+
+extern MailStore *mailStore;          // shared by all workers
+
+// 1 on success, -1 on error
+int processSend(const std::string &sender, const std::string &receiver, const std::string &subject, const MessageBody &message);
+int parseMessageNr(const std::string &messageNr, uint32_t &number);
+// arguments: "" for every message, "<offset> <count>" for a page followed
+// by "Total: <messages>", "SINCE <token>" for processListSince()
+int processList(const std::string &username, const std::string &arguments, std::string &reply);
+// The messages appended since token as LIST lines, "<nr>. Deleted" for
+// those deleted, then "Token: <token>" for the next call. A token the store
+// cannot answer for, or "0", gets a "Reset" line and every message instead.
+int processListSince(const std::string &username, const std::string &token, std::string &reply);
+int parseSyncToken(const std::string &text, SyncToken &token);
+std::string formatSyncToken(const SyncToken &token);
+int processRead(const std::string &username, const std::string &messageNr, std::string &reply, FileRange &body);
+int processDel(const std::string &username, const std::string &messageNr, std::string &reply);
+// query: words separated by anything but letters and digits, all must match
+int processSearch(const std::string &username, const std::string &query, std::string &reply);
+
+#endif
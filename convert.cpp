@@ -0,0 +1,343 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "mailformat.h"
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+// twmailer-convert: rewrites the flat mailboxes of a spool that are still in
+// the legacy text format into mail records (see mailformat.h), in either
+// spool layout. The server must not run on the spool meanwhile.
+//
+//   ./twmailer-convert <spool>
+//
+// Every mailbox is written to a temporary file next to it, synced and then
+// renamed over it, so a crash leaves either the old or the new mailbox, and
+// running the tool again carries on. Where the index the server kept for a
+// mailbox still describes it, the messages are taken from there, which has
+// them right even if a body holds a MESSAGE line; otherwise the text is
+// split up at its markers. Deleted messages are kept as deleted records, so
+// message numbers do not change. The new indexes are built by the server on
+// first use. Maildir users are directories and left alone.
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define WRITE_CHUNK (1024 * 1024)   // converted bytes gathered before a write
+#define LEGACY_INDEX_MAGIC "TWI3"     // the last index format for text mailboxes
+#define LEGACY_DELETED 0x1
+
+// the index of a legacy mailbox, as the server wrote it
+struct LegacyIndexHeader
+{
+   char magic[4];
+   uint32_t recordCount;
+   uint64_t mailboxSize;
+   uint64_t mailboxInode;
+   uint64_t mailboxMtime;    // nanoseconds
+   uint64_t deadBytes;
+   uint64_t generation;
+   uint64_t sequence;
+   uint64_t deletionCount;
+   char deletions[64 * 16];
+};
+
+struct LegacyIndexRecord
+{
+   uint64_t offset;          // of the MESSAGE line
+   uint32_t length;          // MESSAGE line up to and including the closing blank line
+   uint32_t subjectOffset;   // relative to offset
+   uint32_t bodyOffset;      // relative to offset
+   uint32_t flags;
+   uint64_t sequence;
+};
+
+struct Totals
+{
+   long converted;   // mailboxes rewritten
+   long indexed;     // of them, split up by their index
+   long messages;    // in them
+   long current;     // mailboxes already in the record format, or empty
+   long failed;
+};
+
+int convertDirectory(const string &directory, Totals &totals);
+int convertMailbox(const string &directory, const string &name, Totals &totals);
+int readLegacyIndex(const string &directory, const string &name, const struct stat &sb, const char *data,
+                    vector<LegacyMessage> &messages);
+int writeAll(int fd, const string &data);
+
+int main(int argc, char **argv)
+{
+   if (argc != 2)
+   {
+      cerr << "Usage: ./twmailer-convert <spool>" << endl;
+      return EXIT_FAILURE;
+   }
+   string spool = argv[1];
+
+   Totals totals = {};
+   if (convertDirectory(spool, totals) == -1)
+   {
+      perror(spool.c_str());
+      return EXIT_FAILURE;
+   }
+   // the sharded layout, or what a migration has moved so far
+   string shards = spool + "/.shards";
+   DIR *top = opendir(shards.c_str());
+   struct dirent *entry;
+   while (top != NULL && (entry = readdir(top)) != NULL)
+   {
+      if (entry->d_name[0] == '.')
+      {
+         continue;
+      }
+      string outer = shards + "/" + entry->d_name;
+      DIR *middle = opendir(outer.c_str());
+      struct dirent *inner;
+      while (middle != NULL && (inner = readdir(middle)) != NULL)
+      {
+         if (inner->d_name[0] != '.' && convertDirectory(outer + "/" + inner->d_name, totals) == -1)
+         {
+            perror((outer + "/" + inner->d_name).c_str());
+            totals.failed++;
+         }
+      }
+      if (middle != NULL)
+      {
+         closedir(middle);
+      }
+   }
+   if (top != NULL)
+   {
+      closedir(top);
+   }
+
+   printf("%s: %ld mailboxes converted (%ld messages, %ld split up by their index), %ld already converted, %ld failed\n",
+          spool.c_str(), totals.converted, totals.messages, totals.indexed, totals.current, totals.failed);
+   return totals.failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// converts the mailboxes directly in directory; -1 if it cannot be read
+int convertDirectory(const string &directory, Totals &totals)
+{
+   DIR *dir = opendir(directory.c_str());
+   if (dir == NULL)
+   {
+      return -1;
+   }
+   struct dirent *entry;
+   while ((entry = readdir(dir)) != NULL)
+   {
+      // names starting with "." belong to the server
+      if (entry->d_name[0] != '.' && convertMailbox(directory, entry->d_name, totals) == -1)
+      {
+         perror((directory + "/" + entry->d_name).c_str());
+         totals.failed++;
+      }
+   }
+   closedir(dir);
+   return 0;
+}
+
+// rewrites one mailbox if it is in the legacy format; -1 on error
+int convertMailbox(const string &directory, const string &name, Totals &totals)
+{
+   string path = directory + "/" + name;
+   int fd = open(path.c_str(), O_RDONLY);
+   if (fd == -1)
+   {
+      return -1;
+   }
+   struct stat sb;
+   if (fstat(fd, &sb) == -1)
+   {
+      close(fd);
+      return -1;
+   }
+   if (!S_ISREG(sb.st_mode))
+   {
+      close(fd);
+      return 0;
+   }
+   if (sb.st_size == 0)
+   {
+      close(fd);
+      totals.current++;
+      return 0;
+   }
+   void *mapped = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (mapped == MAP_FAILED)
+   {
+      return -1;
+   }
+   const char *data = (const char *)mapped;
+   if (!legacyMailbox(data, sb.st_size))
+   {
+      bool current = memcmp(data, RECORD_MAGIC, min((size_t)sb.st_size, strlen(RECORD_MAGIC))) == 0;
+      munmap(mapped, sb.st_size);
+      if (!current)
+      {
+         errno = EPROTO;
+         return -1;
+      }
+      totals.current++;
+      return 0;
+   }
+
+   string tempPath = directory + "/." + name + ".convert";
+   int tempFd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, sb.st_mode & 07777);
+   if (tempFd == -1)
+   {
+      munmap(mapped, sb.st_size);
+      return -1;
+   }
+   vector<LegacyMessage> messages;
+   bool indexed = readLegacyIndex(directory, name, sb, data, messages) == 0;
+   if (!indexed)
+   {
+      scanLegacyMailbox(data, sb.st_size, [&](const LegacyMessage &message) { messages.push_back(message); });
+   }
+
+   int result = 0;
+   string chunk;
+   for (const LegacyMessage &message : messages)
+   {
+      MailRecord record;
+      string sender(message.sender, message.senderLength);
+      string subject(message.subject, message.subjectLength);
+      if (!makeRecord(sender, subject, message.bodyLength, crc32(0, message.body, message.bodyLength), record))
+      {
+         errno = EFBIG;
+         result = -1;
+         break;
+      }
+      record.flags = message.deleted ? RECORD_DELETED : 0;
+      chunk.append((const char *)&record, sizeof(record));
+      chunk += sender;
+      chunk += subject;
+      chunk.append(message.body, message.bodyLength);
+      if (chunk.size() >= WRITE_CHUNK)
+      {
+         if ((result = writeAll(tempFd, chunk)) == -1)
+         {
+            break;
+         }
+         chunk.clear();
+      }
+   }
+   munmap(mapped, sb.st_size);
+
+   // the new mailbox has to be on disk before the rename makes it the mailbox
+   if (result == 0 && (writeAll(tempFd, chunk) == -1 || fsync(tempFd) == -1))
+   {
+      result = -1;
+   }
+   close(tempFd);
+   if (result == 0 && rename(tempPath.c_str(), path.c_str()) == -1)
+   {
+      result = -1;
+   }
+   if (result == -1)
+   {
+      int error = errno;
+      unlink(tempPath.c_str());
+      errno = error;
+      return -1;
+   }
+   int dirFd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+   if (dirFd != -1)
+   {
+      fsync(dirFd);
+      close(dirFd);
+   }
+   totals.converted++;
+   totals.indexed += indexed ? 1 : 0;
+   totals.messages += messages.size();
+   return 0;
+}
+
+// Takes the messages of a legacy mailbox from its index in <directory>/.index,
+// if that was written for the mailbox as it is and every record of it points
+// at a message; -1 if not.
+int readLegacyIndex(const string &directory, const string &name, const struct stat &sb, const char *data,
+                    vector<LegacyMessage> &messages)
+{
+   int fd = open((directory + "/.index/" + name).c_str(), O_RDONLY);
+   if (fd == -1)
+   {
+      return -1;
+   }
+   LegacyIndexHeader header;
+   vector<LegacyIndexRecord> records;
+   bool valid = read(fd, &header, sizeof(header)) == sizeof(header) &&
+                memcmp(header.magic, LEGACY_INDEX_MAGIC, sizeof(header.magic)) == 0 &&
+                header.mailboxSize == (uint64_t)sb.st_size && header.mailboxInode == sb.st_ino &&
+                header.mailboxMtime == (uint64_t)sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec;
+   if (valid)
+   {
+      records.resize(header.recordCount);
+      size_t size = records.size() * sizeof(LegacyIndexRecord);
+      valid = read(fd, records.data(), size) == (ssize_t)size;
+   }
+   close(fd);
+
+   for (size_t i = 0; valid && i < records.size(); ++i)
+   {
+      const LegacyIndexRecord &record = records[i];
+      const char *start = data + record.offset;
+      valid = record.offset + record.length <= (uint64_t)sb.st_size && record.length > 0 &&
+              record.subjectOffset > 8 && record.subjectOffset <= record.bodyOffset &&
+              record.bodyOffset <= record.length &&
+              (memcmp(start, "MESSAGE\n", 8) == 0 || memcmp(start, "DELETED\n", 8) == 0);
+      if (!valid)
+      {
+         break;
+      }
+      // the lines without their newlines, the body without the closing one
+      LegacyMessage message;
+      message.sender = start + 8;
+      message.senderLength = record.subjectOffset - 9;
+      message.subject = start + record.subjectOffset;
+      message.subjectLength = record.bodyOffset > record.subjectOffset ? record.bodyOffset - record.subjectOffset - 1 : 0;
+      message.body = start + record.bodyOffset;
+      message.bodyLength = record.length > record.bodyOffset ? record.length - record.bodyOffset - 1 : 0;
+      message.deleted = (record.flags & LEGACY_DELETED) != 0;
+      messages.push_back(message);
+   }
+   if (!valid)
+   {
+      messages.clear();
+      return -1;
+   }
+   return 0;
+}
+
+int writeAll(int fd, const string &data)
+{
+   size_t written = 0;
+   while (written < data.size())
+   {
+      ssize_t put = write(fd, data.data() + written, data.size() - written);
+      if (put == -1 && errno == EINTR)
+      {
+         continue;
+      }
+      if (put == -1)
+      {
+         return -1;
+      }
+      written += put;
+   }
+   return 0;
+}
@@ -0,0 +1,147 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <atomic>
+
+///////////////////////////////////////////////////////////////////////////////
+// Lock-free log-linear histogram in the manner of HdrHistogram: values below
+// 2 * SUB_BUCKETS get a bucket each, above that every power of two is split
+// into SUB_BUCKETS equal buckets, so a bucket bound is never more than 1/16
+// above the values it holds. Recording is a few relaxed atomic adds, cheap
+// enough for every request; readers may run concurrently and see a snapshot
+// that is at most a few records behind.
+
+class Histogram
+{
+public:
+   Histogram() : count(0), sum(0), maximum(0)
+   {
+      for (std::atomic<long> &bucket : buckets)
+      {
+         bucket = 0;
+      }
+   }
+
+   void record(uint64_t value)
+   {
+      buckets[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+      count.fetch_add(1, std::memory_order_relaxed);
+      sum.fetch_add(value, std::memory_order_relaxed);
+      uint64_t seen = maximum.load(std::memory_order_relaxed);
+      while (value > seen && !maximum.compare_exchange_weak(seen, value, std::memory_order_relaxed))
+      {
+      }
+   }
+
+   // adds the values recorded in other, e.g. to sum up per-thread histograms
+   void merge(const Histogram &other)
+   {
+      for (int i = 0; i < BUCKETS; ++i)
+      {
+         buckets[i] += other.buckets[i].load(std::memory_order_relaxed);
+      }
+      count += other.count.load(std::memory_order_relaxed);
+      sum += other.sum.load(std::memory_order_relaxed);
+      uint64_t otherMaximum = other.maximum.load(std::memory_order_relaxed);
+      if (otherMaximum > maximum)
+      {
+         maximum = otherMaximum;
+      }
+   }
+
+   long total() const { return count; }
+   uint64_t max() const { return maximum; }
+   double mean() const { return count > 0 ? (double)sum / count : 0.0; }
+
+   // exclusive upper bound of the bucket holding the given share (0..1) of
+   // the values, 0 if there are none
+   uint64_t percentile(double share) const
+   {
+      if (count == 0)
+      {
+         return 0;
+      }
+      long wanted = (long)(share * count + 0.5);
+      long seen = 0;
+      for (int i = 0; i < BUCKETS; ++i)
+      {
+         seen += buckets[i];
+         if (seen >= wanted && seen > 0)
+         {
+            return upperBound(i);
+         }
+      }
+      return maximum;
+   }
+
+   // one summary line and one line of non-empty buckets as "<bound>:<count>"
+   void format(std::string &out, const char *name, const char *unit) const
+   {
+      char line[256];
+      long n = count;
+      snprintf(line, sizeof(line), "%s: %ld, mean %.1f %s, p50 <%llu, p99 <%llu, p999 <%llu, max %llu\n",
+               name, n, mean(), unit,
+               (unsigned long long)percentile(0.5),
+               (unsigned long long)percentile(0.99),
+               (unsigned long long)percentile(0.999),
+               (unsigned long long)maximum.load());
+      out += line;
+      if (n == 0)
+      {
+         return;
+      }
+      out += "  ";
+      for (int i = 0; i < BUCKETS; ++i)
+      {
+         if (buckets[i] > 0)
+         {
+            snprintf(line, sizeof(line), " <%llu:%ld", (unsigned long long)upperBound(i), buckets[i].load());
+            out += line;
+         }
+      }
+      out += "\n";
+   }
+
+   void print(const char *name, const char *unit) const
+   {
+      std::string out;
+      format(out, name, unit);
+      fputs(out.c_str(), stdout);
+   }
+
+private:
+   static const int SUB_BITS = 4;
+   static const int SUB_BUCKETS = 1 << SUB_BITS;
+   static const int MAX_BITS = 40;   // larger values share the last bucket
+   static const int BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS;
+
+   // values below 2 * SUB_BUCKETS map to themselves; above, the top
+   // SUB_BITS + 1 bits select the bucket within the power of two
+   static int bucketOf(uint64_t value)
+   {
+      int bits = 64 - __builtin_clzll(value | 1);
+      int shift = bits > SUB_BITS + 1 ? bits - SUB_BITS - 1 : 0;
+      int bucket = shift * SUB_BUCKETS + (int)(value >> shift);
+      return bucket < BUCKETS ? bucket : BUCKETS - 1;
+   }
+
+   static uint64_t upperBound(int bucket)
+   {
+      if (bucket < 2 * SUB_BUCKETS)
+      {
+         return bucket + 1;
+      }
+      int shift = bucket / SUB_BUCKETS - 1;
+      return (uint64_t)(bucket % SUB_BUCKETS + SUB_BUCKETS + 1) << shift;
+   }
+
+   std::atomic<long> buckets[BUCKETS];
+   std::atomic<long> count;
+   std::atomic<uint64_t> sum;
+   std::atomic<uint64_t> maximum;
+};
+
+#endif
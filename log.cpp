@@ -0,0 +1,296 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <chrono>
+#include <thread>
+#include "log.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define LOG_LINE 512          // longer messages are cut off
+#define LOG_CAPACITY 4096     // queued messages, a power of two
+#define LOG_IDLE_MS 10        // writer pause when the ring is empty
+
+// One slot of the ring. sequence tells whose turn it is (Vyukov's bounded
+// queue): position when it is free for the producer that claims position,
+// position + 1 once that producer has filled it, position + LOG_CAPACITY
+// when the writer has taken it again.
+struct LogRecord
+{
+   atomic<uint64_t> sequence;
+   struct timespec time;
+   int level;
+   long suppressed;
+   char text[LOG_LINE];
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+atomic<int> logLevel(LEVEL_INFO);
+bool logBodies = false;
+
+static LogRecord ring[LOG_CAPACITY];
+static atomic<uint64_t> enqueuePosition(0);
+static uint64_t dequeuePosition = 0;   // only the writer thread uses it
+static atomic<long> droppedFull(0);    // messages lost to a full ring
+static atomic<int> ratePerSecond(100);
+
+static LogOptions logOptions;
+static thread writer;
+static atomic<bool> stopping(false);
+static int logFd = STDOUT_FILENO;
+static size_t logSize = 0;
+
+static const char *levelNames[] = {"ERROR", "WARN", "INFO", "DEBUG"};
+
+// the slots start out free for the first LOG_CAPACITY positions
+static bool initRing()
+{
+   for (uint64_t i = 0; i < LOG_CAPACITY; ++i)
+   {
+      ring[i].sequence.store(i, memory_order_relaxed);
+   }
+   return true;
+}
+
+static bool ringReady = initRing();
+
+///////////////////////////////////////////////////////////////////////////////
+
+int parseLogLevel(const string &name)
+{
+   for (int level = LEVEL_ERROR; level <= LEVEL_DEBUG; ++level)
+   {
+      if (strcasecmp(name.c_str(), levelNames[level]) == 0)
+      {
+         return level;
+      }
+   }
+   return -1;
+}
+
+bool LogSite::allow(long &dropped)
+{
+   dropped = 0;
+   int limit = ratePerSecond.load(memory_order_relaxed);
+   if (limit <= 0)
+   {
+      return true;
+   }
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+   long current = second.load(memory_order_relaxed);
+   if (current != now.tv_sec && second.compare_exchange_strong(current, now.tv_sec))
+   {
+      count = 0;
+   }
+   if (count.fetch_add(1, memory_order_relaxed) < limit)
+   {
+      dropped = suppressed.exchange(0, memory_order_relaxed);
+      return true;
+   }
+   suppressed.fetch_add(1, memory_order_relaxed);
+   return false;
+}
+
+// claims a slot, formats into it and publishes it; never waits
+void logMessage(int level, long suppressed, const char *format, ...)
+{
+   uint64_t position = enqueuePosition.load(memory_order_relaxed);
+   LogRecord *record;
+   while (true)
+   {
+      record = &ring[position & (LOG_CAPACITY - 1)];
+      uint64_t sequence = record->sequence.load(memory_order_acquire);
+      int64_t difference = (int64_t)(sequence - position);
+      if (difference == 0)
+      {
+         if (enqueuePosition.compare_exchange_weak(position, position + 1, memory_order_relaxed))
+         {
+            break;
+         }
+      }
+      else if (difference < 0)
+      {
+         droppedFull.fetch_add(1, memory_order_relaxed);
+         return;
+      }
+      else
+      {
+         position = enqueuePosition.load(memory_order_relaxed);
+      }
+   }
+
+   clock_gettime(CLOCK_REALTIME, &record->time);
+   record->level = level;
+   record->suppressed = suppressed;
+   va_list arguments;
+   va_start(arguments, format);
+   vsnprintf(record->text, sizeof(record->text), format, arguments);
+   va_end(arguments);
+   record->sequence.store(position + 1, memory_order_release);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WRITER THREAD
+
+static int openLogFile()
+{
+   struct stat sb;
+   logFd = open(logOptions.file.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+   if (logFd == -1)
+   {
+      return -1;
+   }
+   logSize = fstat(logFd, &sb) == 0 ? sb.st_size : 0;
+   return 0;
+}
+
+// <file> becomes <file>.1, <file>.1 becomes <file>.2 and so on; the oldest
+// falls off the end
+static void rotateLogFile()
+{
+   close(logFd);
+   for (int i = logOptions.keepFiles; i > 0; --i)
+   {
+      string from = i > 1 ? logOptions.file + "." + to_string(i - 1) : logOptions.file;
+      if (rename(from.c_str(), (logOptions.file + "." + to_string(i)).c_str()) == -1 && errno != ENOENT)
+      {
+         perror("rotate log file");
+      }
+   }
+   if (logOptions.keepFiles == 0)
+   {
+      unlink(logOptions.file.c_str());
+   }
+   if (openLogFile() == -1)
+   {
+      // keep logging somewhere rather than losing everything
+      perror("reopen log file");
+      logFd = STDERR_FILENO;
+      logOptions.file.clear();
+   }
+}
+
+static void writeLog(const string &batch)
+{
+   if (!logOptions.file.empty() && logSize > 0 && logSize + batch.size() > logOptions.rotateBytes)
+   {
+      rotateLogFile();
+   }
+   size_t done = 0;
+   while (done < batch.size())
+   {
+      ssize_t written = write(logFd, batch.data() + done, batch.size() - done);
+      if (written == -1)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         return; // nowhere left to report it
+      }
+      done += written;
+   }
+   logSize += batch.size();
+}
+
+static void appendRecord(string &batch, const LogRecord &record)
+{
+   char prefix[64];
+   struct tm local;
+   localtime_r(&record.time.tv_sec, &local);
+   size_t length = strftime(prefix, sizeof(prefix), "%Y-%m-%d %H:%M:%S", &local);
+   snprintf(prefix + length, sizeof(prefix) - length, ".%03ld %-5s ",
+            record.time.tv_nsec / 1000000, levelNames[record.level]);
+   batch += prefix;
+   batch += record.text;
+   if (record.suppressed > 0)
+   {
+      batch += " (" + to_string(record.suppressed) + " similar messages suppressed)";
+   }
+   batch += "\n";
+}
+
+// takes everything the producers published, one write() per pass
+static bool drainRing(string &batch)
+{
+   batch.clear();
+   while (batch.size() < 64 * 1024)
+   {
+      LogRecord &record = ring[dequeuePosition & (LOG_CAPACITY - 1)];
+      if (record.sequence.load(memory_order_acquire) != dequeuePosition + 1)
+      {
+         break;
+      }
+      appendRecord(batch, record);
+      record.sequence.store(dequeuePosition + LOG_CAPACITY, memory_order_release);
+      dequeuePosition++;
+   }
+   long dropped = droppedFull.exchange(0, memory_order_relaxed);
+   if (dropped > 0)
+   {
+      batch += to_string(dropped) + " log messages dropped - queue full\n";
+   }
+   if (batch.empty())
+   {
+      return false;
+   }
+   writeLog(batch);
+   return true;
+}
+
+static void runWriter()
+{
+   string batch;
+   while (!stopping)
+   {
+      if (!drainRing(batch))
+      {
+         this_thread::sleep_for(chrono::milliseconds(LOG_IDLE_MS));
+      }
+   }
+   while (drainRing(batch))
+   {
+   }
+}
+
+int startLogger(const LogOptions &options)
+{
+   logOptions = options;
+   logLevel = options.level;
+   logBodies = options.bodies;
+   ratePerSecond = options.ratePerSecond;
+   if (!logOptions.file.empty() && openLogFile() == -1)
+   {
+      return -1;
+   }
+   (void)ringReady;
+   stopping = false;
+   writer = thread(runWriter);
+   return 0;
+}
+
+void stopLogger()
+{
+   if (!writer.joinable())
+   {
+      return;
+   }
+   stopping = true;
+   writer.join();
+   if (!logOptions.file.empty())
+   {
+      close(logFd);
+      logFd = STDOUT_FILENO;
+   }
+}
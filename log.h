@@ -0,0 +1,80 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stddef.h>
+#include <atomic>
+#include <string>
+
+///////////////////////////////////////////////////////////////////////////////
+// LOGGING
+// LOG(level, format, ...) formats a message into a slot of a lock-free ring
+// and returns; a background thread writes the queued messages to stdout or a
+// rotating log file. Nothing on the request path takes a lock, flushes or
+// waits for the disk. A message above the configured level costs one relaxed
+// load and its arguments are not even evaluated. Every call site may log at
+// most --log-rate messages per second; the ones it drops are counted and
+// reported with the next message it logs. If the ring is full, messages are
+// dropped rather than blocking the caller.
+
+enum LogLevel
+{
+   LEVEL_ERROR,
+   LEVEL_WARN,
+   LEVEL_INFO,
+   LEVEL_DEBUG
+};
+
+struct LogOptions
+{
+   int level;
+   std::string file;     // empty: stdout
+   size_t rotateBytes;   // rotate the file once it reaches this size
+   int keepFiles;        // rotated files kept as <file>.1 .. <file>.<n>
+   int ratePerSecond;    // per call site, 0: unlimited
+   bool bodies;          // log message bodies at debug level
+};
+
+extern std::atomic<int> logLevel;
+extern bool logBodies;
+
+// rate limit of one LOG call site
+class LogSite
+{
+public:
+   LogSite() : second(0), count(0), suppressed(0) {}
+
+   // true if the message may be logged; dropped is set to the messages of
+   // this site that were suppressed since the last one that was logged
+   bool allow(long &dropped);
+
+private:
+   std::atomic<long> second;
+   std::atomic<int> count;
+   std::atomic<long> suppressed;
+};
+
+#define LOG(level, ...)                                        \
+   do                                                          \
+   {                                                           \
+      if ((level) <= logLevel.load(std::memory_order_relaxed)) \
+      {                                                        \
+         static LogSite logSite;                               \
+         long logDropped;                                      \
+         if (logSite.allow(logDropped))                        \
+         {                                                     \
+            logMessage((level), logDropped, __VA_ARGS__);      \
+         }                                                     \
+      }                                                        \
+   } while (0)
+
+void logMessage(int level, long suppressed, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+// LEVEL_* for "error", "warn", "info" or "debug", -1 otherwise
+int parseLogLevel(const std::string &name);
+
+// starts the writer thread; -1 if the log file cannot be opened
+int startLogger(const LogOptions &options);
+// writes everything still queued and stops the writer thread
+void stopLogger();
+
+#endif
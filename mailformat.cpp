@@ -0,0 +1,285 @@
+#include <string.h>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "mailformat.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define CRC_POLYNOMIAL 0xedb88320u   // reflected, as in zlib
+#define MARKER_MESSAGE "MESSAGE"
+#define MARKER_DELETED "DELETED"
+#define MARKER_LENGTH 7
+
+///////////////////////////////////////////////////////////////////////////////
+// RECORDS
+
+// Slicing by 8: table k maps a byte to its CRC after k further zero bytes,
+// so eight bytes are folded in with eight lookups and no dependency chain.
+struct CrcTables
+{
+   uint32_t table[8][256];
+
+   CrcTables()
+   {
+      for (uint32_t i = 0; i < 256; ++i)
+      {
+         uint32_t crc = i;
+         for (int bit = 0; bit < 8; ++bit)
+         {
+            crc = (crc >> 1) ^ (crc & 1 ? CRC_POLYNOMIAL : 0);
+         }
+         table[0][i] = crc;
+      }
+      for (uint32_t i = 0; i < 256; ++i)
+      {
+         for (int k = 1; k < 8; ++k)
+         {
+            table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xff];
+         }
+      }
+   }
+};
+
+static const CrcTables crcTables;
+
+uint32_t crc32(uint32_t crc, const void *data, size_t length)
+{
+   const uint32_t(*table)[256] = crcTables.table;
+   const unsigned char *p = (const unsigned char *)data;
+   crc = ~crc;
+   while (length >= 8)
+   {
+      uint32_t low, high;
+      memcpy(&low, p, 4);
+      memcpy(&high, p + 4, 4);
+      low ^= crc;   // little-endian, like every host the spool is used on
+      crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^
+            table[5][(low >> 16) & 0xff] ^ table[4][low >> 24] ^
+            table[3][high & 0xff] ^ table[2][(high >> 8) & 0xff] ^
+            table[1][(high >> 16) & 0xff] ^ table[0][high >> 24];
+      p += 8;
+      length -= 8;
+   }
+   while (length-- > 0)
+   {
+      crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+   }
+   return ~crc;
+}
+
+bool makeRecord(const string &sender, const string &subject, uint64_t bodyLength, uint32_t bodyCrc,
+                MailRecord &record)
+{
+   uint64_t length = sender.size() + subject.size() + bodyLength;
+   if (length + sizeof(MailRecord) > UINT32_MAX)
+   {
+      return false;
+   }
+   memcpy(record.magic, RECORD_MAGIC, sizeof(record.magic));
+   record.length = length;
+   record.flags = 0;
+   record.senderLength = sender.size();
+   record.subjectLength = subject.size();
+   record.crc = crc32(crc32(bodyCrc, sender.data(), sender.size()), subject.data(), subject.size());
+   return true;
+}
+
+bool validRecord(const char *data, uint64_t available)
+{
+   MailRecord record;
+   if (available < sizeof(record))
+   {
+      return false;
+   }
+   memcpy(&record, data, sizeof(record));
+   if (memcmp(record.magic, RECORD_MAGIC, sizeof(record.magic)) != 0 ||
+       record.length > available - sizeof(record) ||
+       (uint64_t)record.senderLength + record.subjectLength > record.length)
+   {
+      return false;
+   }
+   const char *sender = data + sizeof(record);
+   const char *subject = sender + record.senderLength;
+   const char *body = subject + record.subjectLength;
+   uint32_t crc = crc32(0, body, record.length - record.senderLength - record.subjectLength);
+   crc = crc32(crc, sender, record.senderLength);
+   return crc32(crc, subject, record.subjectLength) == record.crc;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LEGACY FORMAT
+
+typedef const char *(*MarkerSearch)(const char *from, const char *end);
+
+// whether a "\nMESSAGE\n" or "\nDELETED\n" line starts at newline, which
+// has at least MARKER_LENGTH + 2 bytes after it
+static bool isMarker(const char *newline)
+{
+   return newline[MARKER_LENGTH + 1] == '\n' &&
+          (memcmp(newline + 1, MARKER_MESSAGE, MARKER_LENGTH) == 0 ||
+           memcmp(newline + 1, MARKER_DELETED, MARKER_LENGTH) == 0);
+}
+
+// start of the next "\nMESSAGE\n" or "\nDELETED\n" line at or after from, end if none
+static const char *findMarker(const char *from, const char *end)
+{
+   while (end - from > MARKER_LENGTH + 1)
+   {
+      const char *newline = (const char *)memchr(from, '\n', end - from - MARKER_LENGTH - 1);
+      if (newline == NULL)
+      {
+         break;
+      }
+      if (isMarker(newline))
+      {
+         return newline;
+      }
+      from = newline + 1;
+   }
+   return end;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Like findMarker(), a block of positions at a time: a position is a
+// candidate if it holds a newline and so does the byte MARKER_LENGTH + 1
+// further on, which two loads and compares find for the whole block. In
+// text that is rare enough to check the candidates one by one. The last
+// bytes, too few for a block, are left to findMarker().
+__attribute__((target("sse2")))
+static const char *findMarkerSse2(const char *from, const char *end)
+{
+   const __m128i newline = _mm_set1_epi8('\n');
+   while (end - from >= 32 + MARKER_LENGTH + 1)
+   {
+      // two blocks of 16 per round, so most rounds take one branch
+      __m128i low = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)from), newline),
+                                  _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(from + MARKER_LENGTH + 1)), newline));
+      __m128i high = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(from + 16)), newline),
+                                   _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(from + 16 + MARKER_LENGTH + 1)), newline));
+      unsigned mask = _mm_movemask_epi8(low) | (unsigned)_mm_movemask_epi8(high) << 16;
+      for (; mask != 0; mask &= mask - 1)
+      {
+         const char *candidate = from + __builtin_ctz(mask);
+         if (isMarker(candidate))
+         {
+            return candidate;
+         }
+      }
+      from += 32;
+   }
+   return findMarker(from, end);
+}
+
+// the same with blocks of 32
+__attribute__((target("avx2")))
+static const char *findMarkerAvx2(const char *from, const char *end)
+{
+   const __m256i newline = _mm256_set1_epi8('\n');
+   while (end - from >= 64 + MARKER_LENGTH + 1)
+   {
+      __m256i low = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)from), newline),
+                                     _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(from + MARKER_LENGTH + 1)),
+                                                       newline));
+      __m256i high = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(from + 32)), newline),
+                                      _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(from + 32 + MARKER_LENGTH + 1)),
+                                                        newline));
+      uint64_t mask = (uint32_t)_mm256_movemask_epi8(low) | (uint64_t)(uint32_t)_mm256_movemask_epi8(high) << 32;
+      for (; mask != 0; mask &= mask - 1)
+      {
+         const char *candidate = from + __builtin_ctzll(mask);
+         if (isMarker(candidate))
+         {
+            return candidate;
+         }
+      }
+      from += 64;
+   }
+   return findMarkerSse2(from, end);
+}
+#endif
+
+bool scannerSupported(int scanner)
+{
+   switch (scanner)
+   {
+   case SCANNER_BEST:
+   case SCANNER_SCALAR:
+      return true;
+#if defined(__x86_64__) || defined(__i386__)
+   case SCANNER_SSE2:
+      return __builtin_cpu_supports("sse2");
+   case SCANNER_AVX2:
+      return __builtin_cpu_supports("avx2");
+#endif
+   default:
+      return false;
+   }
+}
+
+// the marker search of a scanner; an unsupported one falls back to scalar
+static MarkerSearch markerSearch(int scanner)
+{
+   if (scanner == SCANNER_BEST)
+   {
+      scanner = scannerSupported(SCANNER_AVX2) ? SCANNER_AVX2
+                : scannerSupported(SCANNER_SSE2) ? SCANNER_SSE2 : SCANNER_SCALAR;
+   }
+   if (!scannerSupported(scanner))
+   {
+      return findMarker;
+   }
+   switch (scanner)
+   {
+#if defined(__x86_64__) || defined(__i386__)
+   case SCANNER_SSE2:
+      return findMarkerSse2;
+   case SCANNER_AVX2:
+      return findMarkerAvx2;
+#endif
+   default:
+      return findMarker;
+   }
+}
+
+// only the first line is looked at, which is a marker in every legacy mailbox
+bool legacyMailbox(const char *data, uint64_t size)
+{
+   return size > 0 && findMarker(data, data + min(size, (uint64_t)MARKER_LENGTH + 2)) == data;
+}
+
+void scanLegacyMailbox(const char *data, uint64_t size, const function<void(const LegacyMessage &)> &found,
+                       int scanner)
+{
+   MarkerSearch search = markerSearch(scanner);
+   const char *end = data + size;
+   const char *next = search(data, end);
+   while (next != end)
+   {
+      const char *start = next + 1;
+      next = search(start, end);
+      // a following message has to be preceded by the closing blank line
+      while (next != end && next[-1] != '\n')
+      {
+         next = search(next + 1, end);
+      }
+
+      LegacyMessage message;
+      message.deleted = memcmp(start, MARKER_DELETED, MARKER_LENGTH) == 0;
+      message.sender = start + MARKER_LENGTH + 1;
+      const char *subject = (const char *)memchr(message.sender, '\n', next - message.sender);
+      subject = subject != NULL ? subject + 1 : next;
+      const char *body = (const char *)memchr(subject, '\n', next - subject);
+      body = body != NULL ? body + 1 : next;
+      // the lines without their newlines, the body without the closing one
+      message.senderLength = subject > message.sender ? subject - message.sender - 1 : 0;
+      message.subject = subject;
+      message.subjectLength = body > subject ? body - subject - 1 : 0;
+      message.body = body;
+      message.bodyLength = next > body ? next - body - 1 : 0;
+      found(message);
+   }
+}
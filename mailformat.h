@@ -0,0 +1,92 @@
+#ifndef MAILFORMAT_H
+#define MAILFORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <functional>
+
+///////////////////////////////////////////////////////////////////////////////
+// FLAT MAILBOX FORMAT
+// A flat mailbox is a sequence of records, each a fixed header followed by
+// its payload: the sender, the subject and the body, back to back with
+// their lengths in the header. Nothing in the payload is ever interpreted,
+// so a body may hold any bytes, and a reader gets from one record to the
+// next by its length alone. DEL sets RECORD_DELETED in the flags, the only
+// bytes of a record that change after it was written; compaction later
+// rewrites a deleted record as its header alone, which keeps its place and
+// so the numbers of the messages after it.
+//
+// The CRC covers the payload and lets a scan tell a record from bytes that
+// merely look like one (a torn append, or a body that holds a record). It
+// is a CRC-32 (the one of zlib) taken over the body first and then the
+// sender and the subject, so it can be kept up while a body arrives.
+//
+// Mailboxes written before this format hold "\nMESSAGE\n<sender>\n<subject>
+// \n<body>\n" per message (DELETED in place of MESSAGE once deleted), where
+// a body holding such a line cannot be told from the next message.
+// twmailer-convert rewrites them; the server refuses to use them.
+
+#define RECORD_MAGIC "TWM1"   // the last byte is the format version
+#define RECORD_DELETED 0x1
+
+struct MailRecord
+{
+   char magic[4];
+   uint32_t length;          // of the payload
+   uint32_t flags;
+   uint32_t senderLength;
+   uint32_t subjectLength;
+   uint32_t crc;
+};
+
+static_assert(sizeof(MailRecord) == 24, "mail record layout");
+
+// continues crc over length bytes of data; start with 0
+uint32_t crc32(uint32_t crc, const void *data, size_t length);
+
+// the header of a new record, for a body of bodyLength bytes with the CRC
+// bodyCrc; false if a length does not fit in 32 bits
+bool makeRecord(const std::string &sender, const std::string &subject, uint64_t bodyLength, uint32_t bodyCrc,
+                MailRecord &record);
+// whether data, with available bytes from its start on, holds a complete
+// record whose CRC matches
+bool validRecord(const char *data, uint64_t available);
+
+///////////////////////////////////////////////////////////////////////////////
+// LEGACY FORMAT
+// Legacy mailboxes are split up at their MESSAGE and DELETED lines. The
+// search for them compares 16 (SSE2) or 32 (AVX2) positions of the mapped
+// file at once instead of stopping at every newline, whichever the CPU
+// has. The messages point into the contents, nothing is copied.
+
+enum LegacyScanner
+{
+   SCANNER_BEST,     // the fastest one the CPU runs
+   SCANNER_SCALAR,   // memchr() from newline to newline
+   SCANNER_SSE2,
+   SCANNER_AVX2
+};
+
+// a message of a legacy mailbox, pointing into its contents
+struct LegacyMessage
+{
+   const char *sender;
+   size_t senderLength;
+   const char *subject;
+   size_t subjectLength;
+   const char *body;
+   size_t bodyLength;
+   bool deleted;
+};
+
+// whether the contents are a mailbox in the legacy text format
+bool legacyMailbox(const char *data, uint64_t size);
+// Calls found for every message of a legacy mailbox, in order. A message
+// runs from its MESSAGE line up to the blank line in front of the next one.
+void scanLegacyMailbox(const char *data, uint64_t size, const std::function<void(const LegacyMessage &)> &found,
+                       int scanner = SCANNER_BEST);
+// whether the CPU runs the scanner
+bool scannerSupported(int scanner);
+
+#endif
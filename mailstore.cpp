@@ -0,0 +1,2077 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include "mailstore.h"
+#include "mailformat.h"
+#include "log.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define BUF 1024
+#define INDEX_MAGIC "TWI4"
+
+///////////////////////////////////////////////////////////////////////////////
+
+MailStore *createMailStore(const string &type, const string &spool, const StoreOptions &options)
+{
+   MailStore *store = NULL;
+   if (type == "flat")
+   {
+      store = new FlatStore(spool, options);
+   }
+   else if (type == "maildir")
+   {
+      store = new MaildirStore(spool, options);
+   }
+   if (store != NULL && options.cacheBytes > 0)
+   {
+      store = new CachedStore(store, options.cacheBytes);
+   }
+   return store;
+}
+
+// reads exactly n bytes at offset, -1 on error or short file
+static int readAt(int fd, void *dst, size_t n, off_t offset)
+{
+   char *p = (char *)dst;
+   while (n > 0)
+   {
+      ssize_t got = pread(fd, p, n, offset);
+      if (got == -1 && errno == EINTR)
+      {
+         continue;
+      }
+      if (got <= 0)
+      {
+         return -1;
+      }
+      p += got;
+      n -= got;
+      offset += got;
+   }
+   return 0;
+}
+
+static int writeAt(int fd, const void *src, size_t n, off_t offset)
+{
+   const char *p = (const char *)src;
+   while (n > 0)
+   {
+      ssize_t put = pwrite(fd, p, n, offset);
+      if (put == -1 && errno == EINTR)
+      {
+         continue;
+      }
+      if (put == -1)
+      {
+         return -1;
+      }
+      p += put;
+      n -= put;
+      offset += put;
+   }
+   return 0;
+}
+
+// copies the body a readFile() left in the file into message.body
+static int readBody(const FileRange &body, Message &message)
+{
+   if (!body.file)
+   {
+      return 0;
+   }
+   message.body.resize(body.length);
+   return readAt(body.file->fd, &message.body[0], body.length, body.offset);
+}
+
+// creates a directory unless it already exists
+static int makeDirectory(const string &path)
+{
+   if (mkdir(path.c_str(), 0777) != 0 && errno != EEXIST)
+   {
+      return -1;
+   }
+   return 0;
+}
+
+// Flushes a file or directory to disk; a file that is gone has nothing left
+// to flush. For a directory this makes its entries durable.
+static int syncPath(const string &path)
+{
+   int fd = ::open(path.c_str(), O_RDONLY);
+   if (fd == -1)
+   {
+      return errno == ENOENT ? 0 : -1;
+   }
+   int result = fdatasync(fd);
+   if (result == -1)
+   {
+      perror(("fdatasync " + path).c_str());
+   }
+   close(fd);
+   return result;
+}
+
+// adds a message to the search index of username, if that is loaded, with
+// feed handing its stored text to the scanner; an index that misses it would
+// answer wrong, so it is dropped if the message cannot be read back
+static void indexMessage(SearchIndex &index, const string &username, uint32_t number,
+                         const function<int(TermScanner &)> &feed)
+{
+   if (!index.loaded(username))
+   {
+      return;
+   }
+   TermScanner scanner;
+   if (feed(scanner) == -1)
+   {
+      index.drop(username);
+      return;
+   }
+   index.add(username, number, scanner.finish());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MESSAGE BODIES
+
+string MessageBody::stagingDirectory = "/tmp";
+
+// writes all iovecs at offset, -1 on error
+static int writevAt(int fd, struct iovec *iov, int count, off_t offset)
+{
+   while (count > 0)
+   {
+      ssize_t put = pwritev(fd, iov, count, offset);
+      if (put == -1 && errno == EINTR)
+      {
+         continue;
+      }
+      if (put == -1)
+      {
+         return -1;
+      }
+      offset += put;
+      while (count > 0 && (size_t)put >= iov->iov_len)
+      {
+         put -= iov->iov_len;
+         iov++;
+         count--;
+      }
+      if (count > 0)
+      {
+         iov->iov_base = (char *)iov->iov_base + put;
+         iov->iov_len -= put;
+      }
+   }
+   return 0;
+}
+
+// Copies length bytes from the start of in to out at offset. The kernel
+// moves them between the files itself where it can; across file systems
+// they go through a buffer.
+static int copyFile(int in, int out, uint64_t length, off_t offset)
+{
+   loff_t from = 0;
+   loff_t to = offset;
+   while (length > 0)
+   {
+      ssize_t copied = copy_file_range(in, &from, out, &to, length, 0);
+      if (copied == -1 && errno == EINTR)
+      {
+         continue;
+      }
+      if (copied <= 0)
+      {
+         break;
+      }
+      length -= copied;
+   }
+
+   char buffer[BODY_MEMORY];
+   while (length > 0)
+   {
+      size_t chunk = min(length, (uint64_t)sizeof(buffer));
+      if (readAt(in, buffer, chunk, from) == -1 || writeAt(out, buffer, chunk, to) == -1)
+      {
+         return -1;
+      }
+      from += chunk;
+      to += chunk;
+      length -= chunk;
+   }
+   return 0;
+}
+
+int MessageBody::append(const char *data, size_t length)
+{
+   checksum = crc32(checksum, data, length);
+   if (memory.size() + length > BODY_MEMORY)
+   {
+      if (spill() == -1)
+      {
+         return -1;
+      }
+      if (length > BODY_MEMORY)
+      {
+         if (writeAt(file, data, length, fileLength) == -1)
+         {
+            return -1;
+         }
+         fileLength += length;
+         return 0;
+      }
+   }
+   memory.append(data, length);
+   return 0;
+}
+
+// moves the buffered bytes to the end of the staging file, creating it
+int MessageBody::spill()
+{
+   if (file == -1)
+   {
+      // unnamed, so it disappears with the descriptor even after a crash
+      file = ::open(stagingDirectory.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+      if (file == -1)
+      {
+         return -1;
+      }
+   }
+   if (writeAt(file, memory.data(), memory.size(), fileLength) == -1)
+   {
+      return -1;
+   }
+   fileLength += memory.size();
+   memory.clear();
+   return 0;
+}
+
+void MessageBody::clear()
+{
+   if (file != -1)
+   {
+      close(file);
+      file = -1;
+      fileLength = 0;
+      // a large message should not pin its buffer to an idle connection
+      string().swap(memory);
+   }
+   memory.clear();
+   checksum = 0;
+}
+
+int MessageBody::writeTo(int fd, off_t offset, const string &before, const string &after) const
+{
+   struct iovec iov[3];
+   int count = 0;
+   if (file == -1)
+   {
+      iov[count++] = {(void *)before.data(), before.size()};
+   }
+   else
+   {
+      if (writeAt(fd, before.data(), before.size(), offset) == -1 ||
+          copyFile(file, fd, fileLength, offset + before.size()) == -1)
+      {
+         return -1;
+      }
+      offset += before.size() + fileLength;
+   }
+   iov[count++] = {(void *)memory.data(), memory.size()};
+   iov[count++] = {(void *)after.data(), after.size()};
+   return writevAt(fd, iov, count, offset);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MAILBOX LOCKS
+
+LockManager::LockManager(size_t stripeCount)
+   : stripes(new Stripe[stripeCount]), stripeCount(stripeCount)
+{
+   for (size_t i = 0; i < stripeCount; ++i)
+   {
+      stripes[i].acquisitions = 0;
+      stripes[i].waits = 0;
+      stripes[i].waitMicros = 0;
+      stripes[i].maxWaitMicros = 0;
+   }
+}
+
+// Only acquisitions that find the stripe taken are timed, so the fast path
+// costs no clock reads.
+size_t LockManager::lock(const string &username, bool exclusive)
+{
+   size_t index = hash<string>()(username) % stripeCount;
+   Stripe &stripe = stripes[index];
+   stripe.acquisitions++;
+   if (exclusive ? stripe.mutex.try_lock() : stripe.mutex.try_lock_shared())
+   {
+      return index;
+   }
+
+   auto started = chrono::steady_clock::now();
+   if (exclusive)
+   {
+      stripe.mutex.lock();
+   }
+   else
+   {
+      stripe.mutex.lock_shared();
+   }
+   long waited = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - started).count();
+   stripe.waits++;
+   stripe.waitMicros += waited;
+   long max = stripe.maxWaitMicros.load();
+   while (waited > max && !stripe.maxWaitMicros.compare_exchange_weak(max, waited))
+   {
+   }
+   return index;
+}
+
+void LockManager::unlock(size_t index, bool exclusive)
+{
+   if (exclusive)
+   {
+      stripes[index].mutex.unlock();
+   }
+   else
+   {
+      stripes[index].mutex.unlock_shared();
+   }
+}
+
+void LockManager::counts(long &acquisitions, long &waits)
+{
+   acquisitions = 0;
+   waits = 0;
+   for (size_t i = 0; i < stripeCount; ++i)
+   {
+      acquisitions += stripes[i].acquisitions;
+      waits += stripes[i].waits;
+   }
+}
+
+void LockManager::printStats()
+{
+   long acquisitions, waits;
+   counts(acquisitions, waits);
+   printf("lock stripes %zu, acquisitions %ld, waited %ld\n", stripeCount, acquisitions, waits);
+   if (waits == 0)
+   {
+      return;
+   }
+   printf("%6s %12s %8s %12s %10s\n", "stripe", "acquisitions", "waits", "wait us", "max us");
+   for (size_t i = 0; i < stripeCount; ++i)
+   {
+      const Stripe &stripe = stripes[i];
+      if (stripe.waits > 0)
+      {
+         printf("%6zu %12ld %8ld %12ld %10ld\n", i,
+                stripe.acquisitions.load(),
+                stripe.waits.load(),
+                stripe.waitMicros.load(),
+                stripe.maxWaitMicros.load());
+      }
+   }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FLAT BACKEND
+
+// Recovers the records of a mailbox from its contents, going from one to
+// the next by their lengths. Bytes that are no valid record (what a crash
+// left of an append) are passed over up to the next record; damaged gets
+// how many. -1 with EPROTO for a mailbox in the legacy text format.
+static int scanMailbox(int fd, uint64_t size, vector<IndexRecord> &records, uint64_t &damaged)
+{
+   records.clear();
+   damaged = 0;
+   if (size == 0)
+   {
+      return 0;
+   }
+
+   void *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+   if (mapped == MAP_FAILED)
+   {
+      perror("mmap mailbox");
+      return -1;
+   }
+   const char *data = (const char *)mapped;
+   if (legacyMailbox(data, size))
+   {
+      munmap(mapped, size);
+      errno = EPROTO;
+      return -1;
+   }
+
+   uint64_t position = 0;
+   while (position < size)
+   {
+      if (!validRecord(data + position, size - position))
+      {
+         const char *next = (const char *)memmem(data + position + 1, size - position - 1,
+                                                 RECORD_MAGIC, strlen(RECORD_MAGIC));
+         uint64_t skipped = (next != NULL ? next - data : size) - position;
+         damaged += skipped;
+         position += skipped;
+         continue;
+      }
+      MailRecord header;
+      memcpy(&header, data + position, sizeof(header));
+      IndexRecord record = {};
+      record.offset = position;
+      record.length = sizeof(header) + header.length;
+      record.subjectOffset = sizeof(header) + header.senderLength;
+      record.bodyOffset = record.subjectOffset + header.subjectLength;
+      record.flags = header.flags & RECORD_DELETED;
+      records.push_back(record);
+      position += record.length;
+   }
+
+   munmap(mapped, size);
+   return 0;
+}
+
+// the version of the mailbox an index header is valid for
+static void describeMailbox(const struct stat &sb, IndexHeader &header)
+{
+   header.mailboxSize = sb.st_size;
+   header.mailboxInode = sb.st_ino;
+   header.mailboxMtime = (uint64_t)sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec;
+}
+
+// reads the sender and subject of a record, never the body
+static int readRecordHead(int fd, const IndexRecord &record, string &sender, string &subject)
+{
+   size_t start = sizeof(MailRecord);
+   string head(record.bodyOffset > start ? record.bodyOffset - start : 0, '\0');
+   if (readAt(fd, &head[0], head.size(), record.offset + start) == -1)
+   {
+      return -1;
+   }
+   size_t split = record.subjectOffset > start ? min(record.subjectOffset - start, head.size()) : 0;
+   sender.assign(head, 0, split);
+   subject.assign(head, split, string::npos);
+   return 0;
+}
+
+// what compacting a deleted record gives back: all but its header, which
+// stays behind as a tombstone holding the place of its number
+static uint64_t deadLength(const IndexRecord &record)
+{
+   return record.length > sizeof(MailRecord) ? record.length - sizeof(MailRecord) : 0;
+}
+
+// feeds the sender, subject and body of a record to scanner
+static int feedRecord(TermScanner &scanner, int fd, const IndexRecord &record)
+{
+   const uint32_t parts[] = {(uint32_t)sizeof(MailRecord), record.subjectOffset, record.bodyOffset, record.length};
+   for (int i = 0; i < 3; ++i)
+   {
+      if (scanner.feedFile(fd, record.offset + parts[i], parts[i + 1] - parts[i]) == -1)
+      {
+         return -1;
+      }
+      // nothing separates them on disk, but a term must not run across
+      scanner.feed("\n", 1);
+   }
+   return 0;
+}
+
+static int readIndexRecord(int indexFd, uint32_t position, IndexRecord &record)
+{
+   return readAt(indexFd, &record, sizeof(record), sizeof(IndexHeader) + (off_t)position * sizeof(IndexRecord));
+}
+
+// Adds the live ones among records, the first being message number first,
+// to messages: count of them at most, after passing over skip.
+static int summarizeRecords(int fd, const vector<IndexRecord> &records, uint32_t first, size_t skip, size_t count,
+                            vector<MessageSummary> &messages)
+{
+   for (uint32_t i = 0; i < records.size() && count > 0; ++i)
+   {
+      const IndexRecord &record = records[i];
+      if (record.flags & RECORD_DELETED)
+      {
+         continue;
+      }
+      if (skip > 0)
+      {
+         skip--;
+         continue;
+      }
+      MessageSummary summary;
+      summary.number = first + i;
+      if (readRecordHead(fd, record, summary.sender, summary.subject) == -1)
+      {
+         return -1;
+      }
+      summary.offset = record.offset;
+      summary.size = record.length;
+      messages.push_back(summary);
+      count--;
+   }
+   return 0;
+}
+
+// LIST SINCE generations of new indexes; the clock keeps them apart across
+// restarts
+static uint64_t newGeneration()
+{
+   return chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+FlatStore::FlatStore(const string &spool, const StoreOptions &options)
+   : layout(spool, options.layout), compactRatio(options.compactRatio), durable(options.durable),
+     locks(options.lockStripes), searchIndex(options.searchBytes), stopping(false)
+{
+   stats.runs = 0;
+   stats.bytesReclaimed = 0;
+   stats.bytesRewritten = 0;
+   stats.microseconds = 0;
+}
+
+// pending compactions are dropped, the next DEL queues them again
+FlatStore::~FlatStore()
+{
+   if (compactor.joinable())
+   {
+      {
+         lock_guard<mutex> lock(compactMutex);
+         stopping = true;
+         compactWakeup.notify_one();
+      }
+      compactor.join();
+   }
+}
+
+// the index directories are created along with the first index in them
+int FlatStore::open()
+{
+   if (layout.open() == -1)
+   {
+      return -1;
+   }
+   compactor = thread(&FlatStore::runCompactor, this);
+   return 0;
+}
+
+string FlatStore::mailboxPath(const string &username)
+{
+   return layout.userPath(username);
+}
+
+string FlatStore::indexPath(const string &username)
+{
+   return layout.indexPath(username);
+}
+
+// A temporary file next to path, named "." + its name + suffix. No user can
+// be called that (see SpoolLayout::validUser), so it never clobbers another
+// user's mailbox or index, and a migration passes it over.
+static string hiddenPath(const string &path, const string &suffix)
+{
+   size_t slash = path.rfind('/');
+   return path.substr(0, slash + 1) + "." + path.substr(slash + 1) + suffix;
+}
+
+// Replaces the index of username with records describing the open mailbox.
+// The LIST SINCE state of previous is carried over if given, otherwise the
+// index starts a new generation.
+int FlatStore::storeIndex(const string &username, int mailboxFd, const vector<IndexRecord> &records, IndexHeader &header,
+                          const IndexHeader *previous)
+{
+   struct stat sb;
+   if (fstat(mailboxFd, &sb) == -1)
+   {
+      return -1;
+   }
+
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+   header.recordCount = records.size();
+   header.generation = newGeneration();
+   if (previous != NULL)
+   {
+      header.generation = previous->generation;
+      header.sequence = previous->sequence;
+      header.deletionCount = previous->deletionCount;
+      memcpy(header.deletions, previous->deletions, sizeof(header.deletions));
+   }
+   describeMailbox(sb, header);
+   for (const IndexRecord &record : records)
+   {
+      if (record.flags & RECORD_DELETED)
+      {
+         header.deadBytes += deadLength(record);
+      }
+   }
+
+   // Written aside and renamed so a reader never sees half an index. Readers
+   // of a mailbox may rebuild it at the same time, each into its own file.
+   string path = indexPath(username);
+   string tempPath = hiddenPath(path, ".tmp." + to_string(hash<thread::id>()(this_thread::get_id())));
+   int fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+   if (fd == -1 && errno == ENOENT && layout.prepare(tempPath) == 0)
+   {
+      fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+   }
+   if (fd == -1)
+   {
+      perror("create index");
+      return -1;
+   }
+   if (writeAt(fd, &header, sizeof(header), 0) == -1 ||
+       writeAt(fd, records.data(), records.size() * sizeof(IndexRecord), sizeof(header)) == -1)
+   {
+      perror("write index");
+      close(fd);
+      unlink(tempPath.c_str());
+      return -1;
+   }
+   close(fd);
+   if (rename(tempPath.c_str(), path.c_str()) == -1)
+   {
+      perror("rename index");
+      unlink(tempPath.c_str());
+      return -1;
+   }
+   return 0;
+}
+
+// replaces the index of username with a freshly scanned one
+int FlatStore::rebuildIndex(const string &username, int mailboxFd, IndexHeader &header)
+{
+   struct stat sb;
+   if (fstat(mailboxFd, &sb) == -1)
+   {
+      return -1;
+   }
+
+   vector<IndexRecord> records;
+   uint64_t damaged;
+   if (scanMailbox(mailboxFd, sb.st_size, records, damaged) == -1)
+   {
+      if (errno == EPROTO)
+      {
+         LOG(LEVEL_ERROR, "Mailbox of %s is in the legacy text format - convert the spool with twmailer-convert",
+             username.c_str());
+      }
+      return -1;
+   }
+   if (storeIndex(username, mailboxFd, records, header) == -1)
+   {
+      return -1;
+   }
+
+   // the mailbox changed behind the store's back
+   searchIndex.drop(username);
+   if (damaged > 0)
+   {
+      LOG(LEVEL_WARN, "Mailbox of %s holds %llu damaged bytes, passed over", username.c_str(),
+          (unsigned long long)damaged);
+   }
+   LOG(LEVEL_INFO, "Rebuilt index of %s: %u messages", username.c_str(), header.recordCount);
+   return 0;
+}
+
+// Opens the index belonging to the open mailbox, rebuilding it first when it
+// is missing, damaged or describes a different version of the mailbox (size
+// changes with appends, mtime with tombstones, the inode with compaction).
+int FlatStore::openIndex(const string &username, int mailboxFd, IndexHeader &header)
+{
+   struct stat sb;
+   if (fstat(mailboxFd, &sb) == -1)
+   {
+      return -1;
+   }
+   IndexHeader current;
+   describeMailbox(sb, current);
+
+   string path = indexPath(username);
+   for (int attempt = 0; attempt < 2; ++attempt)
+   {
+      int fd = ::open(path.c_str(), O_RDWR);
+      if (fd != -1)
+      {
+         struct stat ib;
+         if (readAt(fd, &header, sizeof(header), 0) == 0 &&
+             memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) == 0 &&
+             header.mailboxSize == current.mailboxSize &&
+             header.mailboxInode == current.mailboxInode &&
+             header.mailboxMtime == current.mailboxMtime &&
+             fstat(fd, &ib) == 0 &&
+             (uint64_t)ib.st_size == sizeof(header) + (uint64_t)header.recordCount * sizeof(IndexRecord))
+         {
+            return fd;
+         }
+         close(fd);
+      }
+      if (attempt == 0 && rebuildIndex(username, mailboxFd, header) == -1)
+      {
+         return -1;
+      }
+   }
+   return -1;
+}
+
+// resolves a 1-based message number to its record
+int FlatStore::findMessage(int indexFd, const IndexHeader &header, uint32_t number, IndexRecord &record)
+{
+   if (number < 1 || number > header.recordCount)
+   {
+      return STORE_NO_MESSAGE;
+   }
+   if (readIndexRecord(indexFd, number - 1, record) == -1)
+   {
+      return -1;
+   }
+   if (record.flags & RECORD_DELETED)
+   {
+      return STORE_NO_MESSAGE;
+   }
+   return 0;
+}
+
+int FlatStore::append(const string &username, const string &sender, const string &subject, const MessageBody &body)
+{
+   // records hold their lengths in 32 bits
+   MailRecord mailRecord;
+   if (!makeRecord(sender, subject, body.size(), body.crc(), mailRecord))
+   {
+      errno = EFBIG;
+      return -1;
+   }
+   MailboxLock lock(locks, username, true);
+
+   // no O_APPEND: the lock makes the end known, and copy_file_range()
+   // refuses appending descriptors
+   string path = mailboxPath(username);
+   int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0666);
+   if (fd == -1 && errno == ENOENT && !path.empty() && layout.prepare(path) == 0)
+   {
+      fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0666);
+   }
+   if (fd == -1)
+   {
+      return -1;
+   }
+   IndexHeader header;
+   int indexFd = openIndex(username, fd, header);
+   if (indexFd == -1)
+   {
+      close(fd);
+      return -1;
+   }
+
+   string head((const char *)&mailRecord, sizeof(mailRecord));
+   head += sender;
+   head += subject;
+   uint64_t size = head.size() + body.size();
+   IndexRecord record = {};
+   record.offset = header.mailboxSize;
+   record.length = size;
+   record.subjectOffset = sizeof(mailRecord) + sender.size();
+   record.bodyOffset = record.subjectOffset + subject.size();
+   record.sequence = ++header.sequence;
+
+   int result = -1;
+   struct stat sb;
+   if (body.writeTo(fd, header.mailboxSize, head, "") == 0 && fstat(fd, &sb) == 0)
+   {
+      // the record goes in before the header accepts it, so a crash in
+      // between only leaves a stale index that is rebuilt on next use
+      off_t recordPosition = sizeof(header) + (off_t)header.recordCount * sizeof(IndexRecord);
+      header.recordCount++;
+      describeMailbox(sb, header);
+      if (writeAt(indexFd, &record, sizeof(record), recordPosition) == 0 &&
+          writeAt(indexFd, &header, sizeof(header), 0) == 0)
+      {
+         result = 0;
+      }
+   }
+   if (result == 0)
+   {
+      // sender, subject and body, read back from the page cache
+      indexMessage(searchIndex, username, header.recordCount,
+                   [&](TermScanner &scanner) { return feedRecord(scanner, fd, record); });
+   }
+   close(indexFd);
+   close(fd);
+
+   // the directory entry of a new mailbox has to be synced as well
+   if (result == 0 && durable && header.mailboxSize == size)
+   {
+      lock_guard<mutex> lock(syncMutex);
+      newMailboxes.insert(username);
+   }
+   return result;
+}
+
+int FlatStore::list(const string &username, vector<MessageSummary> &messages)
+{
+   MailboxLock lock(locks, username, false);
+
+   int fd = ::open(mailboxPath(username).c_str(), O_RDONLY);
+   if (fd == -1)
+   {
+      return -1;
+   }
+   IndexHeader header;
+   int indexFd = openIndex(username, fd, header);
+   if (indexFd == -1)
+   {
+      close(fd);
+      return -1;
+   }
+
+   vector<IndexRecord> records(header.recordCount);
+   int result = readAt(indexFd, records.data(), records.size() * sizeof(IndexRecord), sizeof(header));
+   if (result == 0)
+   {
+      result = summarizeRecords(fd, records, 1, 0, records.size(), messages);
+   }
+   close(indexFd);
+   close(fd);
+   return result;
+}
+
+// all records are read, but only the heads of the page
+int FlatStore::listPage(const string &username, size_t offset, size_t count,
+                        vector<MessageSummary> &messages, size_t &total)
+{
+   MailboxLock lock(locks, username, false);
+
+   int fd = ::open(mailboxPath(username).c_str(), O_RDONLY);
+   if (fd == -1)
+   {
+      return -1;
+   }
+   IndexHeader header;
+   int indexFd = openIndex(username, fd, header);
+   if (indexFd == -1)
+   {
+      close(fd);
+      return -1;
+   }
+
+   vector<IndexRecord> records(header.recordCount);
+   int result = readAt(indexFd, records.data(), records.size() * sizeof(IndexRecord), sizeof(header));
+   total = 0;
+   for (const IndexRecord &record : records)
+   {
+      total += (record.flags & RECORD_DELETED) ? 0 : 1;
+   }
+   if (result == 0)
+   {
+      result = summarizeRecords(fd, records, 1, offset, count, messages);
+   }
+   close(indexFd);
+   close(fd);
+   return result;
+}
+
+// Record sequences ascend with the message numbers, so the messages appended
+// since the token follow the last record the token had seen. Its deletes are
+// in the header unless more than DELETION_LOG happened since.
+int FlatStore::listChanges(const string &username, const SyncToken &since, MailboxChanges &changes)
+{
+   MailboxLock lock(locks, username, false);
+
+   int fd = ::open(mailboxPath(username).c_str(), O_RDONLY);
+   if (fd == -1)
+   {
+      return -1;
+   }
+   IndexHeader header;
+   int indexFd = openIndex(username, fd, header);
+   if (indexFd == -1)
+   {
+      close(fd);
+      return -1;
+   }
+   changes.token.generation = header.generation;
+   changes.token.sequence = header.sequence;
+
+   const IndexDeletion &oldest = header.deletions[header.deletionCount % DELETION_LOG];
+   changes.reset = since.generation != header.generation || since.sequence > header.sequence ||
+                   (header.deletionCount > DELETION_LOG && since.sequence < oldest.sequence);
+
+   // the first record appended after the token
+   uint32_t first = 0;
+   int result = 0;
+   if (!changes.reset && since.sequence < header.sequence)
+   {
+      uint32_t end = header.recordCount;
+      while (first < end)
+      {
+         uint32_t middle = first + (end - first) / 2;
+         IndexRecord record;
+         if (readIndexRecord(indexFd, middle, record) == -1)
+         {
+            result = -1;
+            break;
+         }
+         if (record.sequence > since.sequence)
+         {
+            end = middle;
+         }
+         else
+         {
+            first = middle + 1;
+         }
+      }
+   }
+   else if (!changes.reset)
+   {
+      first = header.recordCount;
+   }
+
+   vector<IndexRecord> records(header.recordCount - first);
+   if (result == 0)
+   {
+      result = readAt(indexFd, records.data(), records.size() * sizeof(IndexRecord),
+                      sizeof(header) + (off_t)first * sizeof(IndexRecord));
+   }
+   if (result == 0)
+   {
+      result = summarizeRecords(fd, records, first + 1, 0, records.size(), changes.added);
+   }
+   for (uint64_t i = header.deletionCount > DELETION_LOG ? header.deletionCount - DELETION_LOG : 0;
+        !changes.reset && i < header.deletionCount; ++i)
+   {
+      const IndexDeletion &deletion = header.deletions[i % DELETION_LOG];
+      // messages appended after the token were never seen by the client
+      if (deletion.sequence > since.sequence && deletion.number <= first)
+      {
+         changes.deleted.push_back(deletion.number);
+      }
+   }
+   sort(changes.deleted.begin(), changes.deleted.end());
+   close(indexFd);
+   close(fd);
+   return result;
+}
+
+int FlatStore::read(const string &username, uint32_t number, Message &message)
+{
+   FileRange body;
+   int result = readFile(username, number, message, body);
+   return result == 0 ? readBody(body, message) : result;
+}
+
+int FlatStore::readFile(const string &username, uint32_t number, Message &message, FileRange &body)
+{
+   MailboxLock lock(locks, username, false);
+
+   int fd = ::open(mailboxPath(username).c_str(), O_RDONLY);
+   if (fd == -1)
+   {
+      return -1;
+   }
+   IndexHeader header;
+   int indexFd = openIndex(username, fd, header);
+   if (indexFd == -1)
+   {
+      close(fd);
+      return -1;
+   }
+
+   // look the message up instead of scanning for it
+   IndexRecord record;
+   int result = findMessage(indexFd, header, number, record);
+   close(indexFd);
+   if (result == 0)
+   {
+      result = readRecordHead(fd, record, message.sender, message.subject);
+   }
+   if (result != 0)
+   {
+      close(fd);
+      return result;
+   }
+
+   // appends, deletes and compaction never touch these bytes of the open file
+   message.body.clear();
+   body.file = make_shared<FileHandle>(fd);
+   body.offset = record.offset + record.bodyOffset;
+   body.length = record.length > record.bodyOffset ? record.length - record.bodyOffset : 0;
+   return 0;
+}
+
+int FlatStore::remove(const string &username, uint32_t number)
+{
+   MailboxLock lock(locks, username, true);
+
+   int fd = ::open(mailboxPath(username).c_str(), O_RDWR);
+   if (fd == -1)
+   {
+      return -1;
+   }
+   IndexHeader header;
+   int indexFd = openIndex(username, fd, header);
+   if (indexFd == -1)
+   {
+      close(fd);
+      return -1;
+   }
+   IndexRecord record;
+   int result = findMessage(indexFd, header, number, record);
+
+   // only flags the mail record; the bytes stay in place until the compactor
+   // rewrites the mailbox
+   struct stat sb;
+   uint32_t flags = RECORD_DELETED;
+   if (result == 0 &&
+       (writeAt(fd, &flags, sizeof(flags), record.offset + offsetof(MailRecord, flags)) == -1 ||
+        fstat(fd, &sb) == -1))
+   {
+      result = -1;
+   }
+   if (result == 0)
+   {
+      record.flags |= RECORD_DELETED;
+      header.deadBytes += deadLength(record);
+      header.sequence++;
+      IndexDeletion &deletion = header.deletions[header.deletionCount++ % DELETION_LOG];
+      deletion.sequence = header.sequence;
+      deletion.number = number;
+      describeMailbox(sb, header);
+      if (writeAt(indexFd, &record, sizeof(record), sizeof(header) + (off_t)(number - 1) * sizeof(IndexRecord)) == -1 ||
+          writeAt(indexFd, &header, sizeof(header), 0) == -1)
+      {
+         result = -1;
+      }
+   }
+   close(indexFd);
+   close(fd);
+   if (result == 0)
+   {
+      searchIndex.remove(username, number);
+   }
+
+   if (result == 0 && header.deadBytes >= compactRatio * header.mailboxSize)
+   {
+      requestCompaction(username);
+   }
+   return result;
+}
+
+int FlatStore::search(const string &username, const vector<string> &terms, vector<MessageSummary> &messages)
+{
+   MailboxLock lock(locks, username, false);
+
+   int fd = ::open(mailboxPath(username).c_str(), O_RDONLY);
+   if (fd == -1)
+   {
+      return -1;
+   }
+   IndexHeader header;
+   int indexFd = openIndex(username, fd, header);
+   if (indexFd == -1)
+   {
+      close(fd);
+      return -1;
+   }
+
+   // a first search indexes every live message; the lock keeps appends out
+   vector<uint32_t> numbers;
+   int result = searchIndex.search(username, terms, numbers, [&](Postings &postings) {
+      vector<IndexRecord> records(header.recordCount);
+      if (readAt(indexFd, records.data(), records.size() * sizeof(IndexRecord), sizeof(header)) == -1)
+      {
+         return -1;
+      }
+      TermScanner scanner;
+      for (uint32_t i = 0; i < records.size(); ++i)
+      {
+         const IndexRecord &record = records[i];
+         if (record.flags & RECORD_DELETED)
+         {
+            continue;
+         }
+         scanner.clear();
+         if (feedRecord(scanner, fd, record) == -1)
+         {
+            return -1;
+         }
+         postings.add(i + 1, scanner.finish());
+      }
+      return 0;
+   });
+
+   // many matches take the records in one read, a few one at a time
+   vector<IndexRecord> records;
+   if (result == 0 && numbers.size() > header.recordCount / 64)
+   {
+      records.resize(header.recordCount);
+      result = readAt(indexFd, records.data(), records.size() * sizeof(IndexRecord), sizeof(header));
+   }
+   for (size_t i = 0; result == 0 && i < numbers.size(); ++i)
+   {
+      IndexRecord record;
+      MessageSummary summary;
+      if (!records.empty())
+      {
+         if (numbers[i] > records.size() || (records[numbers[i] - 1].flags & RECORD_DELETED))
+         {
+            continue;
+         }
+         record = records[numbers[i] - 1];
+      }
+      else if (findMessage(indexFd, header, numbers[i], record) != 0)
+      {
+         continue;
+      }
+      summary.number = numbers[i];
+      result = readRecordHead(fd, record, summary.sender, summary.subject);
+      summary.offset = record.offset;
+      summary.size = record.length;
+      messages.push_back(summary);
+   }
+   close(indexFd);
+   close(fd);
+   return result;
+}
+
+// Runs without the mailbox lock: appends may go on meanwhile, and a mailbox
+// compacted since the append was synced before it was renamed into place.
+// The index is not synced, a stale one is rebuilt after a crash.
+int FlatStore::sync(const string &username)
+{
+   bool created;
+   {
+      lock_guard<mutex> lock(syncMutex);
+      created = newMailboxes.erase(username) > 0;
+   }
+   string path = mailboxPath(username);
+   if (syncPath(path) == -1 || (created && layout.syncParents(path) == -1))
+   {
+      return -1;
+   }
+   return 0;
+}
+
+void FlatStore::printStats()
+{
+   printf("compactions %ld, reclaimed %ld bytes, rewritten %ld bytes, %ld us\n",
+          stats.runs.load(),
+          stats.bytesReclaimed.load(),
+          stats.bytesRewritten.load(),
+          stats.microseconds.load());
+   locks.printStats();
+   searchIndex.printStats();
+   layout.printStats();
+}
+
+void FlatStore::addStats(StoreStats &total)
+{
+   long acquisitions, waits;
+   size_t indexBytes, mailboxes;
+   locks.counts(acquisitions, waits);
+   searchIndex.usage(indexBytes, mailboxes);
+   total.compactions += stats.runs;
+   total.reclaimedBytes += stats.bytesReclaimed;
+   total.lockAcquisitions += acquisitions;
+   total.lockWaits += waits;
+   total.searchBytes += indexBytes;
+   total.searchMailboxes += mailboxes;
+}
+
+// queues a mailbox for the compactor thread
+void FlatStore::requestCompaction(const string &username)
+{
+   lock_guard<mutex> lock(compactMutex);
+   compactQueue.insert(username);
+   compactWakeup.notify_one();
+}
+
+void FlatStore::runCompactor()
+{
+   unique_lock<mutex> lock(compactMutex);
+   while (!stopping)
+   {
+      if (compactQueue.empty())
+      {
+         compactWakeup.wait(lock);
+         continue;
+      }
+      string username = *compactQueue.begin();
+      compactQueue.erase(compactQueue.begin());
+      lock.unlock();
+      compact(username);
+      lock.lock();
+   }
+}
+
+// The new file is built in the index directory and renamed over the
+// mailbox, so the mailbox never disappears and a crash leaves either the
+// old or the new version. A deleted message shrinks to the header of its
+// record, flagged deleted and without payload, so every message keeps its
+// position and with it its number, and the index stays valid for the
+// search index and for LIST SINCE tokens.
+int FlatStore::compact(const string &username)
+{
+   auto started = chrono::steady_clock::now();
+   MailboxLock lock(locks, username, true);
+
+   string path = mailboxPath(username);
+   int fd = ::open(path.c_str(), O_RDONLY);
+   if (fd == -1)
+   {
+      return -1;
+   }
+   IndexHeader header;
+   int indexFd = openIndex(username, fd, header);
+   if (indexFd == -1)
+   {
+      close(fd);
+      return -1;
+   }
+   vector<IndexRecord> records(header.recordCount);
+   int result = readAt(indexFd, records.data(), records.size() * sizeof(IndexRecord), sizeof(header));
+   close(indexFd);
+   if (result == -1 || header.deadBytes == 0)
+   {
+      close(fd);
+      return result;
+   }
+
+   string tempPath = hiddenPath(indexPath(username), ".compact");
+   int tempFd = ::open(tempPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+   if (tempFd == -1)
+   {
+      perror("create compacted mailbox");
+      close(fd);
+      return -1;
+   }
+
+   MailRecord tombstone;
+   makeRecord("", "", 0, 0, tombstone);
+   tombstone.flags = RECORD_DELETED;
+   vector<IndexRecord> moved;
+   string message;
+   uint64_t written = 0;
+   size_t kept = 0;
+   for (const IndexRecord &record : records)
+   {
+      IndexRecord move = record;
+      move.offset = written;
+      if (record.flags & RECORD_DELETED)
+      {
+         message.assign((const char *)&tombstone, sizeof(tombstone));
+         move.length = move.subjectOffset = move.bodyOffset = sizeof(tombstone);
+      }
+      else
+      {
+         message.resize(record.length);
+         if (readAt(fd, &message[0], message.size(), record.offset) == -1)
+         {
+            result = -1;
+            break;
+         }
+         kept++;
+      }
+      if (writeAt(tempFd, message.data(), message.size(), written) == -1)
+      {
+         result = -1;
+         break;
+      }
+      moved.push_back(move);
+      written += message.size();
+   }
+   close(fd);
+
+   // the data has to be on disk before the rename makes it the mailbox
+   if (result == 0 && fdatasync(tempFd) == -1)
+   {
+      result = -1;
+   }
+   if (result == 0 && rename(tempPath.c_str(), path.c_str()) == -1)
+   {
+      perror("rename compacted mailbox");
+      result = -1;
+   }
+   if (result == -1)
+   {
+      close(tempFd);
+      unlink(tempPath.c_str());
+      return -1;
+   }
+
+   // the rename itself, or acknowledged appends to the new file could be lost
+   if (durable)
+   {
+      syncPath(path.substr(0, path.rfind('/')));
+   }
+
+   // a failure here only leaves a stale index, which is rebuilt on next use
+   IndexHeader compacted;
+   storeIndex(username, tempFd, moved, compacted, &header);
+   close(tempFd);
+   // the numbers stay, but cached offsets and sizes do not
+   notifyChanged(username);
+
+   long elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - started).count();
+   stats.runs++;
+   stats.bytesReclaimed += header.mailboxSize - written;
+   stats.bytesRewritten += written;
+   stats.microseconds += elapsed;
+   LOG(LEVEL_INFO, "Compacted %s: kept %zu of %u messages, reclaimed %llu bytes in %ld us",
+       username.c_str(), kept, header.recordCount,
+       (unsigned long long)(header.mailboxSize - written), elapsed);
+   return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MAILDIR BACKEND
+
+MaildirStore::MaildirStore(const string &spool, const StoreOptions &options)
+   : layout(spool, options.layout), durable(options.durable), generation(newGeneration()),
+     searchIndex(options.searchBytes)
+{
+}
+
+int MaildirStore::open()
+{
+   return layout.open();
+}
+
+void MaildirStore::printStats()
+{
+   searchIndex.printStats();
+   layout.printStats();
+}
+
+void MaildirStore::addStats(StoreStats &total)
+{
+   size_t indexBytes, mailboxes;
+   searchIndex.usage(indexBytes, mailboxes);
+   total.searchBytes += indexBytes;
+   total.searchMailboxes += mailboxes;
+}
+
+string MaildirStore::userPath(const string &username)
+{
+   return layout.userPath(username);
+}
+
+string MaildirStore::messagePath(const string &username, uint32_t number)
+{
+   return userPath(username) + "/new/" + to_string(number);
+}
+
+// the numbers of all messages in new/, ascending; -1 for an unknown user
+int MaildirStore::scanNumbers(const string &username, vector<uint32_t> &numbers)
+{
+   DIR *dir = opendir((userPath(username) + "/new").c_str());
+   if (dir == NULL)
+   {
+      return -1;
+   }
+   struct dirent *entry;
+   while ((entry = readdir(dir)) != NULL)
+   {
+      char *end;
+      unsigned long number = strtoul(entry->d_name, &end, 10);
+      if (entry->d_name[0] >= '1' && entry->d_name[0] <= '9' && *end == '\0')
+      {
+         numbers.push_back(number);
+      }
+   }
+   closedir(dir);
+   sort(numbers.begin(), numbers.end());
+   return 0;
+}
+
+// Reads the sender and subject lines at the start of a message file, which
+// are followed by the body at bodyOffset; the body itself is not read.
+static int readHead(int fd, string &sender, string &subject, uint64_t &bodyOffset, uint64_t &size)
+{
+   struct stat sb;
+   if (fstat(fd, &sb) == -1)
+   {
+      return -1;
+   }
+   size = sb.st_size;
+
+   char buffer[BUF];
+   string head;
+   size_t senderEnd = string::npos, subjectEnd = string::npos;
+   while (subjectEnd == string::npos && head.size() < size)
+   {
+      ssize_t got = pread(fd, buffer, sizeof(buffer), head.size());
+      if (got <= 0)
+      {
+         return -1;
+      }
+      head.append(buffer, got);
+      senderEnd = head.find('\n');
+      if (senderEnd != string::npos)
+      {
+         subjectEnd = head.find('\n', senderEnd + 1);
+      }
+   }
+   senderEnd = min(senderEnd, head.size());
+   subjectEnd = min(subjectEnd, head.size());
+   size_t subjectStart = min(senderEnd + 1, head.size());
+   sender.assign(head, 0, senderEnd);
+   subject.assign(head, subjectStart, subjectEnd - subjectStart);
+   bodyOffset = min((uint64_t)subjectEnd + 1, size);
+   return 0;
+}
+
+uint32_t MaildirStore::nextNumber(const string &username)
+{
+   lock_guard<mutex> lock(numberMutex);
+   return nextEntry(username)++;
+}
+
+// The next number of username, on first use the one after the highest on
+// disk or the one in <user>/.next, whichever is larger; numberMutex held.
+uint32_t &MaildirStore::nextEntry(const string &username)
+{
+   auto found = nextNumbers.find(username);
+   if (found != nextNumbers.end())
+   {
+      return found->second;
+   }
+   vector<uint32_t> numbers;
+   scanNumbers(username, numbers);
+   uint32_t next = numbers.empty() ? 1 : numbers.back() + 1;
+
+   uint32_t saved = 0;
+   int fd = ::open((userPath(username) + "/.next").c_str(), O_RDONLY);
+   if (fd != -1)
+   {
+      char text[16] = "";
+      ssize_t size = ::read(fd, text, sizeof(text) - 1);
+      close(fd);
+      text[size > 0 ? size : 0] = '\0';
+      saved = strtoul(text, NULL, 10);
+   }
+   savedNumbers[username] = saved;
+   return nextNumbers.emplace(username, max(next, saved)).first->second;
+}
+
+// replaces <user>/.next with number, through tmp/ like a message; numberMutex held
+int MaildirStore::saveNextNumber(const string &username, uint32_t number)
+{
+   string user = userPath(username);
+   string tempPath = user + "/tmp/.next";
+   int fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+   if (fd == -1)
+   {
+      return -1;
+   }
+   string text = to_string(number) + "\n";
+   if (write(fd, text.data(), text.size()) != (ssize_t)text.size() || (durable && fdatasync(fd) == -1))
+   {
+      close(fd);
+      unlink(tempPath.c_str());
+      return -1;
+   }
+   close(fd);
+   if (rename(tempPath.c_str(), (user + "/.next").c_str()) == -1 || (durable && syncPath(user) == -1))
+   {
+      unlink(tempPath.c_str());
+      return -1;
+   }
+   savedNumbers[username] = number;
+   return 0;
+}
+
+int MaildirStore::append(const string &username, const string &sender, const string &subject, const MessageBody &body)
+{
+   string user = userPath(username);
+   bool created = durable && access(user.c_str(), F_OK) == -1;
+   if (makeDirectory(user) == -1 && (errno != ENOENT || user.empty() || layout.prepare(user) == -1 || makeDirectory(user) == -1))
+   {
+      return -1;
+   }
+   if (makeDirectory(user + "/tmp") == -1 || makeDirectory(user + "/new") == -1)
+   {
+      return -1;
+   }
+
+   uint32_t number = nextNumber(username);
+   string tempPath = user + "/tmp/" + to_string(number);
+   int fd = ::open(tempPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+   if (fd == -1)
+   {
+      return -1;
+   }
+   string head = sender + "\n" + subject + "\n";
+   int result = body.writeTo(fd, 0, head, "");
+
+   // the message appears in new/ complete or not at all
+   if (result == 0 && rename(tempPath.c_str(), messagePath(username, number).c_str()) == -1)
+   {
+      result = -1;
+   }
+   if (result == -1)
+   {
+      close(fd);
+      unlink(tempPath.c_str());
+      return -1;
+   }
+   // only after the rename: a search index built meanwhile either found the
+   // file in new/ or is already there to take it
+   indexMessage(searchIndex, username, number,
+                [&](TermScanner &scanner) { return scanner.feedFile(fd, 0, head.size() + body.size()); });
+   close(fd);
+   logChange(username, number, false);
+
+   if (durable)
+   {
+      lock_guard<mutex> lock(numberMutex);
+      unsynced[username].push_back(number);
+      if (created)
+      {
+         newUsers.insert(username);
+      }
+   }
+   return 0;
+}
+
+// records a change for LIST SINCE, once the mailbox has a log
+void MaildirStore::logChange(const string &username, uint32_t number, bool deleted)
+{
+   lock_guard<mutex> lock(numberMutex);
+   auto found = changeLogs.find(username);
+   if (found == changeLogs.end())
+   {
+      return;
+   }
+   ChangeLog &log = found->second;
+   log.changes.push_back({++log.sequence, number, deleted});
+   if (log.changes.size() > CHANGE_LOG)
+   {
+      log.changes.pop_front();
+   }
+}
+
+// the summaries of the messages with these numbers that are still there
+int MaildirStore::summarize(const string &username, const vector<uint32_t> &numbers, vector<MessageSummary> &messages)
+{
+   for (uint32_t number : numbers)
+   {
+      MessageSummary summary;
+      int fd = ::open(messagePath(username, number).c_str(), O_RDONLY);
+      if (fd == -1)
+      {
+         continue;   // deleted since the scan
+      }
+      uint64_t bodyOffset;
+      int result = readHead(fd, summary.sender, summary.subject, bodyOffset, summary.size);
+      close(fd);
+      if (result == -1)
+      {
+         return -1;
+      }
+      summary.number = number;
+      summary.offset = 0;
+      messages.push_back(summary);
+   }
+   return 0;
+}
+
+int MaildirStore::list(const string &username, vector<MessageSummary> &messages)
+{
+   vector<uint32_t> numbers;
+   if (scanNumbers(username, numbers) == -1)
+   {
+      return -1;
+   }
+   return summarize(username, numbers, messages);
+}
+
+// the directory is still read as a whole, the messages only for the page
+int MaildirStore::listPage(const string &username, size_t offset, size_t count,
+                           vector<MessageSummary> &messages, size_t &total)
+{
+   vector<uint32_t> numbers;
+   if (scanNumbers(username, numbers) == -1)
+   {
+      return -1;
+   }
+   total = numbers.size();
+   offset = min(offset, numbers.size());
+   numbers.erase(numbers.begin(), numbers.begin() + offset);
+   numbers.resize(min(count, numbers.size()));
+   return summarize(username, numbers, messages);
+}
+
+// The log is created before the mailbox is first read, so whatever the
+// read misses is logged for the next call.
+int MaildirStore::listChanges(const string &username, const SyncToken &since, MailboxChanges &changes)
+{
+   bool logged;
+   {
+      lock_guard<mutex> lock(numberMutex);
+      logged = changeLogs.count(username) > 0;
+   }
+   struct stat sb;
+   if (!logged && stat(userPath(username).c_str(), &sb) == -1)
+   {
+      return -1;   // no log for unknown users
+   }
+
+   vector<Change> recent;
+   {
+      lock_guard<mutex> lock(numberMutex);
+      ChangeLog &log = changeLogs[username];
+      changes.token.generation = generation;
+      changes.token.sequence = log.sequence;
+      changes.reset = since.generation != generation || since.sequence > log.sequence ||
+                      (!log.changes.empty() && log.changes.front().sequence > since.sequence + 1);
+      for (auto change = log.changes.rbegin(); !changes.reset && change != log.changes.rend() &&
+                                               change->sequence > since.sequence; ++change)
+      {
+         recent.push_back(*change);
+      }
+   }
+   if (changes.reset)
+   {
+      return list(username, changes.added);
+   }
+
+   // numbers are not reused, so a message is at most appended and deleted
+   set<uint32_t> added, deleted;
+   for (auto change = recent.rbegin(); change != recent.rend(); ++change)
+   {
+      if (!change->deleted)
+      {
+         added.insert(change->number);
+      }
+      else if (added.erase(change->number) == 0)
+      {
+         deleted.insert(change->number);
+      }
+   }
+   changes.deleted.assign(deleted.begin(), deleted.end());
+   return summarize(username, vector<uint32_t>(added.begin(), added.end()), changes.added);
+}
+
+int MaildirStore::read(const string &username, uint32_t number, Message &message)
+{
+   FileRange body;
+   int result = readFile(username, number, message, body);
+   return result == 0 ? readBody(body, message) : result;
+}
+
+int MaildirStore::readFile(const string &username, uint32_t number, Message &message, FileRange &body)
+{
+   int fd = ::open(messagePath(username, number).c_str(), O_RDONLY);
+   if (fd == -1)
+   {
+      struct stat sb;
+      return stat(userPath(username).c_str(), &sb) == 0 ? STORE_NO_MESSAGE : -1;
+   }
+   uint64_t bodyOffset, size;
+   if (readHead(fd, message.sender, message.subject, bodyOffset, size) == -1)
+   {
+      close(fd);
+      return -1;
+   }
+   // a message file is never written again after the rename into new/
+   message.body.clear();
+   body.file = make_shared<FileHandle>(fd);
+   body.offset = bodyOffset;
+   body.length = size - bodyOffset;
+   return 0;
+}
+
+int MaildirStore::remove(const string &username, uint32_t number)
+{
+   {
+      // deleting the highest message must not give its number out again
+      // after a restart
+      lock_guard<mutex> lock(numberMutex);
+      uint32_t next = nextEntry(username);
+      if (savedNumbers[username] <= number && number < next &&
+          access(messagePath(username, number).c_str(), F_OK) == 0 && saveNextNumber(username, next) == -1)
+      {
+         return -1;
+      }
+   }
+   if (unlink(messagePath(username, number).c_str()) == 0)
+   {
+      searchIndex.remove(username, number);
+      logChange(username, number, true);
+      return 0;
+   }
+   struct stat sb;
+   return errno == ENOENT && stat(userPath(username).c_str(), &sb) == 0 ? STORE_NO_MESSAGE : -1;
+}
+
+// Without mailbox locks, appends and deletes may run while a first search
+// builds the index; they wait for the build and then change it.
+int MaildirStore::search(const string &username, const vector<string> &terms, vector<MessageSummary> &messages)
+{
+   vector<uint32_t> numbers;
+   int result = searchIndex.search(username, terms, numbers, [&](Postings &postings) {
+      vector<uint32_t> stored;
+      if (scanNumbers(username, stored) == -1)
+      {
+         return -1;
+      }
+      TermScanner scanner;
+      for (uint32_t number : stored)
+      {
+         int fd = ::open(messagePath(username, number).c_str(), O_RDONLY);
+         if (fd == -1)
+         {
+            continue;   // deleted since the scan
+         }
+         struct stat sb;
+         scanner.clear();
+         int scanned = fstat(fd, &sb) == 0 ? scanner.feedFile(fd, 0, sb.st_size) : -1;
+         close(fd);
+         if (scanned == -1)
+         {
+            return -1;
+         }
+         postings.add(number, scanner.finish());
+      }
+      return 0;
+   });
+   if (result == -1)
+   {
+      return -1;
+   }
+   return summarize(username, numbers, messages);
+}
+
+// every new message file, then the new/ entries pointing to them and, for a
+// new user, the directories leading there
+int MaildirStore::sync(const string &username)
+{
+   vector<uint32_t> numbers;
+   bool created;
+   {
+      lock_guard<mutex> lock(numberMutex);
+      numbers.swap(unsynced[username]);
+      created = newUsers.erase(username) > 0;
+   }
+   for (uint32_t number : numbers)
+   {
+      if (syncPath(messagePath(username, number)) == -1)
+      {
+         return -1;
+      }
+   }
+   string user = userPath(username);
+   if (syncPath(user + "/new") == -1 ||
+       (created && (syncPath(user) == -1 || layout.syncParents(user) == -1)))
+   {
+      return -1;
+   }
+   return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// HEADER CACHE
+
+CachedStore::CachedStore(MailStore *store, size_t capacity)
+   : store(store), capacity(capacity), bytes(0), generation(0),
+     hits(0), misses(0), evictions(0), invalidations(0)
+{
+   store->setChangeHandler([this](const string &username) { invalidate(username); });
+}
+
+CachedStore::~CachedStore()
+{
+   delete store;
+}
+
+int CachedStore::open()
+{
+   return store->open();
+}
+
+// what an entry costs, counted generously so the budget is an upper bound
+size_t CachedStore::entrySize(const string &username, const vector<MessageSummary> &messages)
+{
+   size_t size = sizeof(Entry) + 2 * username.size() + 64;
+   for (const MessageSummary &message : messages)
+   {
+      size += sizeof(MessageSummary) + message.sender.size() + message.subject.size();
+   }
+   return size;
+}
+
+void CachedStore::evict(unordered_map<string, Entry>::iterator entry)
+{
+   bytes -= entry->second.bytes;
+   lru.erase(entry->second.lru);
+   entries.erase(entry);
+}
+
+void CachedStore::invalidate(const string &username)
+{
+   lock_guard<mutex> lock(cacheMutex);
+   generation++;
+   auto entry = entries.find(username);
+   if (entry != entries.end())
+   {
+      evict(entry);
+      invalidations++;
+   }
+}
+
+int CachedStore::append(const string &username, const string &sender, const string &subject, const MessageBody &body)
+{
+   int result = store->append(username, sender, subject, body);
+   invalidate(username);
+   return result;
+}
+
+int CachedStore::list(const string &username, vector<MessageSummary> &messages)
+{
+   uint64_t listedGeneration;
+   {
+      lock_guard<mutex> lock(cacheMutex);
+      auto entry = entries.find(username);
+      if (entry != entries.end())
+      {
+         hits++;
+         lru.splice(lru.begin(), lru, entry->second.lru);
+         messages = entry->second.messages;
+         return 0;
+      }
+      misses++;
+      listedGeneration = generation;
+   }
+
+   if (store->list(username, messages) != 0)
+   {
+      return -1;
+   }
+
+   lock_guard<mutex> lock(cacheMutex);
+   // a SEND or DEL that ran meanwhile may not be part of this result
+   size_t size = entrySize(username, messages);
+   if (listedGeneration != generation || size > capacity || entries.count(username) > 0)
+   {
+      return 0;
+   }
+   while (bytes + size > capacity)
+   {
+      evict(entries.find(lru.back()));
+      evictions++;
+   }
+   lru.push_front(username);
+   Entry &entry = entries[username];
+   entry.messages = messages;
+   entry.bytes = size;
+   entry.lru = lru.begin();
+   bytes += size;
+   return 0;
+}
+
+// a page of a cached mailbox is cut out of the entry, other pages are not
+// worth caching
+int CachedStore::listPage(const string &username, size_t offset, size_t count,
+                          vector<MessageSummary> &messages, size_t &total)
+{
+   {
+      lock_guard<mutex> lock(cacheMutex);
+      auto entry = entries.find(username);
+      if (entry != entries.end())
+      {
+         hits++;
+         lru.splice(lru.begin(), lru, entry->second.lru);
+         const vector<MessageSummary> &cached = entry->second.messages;
+         total = cached.size();
+         offset = min(offset, cached.size());
+         messages.assign(cached.begin() + offset, cached.begin() + offset + min(count, cached.size() - offset));
+         return 0;
+      }
+   }
+   return store->listPage(username, offset, count, messages, total);
+}
+
+int CachedStore::listChanges(const string &username, const SyncToken &since, MailboxChanges &changes)
+{
+   return store->listChanges(username, since, changes);
+}
+
+int CachedStore::read(const string &username, uint32_t number, Message &message)
+{
+   return store->read(username, number, message);
+}
+
+int CachedStore::readFile(const string &username, uint32_t number, Message &message, FileRange &body)
+{
+   return store->readFile(username, number, message, body);
+}
+
+int CachedStore::remove(const string &username, uint32_t number)
+{
+   int result = store->remove(username, number);
+   if (result != 0)
+   {
+      return result;
+   }
+
+   // the other messages keep their numbers, so the entry stays usable
+   lock_guard<mutex> lock(cacheMutex);
+   generation++;
+   auto entry = entries.find(username);
+   if (entry != entries.end())
+   {
+      vector<MessageSummary> &messages = entry->second.messages;
+      for (auto message = messages.begin(); message != messages.end(); ++message)
+      {
+         if (message->number == number)
+         {
+            size_t size = sizeof(MessageSummary) + message->sender.size() + message->subject.size();
+            entry->second.bytes -= size;
+            bytes -= size;
+            messages.erase(message);
+            break;
+         }
+      }
+   }
+   return 0;
+}
+
+int CachedStore::search(const string &username, const vector<string> &terms, vector<MessageSummary> &messages)
+{
+   return store->search(username, terms, messages);
+}
+
+int CachedStore::sync(const string &username)
+{
+   return store->sync(username);
+}
+
+void CachedStore::printStats()
+{
+   {
+      lock_guard<mutex> lock(cacheMutex);
+      printf("header cache %zu mailboxes, %zu of %zu bytes, %ld hits, %ld misses, %ld evictions, %ld invalidations\n",
+             entries.size(), bytes, capacity, hits, misses, evictions, invalidations);
+   }
+   store->printStats();
+}
+
+void CachedStore::addStats(StoreStats &total)
+{
+   {
+      lock_guard<mutex> lock(cacheMutex);
+      total.cacheHits += hits;
+      total.cacheMisses += misses;
+   }
+   store->addStats(total);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GROUP COMMIT
+
+GroupCommitter::GroupCommitter(MailStore *store)
+   : store(store), nextTicket(0), stopping(false), durableTicket(0), syncs(0)
+{
+}
+
+// waits for the batch in progress, appends still queued are never acknowledged
+GroupCommitter::~GroupCommitter()
+{
+   if (committer.joinable())
+   {
+      {
+         lock_guard<mutex> lock(queueMutex);
+         stopping = true;
+         queueWakeup.notify_one();
+      }
+      committer.join();
+   }
+}
+
+void GroupCommitter::start()
+{
+   committer = thread(&GroupCommitter::run, this);
+}
+
+uint64_t GroupCommitter::submit(const string &username)
+{
+   lock_guard<mutex> lock(queueMutex);
+   queue.push_back({username, chrono::steady_clock::now()});
+   queueWakeup.notify_one();
+   return ++nextTicket;
+}
+
+void GroupCommitter::run()
+{
+   vector<Pending> batch;
+   set<string> usernames;
+
+   unique_lock<mutex> lock(queueMutex);
+   while (!stopping)
+   {
+      if (queue.empty())
+      {
+         queueWakeup.wait(lock);
+         continue;
+      }
+      batch.swap(queue);
+      uint64_t ticket = nextTicket;
+      lock.unlock();
+
+      usernames.clear();
+      for (const Pending &pending : batch)
+      {
+         usernames.insert(pending.username);
+      }
+      for (const string &username : usernames)
+      {
+         syncs++;
+         if (store->sync(username) == -1)
+         {
+            // The kernel may have dropped the pages it failed to write, so a
+            // retry could report success for lost data. Nothing of this batch
+            // is acknowledged; the server shuts down instead.
+            LOG(LEVEL_ERROR, "sync of %s failed - shutting down", username.c_str());
+            kill(getpid(), SIGTERM);
+            return;
+         }
+      }
+      durableTicket = ticket;
+      if (commitHandler)
+      {
+         commitHandler();
+      }
+
+      auto now = chrono::steady_clock::now();
+      batchSizes.record(batch.size());
+      for (const Pending &pending : batch)
+      {
+         latencies.record(chrono::duration_cast<chrono::microseconds>(now - pending.submitted).count());
+      }
+      batch.clear();
+      lock.lock();
+   }
+}
+
+void GroupCommitter::printStats()
+{
+   printf("group commit: durable through %llu, %ld mailbox syncs\n",
+          (unsigned long long)durableTicket.load(), syncs.load());
+   batchSizes.print("  batch size", "appends");
+   latencies.print("  commit latency", "us");
+}
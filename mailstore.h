@@ -0,0 +1,552 @@
+#ifndef MAILSTORE_H
+#define MAILSTORE_H
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <deque>
+#include <unordered_map>
+#include <functional>
+#include <memory>
+#include <set>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include "histogram.h"
+#include "spool.h"
+#include "search.h"
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define STORE_NO_MESSAGE -2   // read/remove: the mailbox exists, the message does not
+#define BODY_MEMORY (64 * 1024)   // bytes of a message body kept in memory while it arrives
+#define DELETION_LOG 64           // flat: deletes an index remembers for LIST SINCE
+#define CHANGE_LOG 256            // maildir: appends and deletes remembered for LIST SINCE
+
+///////////////////////////////////////////////////////////////////////////////
+
+// a message as handed out by READ
+struct Message
+{
+   std::string sender;
+   std::string subject;
+   std::string body;
+};
+
+// an open descriptor, closed when the last reference goes away
+class FileHandle
+{
+public:
+   explicit FileHandle(int fd) : fd(fd) {}
+   ~FileHandle() { close(fd); }
+   FileHandle(const FileHandle &) = delete;
+   FileHandle &operator=(const FileHandle &) = delete;
+
+   const int fd;
+};
+
+// stored bytes of a message that can be sent straight from the page cache
+struct FileRange
+{
+   std::shared_ptr<FileHandle> file;   // empty: nothing to send from a file
+   uint64_t offset = 0;
+   uint64_t length = 0;
+};
+
+// The body of a message on its way into the store. It is built up as it
+// arrives: at most BODY_MEMORY bytes are held in memory, everything before
+// them is written on to an anonymous staging file in stagingDirectory, so a
+// message of any size costs the same memory. The store copies a staged body
+// into the mailbox inside the kernel when the message is committed. The CRC
+// of the body is kept up as it arrives, so the flat store never reads a
+// staged body back.
+class MessageBody
+{
+public:
+   MessageBody() : file(-1), fileLength(0), checksum(0) {}
+   ~MessageBody() { clear(); }
+   MessageBody(const MessageBody &) = delete;
+   MessageBody &operator=(const MessageBody &) = delete;
+
+   // -1 if the staging file cannot be created or written
+   int append(const char *data, size_t length);
+   int append(const std::string &data) { return append(data.data(), data.size()); }
+   // forgets the body and drops its staging file
+   void clear();
+   uint64_t size() const { return fileLength + memory.size(); }
+   // crc32() of the whole body
+   uint32_t crc() const { return checksum; }
+   // the bytes not staged yet: the whole body unless it outgrew BODY_MEMORY
+   const std::string &buffered() const { return memory; }
+   // writes before, the body and after to fd from offset on; -1 on error
+   int writeTo(int fd, off_t offset, const std::string &before, const std::string &after) const;
+
+   static std::string stagingDirectory;   // on the spool's file system
+
+private:
+   int spill();
+
+   std::string memory;    // the last bytes of the body
+   int file;              // staging file holding the first fileLength bytes, or -1
+   uint64_t fileLength;
+   uint32_t checksum;
+};
+
+// one line of a LIST answer
+struct MessageSummary
+{
+   uint32_t number;
+   std::string sender;
+   std::string subject;
+   uint64_t offset;      // where the message starts in its file
+   uint64_t size;        // bytes on disk
+};
+
+// Where a client stands in a mailbox for LIST SINCE: the generation of the
+// mailbox and the number of appends and deletes in it so far. A backend
+// starts a new generation whenever it cannot tell what changed since an
+// older token (the flat index rebuilt, the maildir change log lost with a
+// restart).
+struct SyncToken
+{
+   uint64_t generation;
+   uint64_t sequence;
+};
+
+// the answer to LIST SINCE
+struct MailboxChanges
+{
+   bool reset;                          // the token was too old: added holds every message
+   std::vector<MessageSummary> added;   // ascending
+   std::vector<uint32_t> deleted;       // ascending, only messages from before the token
+   SyncToken token;                     // for the next LIST SINCE
+};
+
+// backend options given on the command line
+struct StoreOptions
+{
+   double compactRatio;   // flat: dead share of a mailbox that triggers compaction
+   size_t cacheBytes;     // memory for cached LIST headers, 0 disables the cache
+   size_t lockStripes;    // flat: reader-writer locks shared by all mailboxes
+   bool durable;          // remember appends until sync() makes them durable
+   int layout;            // LAYOUT_FLAT or LAYOUT_SHARDED (see spool.h)
+   size_t searchBytes;    // memory for loaded search indexes
+};
+
+// backend counters for STATS; a store adds what it keeps, the rest stays 0
+struct StoreStats
+{
+   long compactions;         // flat: compactor runs
+   long reclaimedBytes;      // flat: freed by compaction
+   long cacheHits;           // LIST answered from the header cache
+   long cacheMisses;
+   long lockAcquisitions;    // flat: mailbox locks taken
+   long lockWaits;           // flat: of them, found the stripe taken
+   size_t searchBytes;       // memory held by loaded search indexes
+   size_t searchMailboxes;   // mailboxes with a loaded search index
+};
+
+// Storage backend behind SEND, LIST, READ and DEL. One instance is shared by
+// all workers, so every implementation has to be thread-safe. Messages are
+// addressed by number; a number stays valid until the message is deleted
+// and is never given to another message, compaction included.
+// Everything returns 0 on success and -1 on error or an unknown user.
+class MailStore
+{
+public:
+   virtual ~MailStore() {}
+
+   // prepares the spool directory and starts background work
+   virtual int open() = 0;
+   virtual int append(const std::string &username, const std::string &sender,
+                      const std::string &subject, const MessageBody &body) = 0;
+   virtual int list(const std::string &username, std::vector<MessageSummary> &messages) = 0;
+   // at most count messages, from the offset-th (0-based, in number order)
+   // on; total gets the number of messages in the mailbox
+   virtual int listPage(const std::string &username, size_t offset, size_t count,
+                        std::vector<MessageSummary> &messages, size_t &total) = 0;
+   // The messages appended and deleted since the token, at a cost that
+   // follows the number of changes rather than the size of the mailbox.
+   // A change racing the call may show up again in the next one.
+   virtual int listChanges(const std::string &username, const SyncToken &since, MailboxChanges &changes) = 0;
+   // STORE_NO_MESSAGE if there is no message with that number
+   virtual int read(const std::string &username, uint32_t number, Message &message) = 0;
+   // Like read(), but may leave message.body empty and describe the stored
+   // body bytes in body instead, for the caller to send without copying.
+   // Stored bytes are never changed in place, so the range stays valid.
+   virtual int readFile(const std::string &username, uint32_t number, Message &message, FileRange &body)
+   {
+      body.file.reset();
+      return read(username, number, message);
+   }
+   // STORE_NO_MESSAGE if there is no message with that number
+   virtual int remove(const std::string &username, uint32_t number) = 0;
+   // the messages holding every term (as split by TermScanner), ascending
+   virtual int search(const std::string &username, const std::vector<std::string> &terms,
+                      std::vector<MessageSummary> &messages) = 0;
+   // Makes every append to the mailbox of username that has returned so far
+   // survive a crash. Only stores created with options.durable keep track of
+   // what is left to sync.
+   virtual int sync(const std::string &username) = 0;
+   // prints backend counters (SIGUSR1)
+   virtual void printStats() {}
+   // adds backend counters to stats (STATS)
+   virtual void addStats(StoreStats &) {}
+
+   // called with the user whenever a mailbox changes on its own (compaction)
+   void setChangeHandler(const std::function<void(const std::string &)> &handler) { changeHandler = handler; }
+
+protected:
+   void notifyChanged(const std::string &username)
+   {
+      if (changeHandler)
+      {
+         changeHandler(username);
+      }
+   }
+
+private:
+   std::function<void(const std::string &)> changeHandler;
+};
+
+// "flat" or "maildir", wrapped in a CachedStore if options.cacheBytes > 0;
+// NULL for an unknown type
+MailStore *createMailStore(const std::string &type, const std::string &spool, const StoreOptions &options);
+
+///////////////////////////////////////////////////////////////////////////////
+// MAILBOX LOCKS
+// A fixed table of reader-writer locks. Every mailbox maps to one stripe by
+// the hash of its user, so LIST and READ of a mailbox share its stripe while
+// SEND and DEL hold it alone. Mailboxes on the same stripe contend, which is
+// what the per-stripe wait counters are there to show.
+
+class LockManager
+{
+public:
+   explicit LockManager(size_t stripeCount);
+
+   // returns the stripe to hand back to unlock()
+   size_t lock(const std::string &username, bool exclusive);
+   void unlock(size_t stripe, bool exclusive);
+   // prints the stripes that ever had to wait
+   void printStats();
+   // totals over all stripes
+   void counts(long &acquisitions, long &waits);
+
+private:
+   struct Stripe
+   {
+      std::shared_timed_mutex mutex;
+      std::atomic<long> acquisitions;
+      std::atomic<long> waits;          // acquisitions that found the stripe taken
+      std::atomic<long> waitMicros;
+      std::atomic<long> maxWaitMicros;
+      char padding[64];                 // keeps neighbouring stripes off one cache line
+   };
+
+   std::unique_ptr<Stripe[]> stripes;
+   size_t stripeCount;
+};
+
+// holds the lock of a mailbox for the lifetime of a scope
+class MailboxLock
+{
+public:
+   MailboxLock(LockManager &locks, const std::string &username, bool exclusive)
+      : locks(locks), exclusive(exclusive), stripe(locks.lock(username, exclusive)) {}
+   ~MailboxLock() { locks.unlock(stripe, exclusive); }
+   MailboxLock(const MailboxLock &) = delete;
+   MailboxLock &operator=(const MailboxLock &) = delete;
+
+private:
+   LockManager &locks;
+   const bool exclusive;
+   const size_t stripe;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// FLAT BACKEND
+// One append-only file per user holding a record per message (see
+// mailformat.h), plus a sidecar index with a fixed-size record per message.
+// Flat layout: <spool>/<user> and <spool>/.index/<user>; the sharded layout
+// is described in spool.h.
+// For LIST SINCE every record carries the sequence number of its append and
+// the header the last DELETION_LOG deletes, so a delta reads the header and
+// the records appended since, found by binary search.
+
+// a deleted message in the deletion log of an index
+struct IndexDeletion
+{
+   uint64_t sequence;
+   uint32_t number;
+   uint32_t reserved;
+};
+
+// Header of a mailbox index. The index is only trusted while it describes
+// the mailbox as it is on disk. Its generation is the one of LIST SINCE
+// tokens: every index written from scratch starts a new one.
+struct IndexHeader
+{
+   char magic[4];
+   uint32_t recordCount;
+   uint64_t mailboxSize;
+   uint64_t mailboxInode;
+   uint64_t mailboxMtime;    // nanoseconds
+   uint64_t deadBytes;       // deleted messages not yet compacted away
+   uint64_t generation;
+   uint64_t sequence;        // appends and deletes in this generation
+   uint64_t deletionCount;   // deletes in this generation
+   IndexDeletion deletions[DELETION_LOG];   // the last deletes, delete k at k % DELETION_LOG
+};
+
+// One message of a mailbox; message number n is record n - 1.
+struct IndexRecord
+{
+   uint64_t offset;          // of the mail record
+   uint32_t length;          // of the mail record, its header included
+   uint32_t subjectOffset;   // relative to offset
+   uint32_t bodyOffset;      // relative to offset
+   uint32_t flags;           // RECORD_DELETED
+   uint64_t sequence;        // of its append, 0 if from before the generation
+};
+
+static_assert(sizeof(IndexHeader) == 64 + DELETION_LOG * 16, "index header layout");
+static_assert(sizeof(IndexRecord) == 32, "index record layout");
+
+// totals of the background compactor
+struct CompactionStats
+{
+   std::atomic<long> runs;
+   std::atomic<long> bytesReclaimed;
+   std::atomic<long> bytesRewritten;
+   std::atomic<long> microseconds;
+};
+
+class FlatStore : public MailStore
+{
+public:
+   FlatStore(const std::string &spool, const StoreOptions &options);
+   ~FlatStore();
+
+   int open() override;
+   int append(const std::string &username, const std::string &sender,
+              const std::string &subject, const MessageBody &body) override;
+   int list(const std::string &username, std::vector<MessageSummary> &messages) override;
+   int listPage(const std::string &username, size_t offset, size_t count,
+                std::vector<MessageSummary> &messages, size_t &total) override;
+   int listChanges(const std::string &username, const SyncToken &since, MailboxChanges &changes) override;
+   int read(const std::string &username, uint32_t number, Message &message) override;
+   int readFile(const std::string &username, uint32_t number, Message &message, FileRange &body) override;
+   int remove(const std::string &username, uint32_t number) override;
+   int search(const std::string &username, const std::vector<std::string> &terms,
+              std::vector<MessageSummary> &messages) override;
+   int sync(const std::string &username) override;
+   void printStats() override;
+   void addStats(StoreStats &total) override;
+
+   // rewrites a mailbox without its deleted messages
+   int compact(const std::string &username);
+
+private:
+   std::string mailboxPath(const std::string &username);
+   std::string indexPath(const std::string &username);
+   int storeIndex(const std::string &username, int mailboxFd, const std::vector<IndexRecord> &records, IndexHeader &header,
+                  const IndexHeader *previous = NULL);
+   int rebuildIndex(const std::string &username, int mailboxFd, IndexHeader &header);
+   int openIndex(const std::string &username, int mailboxFd, IndexHeader &header);
+   int findMessage(int indexFd, const IndexHeader &header, uint32_t number, IndexRecord &record);
+   void requestCompaction(const std::string &username);
+   void runCompactor();
+
+   SpoolLayout layout;
+   double compactRatio;
+   bool durable;
+   std::mutex syncMutex;             // guards newMailboxes
+   std::set<std::string> newMailboxes;   // created since their last sync
+   LockManager locks;                // shared for LIST/READ/SEARCH, exclusive for SEND/DEL/compaction
+   SearchIndex searchIndex;          // built under the shared lock, updated under the exclusive one
+   std::thread compactor;
+   std::mutex compactMutex;          // guards compactQueue and stopping
+   std::condition_variable compactWakeup;
+   std::set<std::string> compactQueue;
+   bool stopping;
+   CompactionStats stats;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// MAILDIR BACKEND
+// One directory per user, <user>/{tmp,new} where the spool layout puts the
+// user (<spool>/<user> if flat). Every message is its own
+// file "<sender>\n<subject>\n<body>", written to tmp/ and renamed into
+// new/<number>, so readers only ever see complete messages and DEL is a
+// single unlink(). Numbers are never reused: a new mailbox takes up after
+// its highest message, and before the highest one is deleted <user>/.next
+// records the number after it, which outlasts a restart.
+// LIST SINCE is answered from an in-memory log of the last CHANGE_LOG
+// appends and deletes, kept for every mailbox once it is listed that way;
+// tokens from before a restart get the whole mailbox.
+
+class MaildirStore : public MailStore
+{
+public:
+   MaildirStore(const std::string &spool, const StoreOptions &options);
+
+   int open() override;
+   int append(const std::string &username, const std::string &sender,
+              const std::string &subject, const MessageBody &body) override;
+   int list(const std::string &username, std::vector<MessageSummary> &messages) override;
+   int listPage(const std::string &username, size_t offset, size_t count,
+                std::vector<MessageSummary> &messages, size_t &total) override;
+   int listChanges(const std::string &username, const SyncToken &since, MailboxChanges &changes) override;
+   int read(const std::string &username, uint32_t number, Message &message) override;
+   int readFile(const std::string &username, uint32_t number, Message &message, FileRange &body) override;
+   int remove(const std::string &username, uint32_t number) override;
+   int search(const std::string &username, const std::vector<std::string> &terms,
+              std::vector<MessageSummary> &messages) override;
+   int sync(const std::string &username) override;
+   void printStats() override;
+   void addStats(StoreStats &total) override;
+
+private:
+   std::string userPath(const std::string &username);
+   std::string messagePath(const std::string &username, uint32_t number);
+   int scanNumbers(const std::string &username, std::vector<uint32_t> &numbers);
+   uint32_t nextNumber(const std::string &username);
+   uint32_t &nextEntry(const std::string &username);
+   int saveNextNumber(const std::string &username, uint32_t number);
+   void logChange(const std::string &username, uint32_t number, bool deleted);
+   int summarize(const std::string &username, const std::vector<uint32_t> &numbers,
+                 std::vector<MessageSummary> &messages);
+
+   // appends and deletes of a mailbox since its first LIST SINCE
+   struct Change
+   {
+      uint64_t sequence;
+      uint32_t number;
+      bool deleted;
+   };
+   struct ChangeLog
+   {
+      uint64_t sequence = 0;
+      std::deque<Change> changes;   // the last CHANGE_LOG of them
+   };
+
+   SpoolLayout layout;
+   bool durable;
+   std::mutex numberMutex;           // guards nextNumbers, savedNumbers, unsynced, newUsers and changeLogs
+   std::map<std::string, uint32_t> nextNumbers;
+   std::map<std::string, uint32_t> savedNumbers;            // what <user>/.next holds
+   std::map<std::string, std::vector<uint32_t>> unsynced;   // messages renamed into new/ since the last sync
+   std::set<std::string> newUsers;   // user directories created since their last sync
+   std::unordered_map<std::string, ChangeLog> changeLogs;
+   uint64_t generation;              // of the change logs: the server start
+   SearchIndex searchIndex;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// HEADER CACHE
+// Decorator keeping the LIST result of recently listed mailboxes, bounded by
+// a memory budget and evicted least recently used first. SEND drops the
+// entry of the receiver, DEL removes the message from it, and a change the
+// backend makes on its own (compaction) drops it through the change handler.
+
+class CachedStore : public MailStore
+{
+public:
+   CachedStore(MailStore *store, size_t capacity);
+   ~CachedStore();
+
+   int open() override;
+   int append(const std::string &username, const std::string &sender,
+              const std::string &subject, const MessageBody &body) override;
+   int list(const std::string &username, std::vector<MessageSummary> &messages) override;
+   int listPage(const std::string &username, size_t offset, size_t count,
+                std::vector<MessageSummary> &messages, size_t &total) override;
+   int listChanges(const std::string &username, const SyncToken &since, MailboxChanges &changes) override;
+   int read(const std::string &username, uint32_t number, Message &message) override;
+   int readFile(const std::string &username, uint32_t number, Message &message, FileRange &body) override;
+   int remove(const std::string &username, uint32_t number) override;
+   int search(const std::string &username, const std::vector<std::string> &terms,
+              std::vector<MessageSummary> &messages) override;
+   int sync(const std::string &username) override;
+   void printStats() override;
+   void addStats(StoreStats &total) override;
+
+private:
+   struct Entry
+   {
+      std::vector<MessageSummary> messages;
+      size_t bytes;
+      std::list<std::string>::iterator lru;
+   };
+
+   void invalidate(const std::string &username);
+   void evict(std::unordered_map<std::string, Entry>::iterator entry);
+   static size_t entrySize(const std::string &username, const std::vector<MessageSummary> &messages);
+
+   MailStore *store;
+   size_t capacity;
+   std::mutex cacheMutex;            // guards everything below
+   std::unordered_map<std::string, Entry> entries;
+   std::list<std::string> lru;       // most recently used first
+   size_t bytes;
+   uint64_t generation;              // bumped by every invalidation
+   long hits;
+   long misses;
+   long evictions;
+   long invalidations;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// GROUP COMMIT
+// Makes appends durable in batches (--durability group). A caller submits
+// the user it appended for and gets a ticket. The commit thread takes
+// everything queued so far, syncs each affected mailbox once and then
+// publishes the highest ticket of the batch, so every ticket up to
+// durable() is on disk. Appends queued while a batch is syncing form the
+// next batch; no time is spent waiting for a batch to fill.
+
+class GroupCommitter
+{
+public:
+   explicit GroupCommitter(MailStore *store);
+   ~GroupCommitter();
+
+   void start();
+   uint64_t submit(const std::string &username);
+   uint64_t durable() const { return durableTicket; }
+   // called on the commit thread after every batch
+   void setCommitHandler(const std::function<void()> &handler) { commitHandler = handler; }
+   void printStats();
+
+private:
+   struct Pending
+   {
+      std::string username;
+      std::chrono::steady_clock::time_point submitted;
+   };
+
+   void run();
+
+   MailStore *store;
+   std::thread committer;
+   std::function<void()> commitHandler;
+   std::mutex queueMutex;            // guards queue, nextTicket and stopping
+   std::condition_variable queueWakeup;
+   std::vector<Pending> queue;
+   uint64_t nextTicket;
+   bool stopping;
+   std::atomic<uint64_t> durableTicket;
+   std::atomic<long> syncs;          // fdatasync rounds, one per mailbox and batch
+   Histogram batchSizes;             // appends per batch
+   Histogram latencies;              // submit to durable, microseconds
+};
+
+#endif
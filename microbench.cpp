@@ -0,0 +1,445 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+#include <map>
+#include <ext/stdio_filebuf.h>
+#include <benchmark/benchmark.h>
+#include "mailstore.h"
+#include "mailformat.h"
+#include "commands.h"
+#include "log.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+// STORAGE MICROBENCHMARKS
+// SEND, LIST, READ, SEARCH and DEL through the command functions the
+// server runs, without sockets, against synthetic spools of 10 to 100,000
+// messages per user and bodies of 100 B to 1 MB. Every spool is built
+// once per backend, size and body size, below a temporary working
+// directory that is removed at the end.
+// The commands print what they do; that goes to /dev/null, the results go
+// to the original stdout.
+// The legacy scan benchmark splits up a text mailbox in memory, as
+// twmailer-convert does, once with each marker search.
+
+#define USER "bench"
+#define LEGACY_MAILBOX (256 * 1024 * 1024)   // bytes of the legacy scan mailbox
+
+enum Backend
+{
+   BACKEND_FLAT,
+   BACKEND_MAILDIR
+};
+
+struct Spool
+{
+   string path;
+   MailStore *store;
+};
+
+string spoolRoot;
+map<string, Spool> spools;   // by backend, messages and body size
+
+///////////////////////////////////////////////////////////////////////////////
+
+static StoreOptions benchOptions()
+{
+   StoreOptions options;
+   options.compactRatio = 1;   // only compact mailboxes without live messages
+   options.cacheBytes = 0;     // measure the storage, not the header cache
+   options.lockStripes = 64;
+   options.durable = false;
+   options.layout = LAYOUT_FLAT;
+   options.searchBytes = 1024 * 1024 * 1024;   // keeps every index built once
+   return options;
+}
+
+static MailStore *openStore(Backend backend, const string &path)
+{
+   MailStore *store = createMailStore(backend == BACKEND_FLAT ? "flat" : "maildir", path, benchOptions());
+   if (mkdir(path.c_str(), 0777) == -1 || store->open() == -1)
+   {
+      perror(path.c_str());
+      exit(EXIT_FAILURE);
+   }
+   return store;
+}
+
+static void fill(MailStore *store, const string &username, long messages, size_t bodySize)
+{
+   // lines of 63 letters, never a lone "."
+   string body;
+   while (body.size() < bodySize)
+   {
+      body += string(63, 'a' + body.size() % 26) + "\n";
+   }
+   body.resize(bodySize);
+   MessageBody message;
+   message.append(body);
+   for (long i = 0; i < messages; ++i)
+   {
+      if (store->append(username, "sender", "subject " + to_string(i), message) == -1)
+      {
+         perror("fill spool");
+         exit(EXIT_FAILURE);
+      }
+   }
+}
+
+// the shared read-only spool for a benchmark, built on first use
+static Spool &sharedSpool(Backend backend, long messages, size_t bodySize)
+{
+   string key = to_string(backend) + "-" + to_string(messages) + "-" + to_string(bodySize);
+   auto spool = spools.find(key);
+   if (spool == spools.end())
+   {
+      string path = key;
+      MailStore *store = openStore(backend, path);
+      fill(store, USER, messages, bodySize);
+      spool = spools.insert({key, {path, store}}).first;
+   }
+   mailStore = spool->second.store;
+   return spool->second;
+}
+
+static int removeEntry(const char *path, const struct stat *, int, struct FTW *)
+{
+   return remove(path);
+}
+
+// Replaces the mailbox a benchmark works on by a fresh one holding messages
+// messages; the old one is removed so 1 MB bodies do not fill the disk.
+static string refill(MailStore *store, const string &path, long &generation, long messages, size_t bodySize)
+{
+   if (generation > 0)
+   {
+      string old = USER + to_string(generation);
+      nftw((path + "/" + old).c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+      unlink((path + "/.index/" + old).c_str());
+   }
+   string username = USER + to_string(++generation);
+   fill(store, username, messages, bodySize);
+   return username;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// BENCHMARKS
+// Arguments: backend, messages in the mailbox, body size in bytes.
+
+// Appends to a private mailbox that holds between messages and twice as
+// many messages; it is replaced outside the timing when it gets bigger.
+static void BM_Send(benchmark::State &state)
+{
+   Backend backend = (Backend)state.range(0);
+   long messages = state.range(1);
+   string path = string("send-") + to_string(backend) + "-" + to_string(messages) + "-" + to_string(state.range(2));
+   MailStore *store = openStore(backend, path);
+   mailStore = store;
+   // staged like the server stages it: bodies above BODY_MEMORY come from a file
+   MessageBody body;
+   body.append(string(state.range(2), 'x'));
+   string username;
+   long generation = 0;
+   long appended = messages;
+   for (auto _ : state)
+   {
+      if (appended >= messages)
+      {
+         state.PauseTiming();
+         username = refill(store, path, generation, messages, state.range(2));
+         appended = 0;
+         state.ResumeTiming();
+      }
+      processSend("sender", username, "subject", body);
+      appended++;
+   }
+   state.SetBytesProcessed(state.iterations() * state.range(2));
+   delete store;
+   nftw(path.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static void BM_List(benchmark::State &state)
+{
+   sharedSpool((Backend)state.range(0), state.range(1), state.range(2));
+   string reply;
+   for (auto _ : state)
+   {
+      reply.clear();
+      processList(USER, "", reply);
+      benchmark::DoNotOptimize(reply.data());
+   }
+   state.SetItemsProcessed(state.iterations() * state.range(1));
+}
+
+// the last page of 20, which still costs the flat index of the whole mailbox
+static void BM_ListPage(benchmark::State &state)
+{
+   sharedSpool((Backend)state.range(0), state.range(1), state.range(2));
+   string page = to_string(max(state.range(1) - 20, (int64_t)0)) + " 20";
+   string reply;
+   for (auto _ : state)
+   {
+      reply.clear();
+      processList(USER, page, reply);
+      benchmark::DoNotOptimize(reply.data());
+   }
+}
+
+// A poll that finds nothing new; a first LIST SINCE before the timing gets
+// the token. Its cost should not grow with the mailbox.
+static void BM_ListSince(benchmark::State &state)
+{
+   sharedSpool((Backend)state.range(0), state.range(1), state.range(2));
+   string reply;
+   processListSince(USER, "0", reply);
+   string token = reply.substr(reply.rfind("Token: ") + 7);
+   token.pop_back();
+   for (auto _ : state)
+   {
+      reply.clear();
+      processListSince(USER, token, reply);
+      benchmark::DoNotOptimize(reply.data());
+   }
+}
+
+// Reads the last message the way the server would queue it: bodies of
+// MIN_SENDFILE and more stay in the file for sendfile() and are not read.
+static void BM_Read(benchmark::State &state)
+{
+   sharedSpool((Backend)state.range(0), state.range(1), state.range(2));
+   string number = to_string(state.range(1));
+   string reply;
+   for (auto _ : state)
+   {
+      FileRange body;
+      reply.clear();
+      processRead(USER, number, reply, body);
+      benchmark::DoNotOptimize(reply.data());
+   }
+}
+
+// Searches for the message in the middle by its subject: one rare and one
+// common term ("subject" is in every message). The first SEARCH builds the
+// index of the mailbox; it runs before the timing.
+static void BM_Search(benchmark::State &state)
+{
+   sharedSpool((Backend)state.range(0), state.range(1), state.range(2));
+   string query = "subject " + to_string(state.range(1) / 2);
+   string reply;
+   processSearch(USER, query, reply);
+   for (auto _ : state)
+   {
+      reply.clear();
+      processSearch(USER, query, reply);
+      benchmark::DoNotOptimize(reply.data());
+   }
+}
+
+// Deletes the messages of a private mailbox one after the other; it is
+// replaced outside the timing once half of it is gone, before the compactor
+// would rewrite it.
+static void BM_Del(benchmark::State &state)
+{
+   Backend backend = (Backend)state.range(0);
+   long messages = state.range(1);
+   string path = string("del-") + to_string(backend) + "-" + to_string(messages) + "-" + to_string(state.range(2));
+   MailStore *store = openStore(backend, path);
+   mailStore = store;
+   string username, reply;
+   long generation = 0;
+   long next = messages;
+   for (auto _ : state)
+   {
+      if (next > messages / 2)
+      {
+         state.PauseTiming();
+         username = refill(store, path, generation, messages, state.range(2));
+         next = 1;
+         state.ResumeTiming();
+      }
+      reply.clear();
+      processDel(username, to_string(next++), reply);
+   }
+   delete store;
+   nftw(path.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+// Parse cost: rebuilding the index of a mailbox by scanning it, as after a
+// crash or a change behind the server's back.
+static void BM_RebuildIndex(benchmark::State &state)
+{
+   Spool &spool = sharedSpool(BACKEND_FLAT, state.range(0), state.range(1));
+   string index = spool.path + "/.index/" USER;
+   string reply;
+   for (auto _ : state)
+   {
+      state.PauseTiming();
+      unlink(index.c_str());
+      reply.clear();
+      state.ResumeTiming();
+      processList(USER, "", reply);
+   }
+   state.SetBytesProcessed(state.iterations() * state.range(0) * state.range(1));
+}
+
+// Rewrite cost: compacting a mailbox of which every other message was
+// deleted.
+static void BM_Compact(benchmark::State &state)
+{
+   long messages = state.range(0);
+   string path = string("compact-") + to_string(messages) + "-" + to_string(state.range(1));
+   FlatStore store(path, benchOptions());
+   if (mkdir(path.c_str(), 0777) == -1 || store.open() == -1)
+   {
+      perror(path.c_str());
+      exit(EXIT_FAILURE);
+   }
+   long generation = 0;
+   for (auto _ : state)
+   {
+      state.PauseTiming();
+      string username = refill(&store, path, generation, messages, state.range(1));
+      for (long number = 1; number <= messages; number += 2)
+      {
+         store.remove(username, number);
+      }
+      state.ResumeTiming();
+      store.compact(username);
+   }
+   state.SetBytesProcessed(state.iterations() * messages / 2 * state.range(1));
+   nftw(path.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+// A legacy mailbox of LEGACY_MAILBOX bytes, split up with the marker search
+// given as the argument; the bodies are lines of 63 letters like fill().
+static void BM_LegacyScan(benchmark::State &state)
+{
+   if (!scannerSupported(state.range(0)))
+   {
+      state.SkipWithError("not supported by this CPU");
+      return;
+   }
+   static string mailbox;
+   if (mailbox.empty())
+   {
+      string body;
+      while (body.size() < 4000)
+      {
+         body += string(63, 'a' + body.size() % 26) + "\n";
+      }
+      for (long i = 0; mailbox.size() < LEGACY_MAILBOX; ++i)
+      {
+         mailbox += "\nMESSAGE\nsender\nsubject " + to_string(i) + "\n" + body + "\n";
+      }
+   }
+   long messages = 0;
+   for (auto _ : state)
+   {
+      scanLegacyMailbox(mailbox.data(), mailbox.size(), [&](const LegacyMessage &) { messages++; },
+                        state.range(0));
+   }
+   benchmark::DoNotOptimize(messages);
+   state.SetBytesProcessed(state.iterations() * mailbox.size());
+}
+
+// messages 10..100,000 with 100 B bodies, and bodies 100 B..1 MB in a
+// mailbox of 10
+static void mailboxSizes(benchmark::internal::Benchmark *benchmark)
+{
+   for (int backend : {BACKEND_FLAT, BACKEND_MAILDIR})
+   {
+      for (long messages : {10, 100, 1000, 10000, 100000})
+      {
+         benchmark->Args({backend, messages, 100});
+      }
+      for (long bodySize : {1000, 10000, 100000, 1000000})
+      {
+         benchmark->Args({backend, 10, bodySize});
+      }
+   }
+}
+
+static void flatSizes(benchmark::internal::Benchmark *benchmark)
+{
+   for (long messages : {10, 100, 1000, 10000, 100000})
+   {
+      benchmark->Args({messages, 100});
+   }
+   for (long bodySize : {1000, 10000, 100000, 1000000})
+   {
+      benchmark->Args({10, bodySize});
+   }
+}
+
+// Send and Del write: a fixed iteration count bounds the disk they use
+BENCHMARK(BM_Send)->Apply(mailboxSizes)->ArgNames({"backend", "messages", "body"})->Iterations(1000);
+BENCHMARK(BM_List)->Apply(mailboxSizes)->ArgNames({"backend", "messages", "body"});
+BENCHMARK(BM_ListPage)->Apply(mailboxSizes)->ArgNames({"backend", "messages", "body"});
+BENCHMARK(BM_ListSince)->Apply(mailboxSizes)->ArgNames({"backend", "messages", "body"});
+BENCHMARK(BM_Read)->Apply(mailboxSizes)->ArgNames({"backend", "messages", "body"});
+BENCHMARK(BM_Search)->Apply(mailboxSizes)->ArgNames({"backend", "messages", "body"});
+BENCHMARK(BM_Del)->Apply(mailboxSizes)->ArgNames({"backend", "messages", "body"})->Iterations(1000);
+BENCHMARK(BM_RebuildIndex)->Apply(flatSizes)->ArgNames({"messages", "body"});
+BENCHMARK(BM_Compact)->Apply(flatSizes)->ArgNames({"messages", "body"});
+BENCHMARK(BM_LegacyScan)->DenseRange(SCANNER_SCALAR, SCANNER_AVX2)->ArgName("scanner")->Unit(benchmark::kMillisecond);
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv)
+{
+   // nobody drains the log queue here; keep the compactor's lines out of it
+   logLevel = LEVEL_ERROR;
+   benchmark::Initialize(&argc, argv);
+   if (benchmark::ReportUnrecognizedArguments(argc, argv))
+   {
+      return EXIT_FAILURE;
+   }
+
+   char pattern[] = "/tmp/twmailer-microbench.XXXXXX";
+   if (mkdtemp(pattern) == NULL)
+   {
+      perror("create temporary spool");
+      return EXIT_FAILURE;
+   }
+   spoolRoot = pattern;
+   MessageBody::stagingDirectory = spoolRoot;
+   // the stores take spool paths relative to the working directory
+   if (chdir(pattern) == -1)
+   {
+      perror(pattern);
+      return EXIT_FAILURE;
+   }
+
+   // the console report keeps the original stdout, the commands' own
+   // output goes to /dev/null
+   int reportFd = dup(STDOUT_FILENO);
+   int null = open("/dev/null", O_WRONLY);
+   if (reportFd == -1 || null == -1 || dup2(null, STDOUT_FILENO) == -1)
+   {
+      perror("redirect stdout");
+      return EXIT_FAILURE;
+   }
+   close(null);
+   __gnu_cxx::stdio_filebuf<char> reportBuffer(reportFd, ios::out);
+   ostream reportStream(&reportBuffer);
+   benchmark::ConsoleReporter reporter(isatty(reportFd) ? benchmark::ConsoleReporter::OO_Defaults
+                                                        : benchmark::ConsoleReporter::OO_Tabular);
+   reporter.SetOutputStream(&reportStream);
+   reporter.SetErrorStream(&reportStream);
+   benchmark::RunSpecifiedBenchmarks(&reporter);
+   benchmark::Shutdown();
+
+   for (auto &spool : spools)
+   {
+      delete spool.second.store;
+   }
+   nftw(spoolRoot.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+   return EXIT_SUCCESS;
+}
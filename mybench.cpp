@@ -0,0 +1,680 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include "twmailer.h"
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define COMMANDS 4
+#define PREFILL_BATCH 100   // SENDs pipelined per write while filling the spool
+
+enum Command
+{
+   COMMAND_SEND,
+   COMMAND_LIST,
+   COMMAND_READ,
+   COMMAND_DEL
+};
+
+const char *commandNames[COMMANDS] = {"SEND", "LIST", "READ", "DEL"};
+
+// what one connection measured
+struct Results
+{
+   vector<uint32_t> latencies[COMMANDS];   // microseconds
+   long errors[COMMANDS];                  // answered with << ERR
+   bool failed;                            // the connection broke
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+int connectionCount = 8;
+long requestsPerConnection = 1000;
+double duration = 0;                  // seconds; overrides requestsPerConnection
+int mix[COMMANDS] = {40, 30, 20, 10};
+size_t minSize = 256;
+size_t maxSize = 4096;
+int userCount = 100;
+double zipfExponent = 0;              // 0: every user equally likely
+int prefill = 10;                     // messages per user before measuring
+unsigned seed = 1;
+const char *jsonPath = NULL;
+int serverPort = 0;                   // 0: start a server of our own
+string serverPath = "./twmailer-server";
+vector<string> serverArgs;            // everything after "--"
+
+vector<double> userCdf;               // cumulative probability of users 0..n-1
+vector<atomic<long>> messageCounts;   // messages ever sent to each user
+string bodyText;                      // message bodies are cut from this
+twmailer::ClientOptions lineProtocol; // what the numbers have always measured
+atomic<int> startFlag(0);
+
+///////////////////////////////////////////////////////////////////////////////
+int parseMix(const char *text);
+int parseSize(const char *text);
+pid_t startServer(const string &spool, int port);
+void stopServer(pid_t pid);
+int removeSpool(const string &spool);
+int findFreePort();
+void buildRequest(Command command, mt19937_64 &generator, vector<string> &request);
+int pickUser(mt19937_64 &generator);
+int prefillSpool(int port);
+void runConnection(int port, int index, Results *results);
+void report(const vector<Results> &results, double elapsed);
+uint32_t percentile(const vector<uint32_t> &sorted, double share);
+
+int main(int argc, char **argv)
+{
+   int option;
+   const char *usage = "Usage: ./twmailer-bench [--connections n] [--requests n | --duration s] [--mix send,list,read,del] "
+                       "[--size min[-max]] [--users n] [--zipf s] [--prefill n] [--seed n] [--json file] "
+                       "[--port p | --server path] [-- server options]";
+
+   // one request at a time in the line protocol, and a broken connection
+   // counts as a failure instead of being papered over by a reconnect
+   lineProtocol.framed = false;
+   lineProtocol.retries = 0;
+
+   static struct option longOptions[] = {
+      {"connections", required_argument, NULL, 'c'},
+      {"requests", required_argument, NULL, 'n'},
+      {"duration", required_argument, NULL, 't'},
+      {"mix", required_argument, NULL, 'x'},
+      {"size", required_argument, NULL, 's'},
+      {"users", required_argument, NULL, 'u'},
+      {"zipf", required_argument, NULL, 'z'},
+      {"prefill", required_argument, NULL, 'f'},
+      {"seed", required_argument, NULL, 'r'},
+      {"json", required_argument, NULL, 'j'},
+      {"port", required_argument, NULL, 'p'},
+      {"server", required_argument, NULL, 'S'},
+      {NULL, 0, NULL, 0}};
+
+   while ((option = getopt_long(argc, argv, "c:n:t:x:s:u:z:f:r:j:p:S:", longOptions, NULL)) != -1)
+   {
+      switch (option)
+      {
+      case 'c':
+         connectionCount = atoi(optarg);
+         if (connectionCount <= 0)
+         {
+            cerr << "Invalid connection count - must be a positive number\n";
+            return EXIT_FAILURE;
+         }
+         break;
+      case 'n':
+         requestsPerConnection = atol(optarg);
+         if (requestsPerConnection <= 0)
+         {
+            cerr << "Invalid request count - must be a positive number\n";
+            return EXIT_FAILURE;
+         }
+         break;
+      case 't':
+         duration = atof(optarg);
+         if (duration <= 0)
+         {
+            cerr << "Invalid duration - must be a positive number of seconds\n";
+            return EXIT_FAILURE;
+         }
+         break;
+      case 'x':
+         if (parseMix(optarg) == -1)
+         {
+            cerr << "Invalid mix - must be four weights send,list,read,del\n";
+            return EXIT_FAILURE;
+         }
+         break;
+      case 's':
+         if (parseSize(optarg) == -1)
+         {
+            cerr << "Invalid size - must be min or min-max bytes\n";
+            return EXIT_FAILURE;
+         }
+         break;
+      case 'u':
+         userCount = atoi(optarg);
+         if (userCount <= 0)
+         {
+            cerr << "Invalid user count - must be a positive number\n";
+            return EXIT_FAILURE;
+         }
+         break;
+      case 'z':
+         zipfExponent = atof(optarg);
+         if (zipfExponent < 0)
+         {
+            cerr << "Invalid zipf exponent - must not be negative\n";
+            return EXIT_FAILURE;
+         }
+         break;
+      case 'f':
+         prefill = atoi(optarg);
+         if (prefill < 0)
+         {
+            cerr << "Invalid prefill - must not be negative\n";
+            return EXIT_FAILURE;
+         }
+         break;
+      case 'r':
+         seed = strtoul(optarg, NULL, 10);
+         break;
+      case 'j':
+         jsonPath = optarg;
+         break;
+      case 'p':
+         serverPort = atoi(optarg);
+         if (serverPort <= 0 || serverPort > 65535)
+         {
+            cerr << "Invalid port\n";
+            return EXIT_FAILURE;
+         }
+         break;
+      case 'S':
+         serverPath = optarg;
+         break;
+      default:
+         cerr << usage << "\n";
+         return EXIT_FAILURE;
+      }
+   }
+   for (int i = optind; i < argc; ++i)
+   {
+      serverArgs.push_back(argv[i]);
+   }
+   // a server that drops a connection must not kill the benchmark
+   signal(SIGPIPE, SIG_IGN);
+
+   ////////////////////////////////////////////////////////////////////////////
+   // WORKLOAD
+   // Zipf: user k (1-based) is picked with a probability proportional to
+   // 1 / k^s, so a few users get most of the traffic
+   double weight = 0;
+   for (int k = 1; k <= userCount; ++k)
+   {
+      weight += 1.0 / pow((double)k, zipfExponent);
+      userCdf.push_back(weight);
+   }
+   for (double &share : userCdf)
+   {
+      share /= weight;
+   }
+   messageCounts = vector<atomic<long>>(userCount);
+   for (atomic<long> &count : messageCounts)
+   {
+      count = 0;
+   }
+   // lines of 63 letters, so no body line is ever a lone "."
+   string line;
+   for (int i = 0; i < 63; ++i)
+   {
+      line += (char)('a' + i % 26);
+   }
+   line += '\n';
+   while (bodyText.size() < maxSize)
+   {
+      bodyText += line;
+   }
+
+   ////////////////////////////////////////////////////////////////////////////
+   // SERVER
+   // Without --port a server of our own runs on a free localhost port
+   // against a temporary spool, which is removed afterwards.
+   string spool;
+   pid_t server = -1;
+   int port = serverPort;
+   if (port == 0)
+   {
+      char pattern[] = "/tmp/twmailer-bench.XXXXXX";
+      if (mkdtemp(pattern) == NULL)
+      {
+         perror("create temporary spool");
+         return EXIT_FAILURE;
+      }
+      spool = pattern;
+      port = findFreePort();
+      server = port == -1 ? -1 : startServer(spool, port);
+      if (server == -1)
+      {
+         removeSpool(spool);
+         return EXIT_FAILURE;
+      }
+   }
+
+   int result = EXIT_SUCCESS;
+   if (prefillSpool(port) == -1)
+   {
+      fprintf(stderr, "filling the spool failed\n");
+      result = EXIT_FAILURE;
+   }
+
+   ////////////////////////////////////////////////////////////////////////////
+   // RUN
+   // every connection is set up before the clock starts
+   vector<Results> results(connectionCount);
+   vector<thread> threads;
+   chrono::steady_clock::time_point started;
+   if (result == EXIT_SUCCESS)
+   {
+      for (int i = 0; i < connectionCount; ++i)
+      {
+         threads.push_back(thread(runConnection, port, i, &results[i]));
+      }
+      while (startFlag < connectionCount)
+      {
+         this_thread::sleep_for(chrono::milliseconds(1));
+      }
+      started = chrono::steady_clock::now();
+      startFlag = -1;
+      for (thread &client : threads)
+      {
+         client.join();
+      }
+      double elapsed = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+      report(results, elapsed);
+      for (const Results &connection : results)
+      {
+         if (connection.failed)
+         {
+            result = EXIT_FAILURE;
+         }
+      }
+   }
+
+   if (server != -1)
+   {
+      stopServer(server);
+      removeSpool(spool);
+   }
+   return result;
+}
+
+// "send,list,read,del" weights, at least one of them positive
+int parseMix(const char *text)
+{
+   int weights[COMMANDS];
+   if (sscanf(text, "%d,%d,%d,%d", &weights[0], &weights[1], &weights[2], &weights[3]) != COMMANDS)
+   {
+      return -1;
+   }
+   int total = 0;
+   for (int i = 0; i < COMMANDS; ++i)
+   {
+      if (weights[i] < 0)
+      {
+         return -1;
+      }
+      total += weights[i];
+      mix[i] = weights[i];
+   }
+   return total > 0 ? 0 : -1;
+}
+
+// "n" or "min-max" bytes of message body
+int parseSize(const char *text)
+{
+   long low, high;
+   int fields = sscanf(text, "%ld-%ld", &low, &high);
+   if (fields == 1)
+   {
+      high = low;
+   }
+   if (fields < 1 || low < 1 || high < low)
+   {
+      return -1;
+   }
+   minSize = low;
+   maxSize = high;
+   return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SERVER PROCESS
+
+// binds port 0 and hands out what the kernel chose; -1 on error
+int findFreePort()
+{
+   struct sockaddr_in address;
+   socklen_t length = sizeof(address);
+   int fd = socket(AF_INET, SOCK_STREAM, 0);
+   memset(&address, 0, sizeof(address));
+   address.sin_family = AF_INET;
+   address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (fd == -1 || bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+       getsockname(fd, (struct sockaddr *)&address, &length) == -1)
+   {
+      perror("find free port");
+      if (fd != -1)
+      {
+         close(fd);
+      }
+      return -1;
+   }
+   close(fd);
+   return ntohs(address.sin_port);
+}
+
+// Runs the server in the temporary directory, with its spool below it, and
+// waits until it accepts connections; its stdout is discarded. -1 on error
+pid_t startServer(const string &spool, int port)
+{
+   char binary[PATH_MAX];
+   if (realpath(serverPath.c_str(), binary) == NULL)
+   {
+      perror(serverPath.c_str());
+      return -1;
+   }
+
+   pid_t pid = fork();
+   if (pid == -1)
+   {
+      perror("fork");
+      return -1;
+   }
+   if (pid == 0)
+   {
+      vector<char *> args;
+      string portText = to_string(port);
+      args.push_back(binary);
+      for (string &arg : serverArgs)
+      {
+         args.push_back(&arg[0]);
+      }
+      args.push_back(&portText[0]);
+      char spoolName[] = "spool";
+      args.push_back(spoolName);
+      args.push_back(NULL);
+
+      int null = open("/dev/null", O_WRONLY);
+      if (chdir(spool.c_str()) == -1 || null == -1 || dup2(null, STDOUT_FILENO) == -1)
+      {
+         perror("prepare server");
+         _exit(EXIT_FAILURE);
+      }
+      execv(binary, args.data());
+      perror("exec server");
+      _exit(EXIT_FAILURE);
+   }
+
+   for (int attempt = 0; attempt < 100; ++attempt)
+   {
+      // connect() reads the whole welcome message
+      twmailer::Client probe("127.0.0.1", port, lineProtocol);
+      if (probe.connect() == 0)
+      {
+         return pid;
+      }
+      int status;
+      if (waitpid(pid, &status, WNOHANG) == pid)
+      {
+         fprintf(stderr, "server exited on startup\n");
+         return -1;
+      }
+      this_thread::sleep_for(chrono::milliseconds(50));
+   }
+   fprintf(stderr, "server did not come up\n");
+   stopServer(pid);
+   return -1;
+}
+
+void stopServer(pid_t pid)
+{
+   kill(pid, SIGTERM);
+   waitpid(pid, NULL, 0);
+}
+
+static int removeEntry(const char *path, const struct stat *, int, struct FTW *)
+{
+   return remove(path);
+}
+
+int removeSpool(const string &spool)
+{
+   if (nftw(spool.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS) == -1)
+   {
+      perror("remove temporary spool");
+      return -1;
+   }
+   return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WORKLOAD
+
+int pickUser(mt19937_64 &generator)
+{
+   double draw = uniform_real_distribution<double>(0, 1)(generator);
+   size_t user = upper_bound(userCdf.begin(), userCdf.end(), draw) - userCdf.begin();
+   return min(user, userCdf.size() - 1);
+}
+
+// READ and DEL pick any number ever sent to the user, so they also hit
+// messages that were deleted in between and get ERR answers
+void buildRequest(Command command, mt19937_64 &generator, vector<string> &request)
+{
+   int user = pickUser(generator);
+   string username = "user" + to_string(user);
+   long count = messageCounts[user];
+
+   switch (command)
+   {
+   case COMMAND_SEND:
+   {
+      size_t size = uniform_int_distribution<size_t>(minSize, maxSize)(generator);
+      request.resize(5);
+      request[1] = "bench";
+      request[2] = username;
+      request[3] = "bench " + to_string(generator() % 100000);
+      request[4].assign(bodyText, 0, size);
+      messageCounts[user]++;
+      break;
+   }
+   case COMMAND_LIST:
+      request.resize(2);
+      request[1] = username;
+      break;
+   case COMMAND_READ:
+   case COMMAND_DEL:
+      request.resize(3);
+      request[1] = username;
+      request[2] = to_string(count > 0 ? generator() % count + 1 : 1);
+      break;
+   }
+   request[0] = commandNames[command];
+}
+
+// sends prefill messages to every user, pipelined in batches
+int prefillSpool(int port)
+{
+   twmailer::Client client("127.0.0.1", port, lineProtocol);
+   if (prefill == 0)
+   {
+      return 0;
+   }
+   if (client.connect() == -1)
+   {
+      return -1;
+   }
+
+   mt19937_64 generator(seed);
+   vector<string> request(5);
+   twmailer::Reply reply;
+   int result = 0;
+   for (int user = 0; user < userCount && result == 0; ++user)
+   {
+      for (int i = 0; i < prefill && result == 0; ++i)
+      {
+         size_t size = uniform_int_distribution<size_t>(minSize, maxSize)(generator);
+         request[0] = "SEND";
+         request[1] = "bench";
+         request[2] = "user" + to_string(user);
+         request[3] = "prefill " + to_string(i);
+         request[4].assign(bodyText, 0, size);
+         client.submit(request);
+         messageCounts[user]++;
+         bool last = user == userCount - 1 && i == prefill - 1;
+         if (client.pending() < PREFILL_BATCH && !last)
+         {
+            continue;
+         }
+         result = client.flush();
+         while (client.pending() > 0 && result == 0)
+         {
+            result = client.receive(reply) == 0 && reply.ok ? 0 : -1;
+         }
+      }
+   }
+   return result;
+}
+
+// Closed loop: one request at a time, the next one goes out as soon as the
+// answer is in. Latency is measured from before the send to the status line.
+void runConnection(int port, int index, Results *results)
+{
+   twmailer::Client client("127.0.0.1", port, lineProtocol);
+   mt19937_64 generator(seed + 1 + index);
+   discrete_distribution<int> commands(mix, mix + COMMANDS);
+   vector<string> request;
+   twmailer::Reply reply;
+
+   for (int i = 0; i < COMMANDS; ++i)
+   {
+      results->errors[i] = 0;
+   }
+   results->failed = client.connect() == -1;
+   startFlag++;
+   while (startFlag >= 0)
+   {
+      this_thread::sleep_for(chrono::microseconds(100));
+   }
+   if (results->failed)
+   {
+      fprintf(stderr, "connection %d could not be set up\n", index);
+      return;
+   }
+
+   auto deadline = chrono::steady_clock::now() + chrono::duration<double>(duration);
+   for (long done = 0; duration > 0 ? chrono::steady_clock::now() < deadline : done < requestsPerConnection; ++done)
+   {
+      Command command = (Command)commands(generator);
+      buildRequest(command, generator, request);
+      auto sent = chrono::steady_clock::now();
+      client.submit(request);
+      if (client.flush() == -1 || client.receive(reply) == -1)
+      {
+         fprintf(stderr, "connection %d broke\n", index);
+         results->failed = true;
+         break;
+      }
+      results->latencies[command].push_back(
+         chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - sent).count());
+      results->errors[command] += !reply.ok;
+   }
+   // the client says QUIT when it goes out of scope
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// REPORT
+
+// the smallest latency at least share of the requests stayed within
+uint32_t percentile(const vector<uint32_t> &sorted, double share)
+{
+   if (sorted.empty())
+   {
+      return 0;
+   }
+   size_t rank = (size_t)ceil(share * sorted.size());
+   return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+// prints a table and, with --json, writes the same numbers as JSON
+void report(const vector<Results> &results, double elapsed)
+{
+   vector<uint32_t> merged[COMMANDS + 1];   // the last one holds every command
+   long errors[COMMANDS + 1] = {};
+   for (const Results &connection : results)
+   {
+      for (int i = 0; i < COMMANDS; ++i)
+      {
+         merged[i].insert(merged[i].end(), connection.latencies[i].begin(), connection.latencies[i].end());
+         merged[COMMANDS].insert(merged[COMMANDS].end(), connection.latencies[i].begin(), connection.latencies[i].end());
+         errors[i] += connection.errors[i];
+         errors[COMMANDS] += connection.errors[i];
+      }
+   }
+
+   string json = "{\n";
+   json += "  \"connections\": " + to_string(connectionCount) + ",\n";
+   json += "  \"users\": " + to_string(userCount) + ",\n";
+   json += "  \"zipf\": " + to_string(zipfExponent) + ",\n";
+   json += "  \"size_min\": " + to_string(minSize) + ",\n";
+   json += "  \"size_max\": " + to_string(maxSize) + ",\n";
+   json += "  \"elapsed_s\": " + to_string(elapsed) + ",\n";
+   json += "  \"commands\": {\n";
+
+   printf("%d connections, %d users (%s), %zu-%zu byte messages, %.3f s\n",
+          connectionCount, userCount, zipfExponent > 0 ? "zipf" : "uniform", minSize, maxSize, elapsed);
+   printf("%-7s %9s %7s %11s %9s %9s %9s %9s\n",
+          "command", "requests", "errors", "requests/s", "p50 us", "p99 us", "p999 us", "max us");
+   for (int i = 0; i <= COMMANDS; ++i)
+   {
+      vector<uint32_t> &sorted = merged[i];
+      sort(sorted.begin(), sorted.end());
+      const char *name = i < COMMANDS ? commandNames[i] : "total";
+      double rate = elapsed > 0 ? sorted.size() / elapsed : 0;
+      printf("%-7s %9zu %7ld %11.1f %9u %9u %9u %9u\n",
+             name, sorted.size(), errors[i], rate,
+             percentile(sorted, 0.5), percentile(sorted, 0.99), percentile(sorted, 0.999),
+             sorted.empty() ? 0 : sorted.back());
+
+      json += string("    \"") + name + "\": {\"requests\": " + to_string(sorted.size()) +
+              ", \"errors\": " + to_string(errors[i]) +
+              ", \"requests_per_s\": " + to_string(rate) +
+              ", \"p50_us\": " + to_string(percentile(sorted, 0.5)) +
+              ", \"p99_us\": " + to_string(percentile(sorted, 0.99)) +
+              ", \"p999_us\": " + to_string(percentile(sorted, 0.999)) +
+              ", \"max_us\": " + to_string(sorted.empty() ? 0 : sorted.back()) + "}" +
+              (i < COMMANDS ? ",\n" : "\n");
+   }
+   json += "  }\n}\n";
+
+   if (jsonPath == NULL)
+   {
+      return;
+   }
+   FILE *out = strcmp(jsonPath, "-") == 0 ? stdout : fopen(jsonPath, "w");
+   if (out == NULL)
+   {
+      perror(jsonPath);
+      return;
+   }
+   fputs(json.c_str(), out);
+   if (out != stdout)
+   {
+      fclose(out);
+   }
+}
@@ -1,135 +1,198 @@
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 #include <iostream>
+#include <fstream>
 #include <sstream>
+#include <vector>
+#include <deque>
+#include "twmailer.h"
 using namespace std;
+using twmailer::Client;
+using twmailer::Reply;
 
 ///////////////////////////////////////////////////////////////////////////////
 
-#define BUF 1024
 #define PORT 6543
+#define PROTO_FRAMED "FRAMED/1"
+#define BATCH_PIPELINE 64       // default --pipeline in batch mode
+#define BATCH_FLUSH (64 * 1024) // queued request bytes sent in one go
 
 ///////////////////////////////////////////////////////////////////////////////
-int sendCommand(int socket);
-int listCommand(int socket);
-int readCommand(int socket);
-int delCommand(int socket);
-int specificMessage(int socket);
+
+int pipelineDepth = 1;  // requests allowed in flight before waiting
+unsigned nextRequestId = 1;
+
+///////////////////////////////////////////////////////////////////////////////
+int sendCommand(Client &client);
+int listCommand(Client &client, const string &command);
+int readCommand(Client &client);
+int delCommand(Client &client);
+int searchCommand(Client &client);
+int waitCommand(Client &client);
+int specificMessage(Client &client, vector<string> &request);
+int sendRequest(Client &client, const vector<string> &request);
+int receiveReplies(Client &client, size_t keep);
+void printReply(const Reply &reply);
+int runBatch(Client &client, istream &input);
+int parseRecord(const string &line, vector<string> &request);
+string escapeField(const string &field);
 
 int main(int argc, char **argv)
 {
-   int create_socket;
-   char buffer[BUF];
-   struct sockaddr_in address;
-   int size;
    int isQuit = 0;
+   int option;
+   int wantFramed = 0;
+   int pipelineGiven = 0;
+   const char *batchFile = NULL;   // "-" for --stdin
+
+   const char *usage = "Usage: ./twmailer-client [--framed] [--pipeline n] [--batch file | --stdin] <ip> <port>";
+
+   static struct option longOptions[] = {
+      {"framed", no_argument, NULL, 'f'},
+      {"pipeline", required_argument, NULL, 'p'},
+      {"batch", required_argument, NULL, 'b'},
+      {"stdin", no_argument, NULL, 'i'},
+      {NULL, 0, NULL, 0}};
+
+   while ((option = getopt_long(argc, argv, "fp:b:i", longOptions, NULL)) != -1)
+   {
+      switch (option)
+      {
+      case 'f':
+         wantFramed = 1;
+         break;
+      case 'p':
+         pipelineDepth = atoi(optarg);
+         pipelineGiven = 1;
+         if (pipelineDepth <= 0)
+         {
+            cerr << "Invalid pipeline depth - must be a positive number";
+            return EXIT_FAILURE;
+         }
+         break;
+      case 'b':
+         batchFile = optarg;
+         break;
+      case 'i':
+         batchFile = "-";
+         break;
+      default:
+         cerr << usage;
+         return EXIT_FAILURE;
+      }
+   }
 
-   if(argc != 3){
-      cerr << "Usage: ./twmailer-client <ip> <port>";
+   if(argc - optind != 2){
+      cerr << usage;
       return EXIT_FAILURE;
    }
 
-   std::istringstream iss(argv[2]);
+   std::istringstream iss(argv[optind + 1]);
    int port;
    if(!(iss >> port)){
       cerr << "Invalid port - not a number";
       return EXIT_FAILURE;
    }
-   ////////////////////////////////////////////////////////////////////////////
-   // CREATE A SOCKET
-   // https://man7.org/linux/man-pages/man2/socket.2.html
-   // https://man7.org/linux/man-pages/man7/ip.7.html
-   // https://man7.org/linux/man-pages/man7/tcp.7.html
-   // IPv4, TCP (connection oriented), IP (same as server)
-   if ((create_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+
+   // batch mode: binary safe framing and a deep pipeline unless told otherwise
+   ifstream batchInput;
+   if (batchFile != NULL)
    {
-      perror("Socket error");
-      return EXIT_FAILURE;
+      wantFramed = 1;
+      if (!pipelineGiven)
+      {
+         pipelineDepth = BATCH_PIPELINE;
+      }
+      if (strcmp(batchFile, "-") != 0)
+      {
+         batchInput.open(batchFile);
+         if (!batchInput)
+         {
+            perror(batchFile);
+            return EXIT_FAILURE;
+         }
+      }
    }
-
-   ////////////////////////////////////////////////////////////////////////////
-   // INIT ADDRESS
-   // Attention: network byte order => big endian
-   memset(&address, 0, sizeof(address)); // init storage with 0
-   address.sin_family = AF_INET;         // IPv4
-   // https://man7.org/linux/man-pages/man3/htons.3.html
-   address.sin_port = htons(port);
-   inet_aton(argv[1], &address.sin_addr); //127.0.0.1 for now
-   // https://man7.org/linux/man-pages/man3/inet_aton.3.html
-
    ////////////////////////////////////////////////////////////////////////////
    // CREATE A CONNECTION
-   // https://man7.org/linux/man-pages/man2/connect.2.html
-   if (connect(create_socket,
-               (struct sockaddr *)&address,
-               sizeof(address)) == -1)
+   // the library resolves the address, reads the welcome message and
+   // switches to the framed protocol if asked to and offered
+   twmailer::ClientOptions options;
+   options.framed = wantFramed;
+   Client client(argv[optind], port, options);
+   if (client.connect() == -1)
    {
       // https://man7.org/linux/man-pages/man3/perror.3.html
       perror("Connect error - no server available");
       return EXIT_FAILURE;
    }
-
-   // ignore return value of printf
-   printf("Connection with server (%s) established\n",
-          inet_ntoa(address.sin_addr));
-
-   ////////////////////////////////////////////////////////////////////////////
-   // RECEIVE DATA
-   // https://man7.org/linux/man-pages/man2/recv.2.html
-   size = recv(create_socket, buffer, BUF - 1, 0);
-   if (size == -1)
-   {
-      perror("recv error");
-   }
-   else if (size == 0)
+   if (wantFramed && !client.framed())
    {
-      printf("Server closed remote socket\n"); // ignore error
+      fprintf(stderr, "Server does not offer %s - using the line protocol\n", PROTO_FRAMED);
    }
-   else
+
+   if (batchFile != NULL)
    {
-      buffer[size] = '\0';
-      printf("%s", buffer); // ignore error
+      int failed = runBatch(client, batchInput.is_open() ? batchInput : cin);
+      return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
    }
-   memset(buffer, 0, BUF);
+
+   // ignore return value of printf
+   printf("Connection with server (%s) established\n", argv[optind]);
+   printf("%s", client.welcome().c_str());
 
    do
    {
       printf(">> ");
       string command;
-      getline(cin, command);
+      if (!getline(cin, command))
+      {
+         command = "QUIT"; // end of input
+      }
       if(command=="SEND"){
-        if(sendCommand(create_socket) == -1){
+        if(sendCommand(client) == -1){
             continue;
         }
       }
-      else if(command=="LIST"){
-         if(listCommand(create_socket) == -1){
+      else if(command=="LIST" || command.compare(0, 5, "LIST ")==0){
+         if(listCommand(client, command) == -1){
             continue;
         }
       }
       else if(command=="READ"){
-         if(readCommand(create_socket) == -1){
+         if(readCommand(client) == -1){
             continue;
         }
       }
       else if(command=="DEL"){
-         if(delCommand(create_socket) == -1){
+         if(delCommand(client) == -1){
+            continue;
+        }
+      }
+      else if(command=="SEARCH"){
+         if(searchCommand(client) == -1){
+            continue;
+        }
+      }
+      else if(command=="WAIT"){
+         if(waitCommand(client) == -1){
+            continue;
+        }
+      }
+      else if(command=="STATS" || command=="STATS JSON"){
+         if(sendRequest(client, {command}) == -1){
             continue;
         }
       }
       else if(command=="QUIT"){
          isQuit = 1;
-         if ((send(create_socket, "QUIT", 4, 0)) == -1) 
-            {
-               perror("send error");
-               return -1;
-            }
+         // every outstanding answer is printed before leaving; the client
+         // says QUIT to the server when it is destroyed
+         receiveReplies(client, 0);
       } else {
          cout << "No valid command!" << endl;
          continue;
@@ -138,102 +201,44 @@ int main(int argc, char **argv)
          //////////////////////////////////////////////////////////////////////
          // RECEIVE FEEDBACK
          // consider: reconnect handling might be appropriate in somes cases
-         //           How can we determine that the command sent was received 
-         //           or not? 
-         //           - Resend, might change state too often. 
+         //           How can we determine that the command sent was received
+         //           or not?
+         //           - Resend, might change state too often.
          //           - Else a command might have been lost.
          //
          // solution 1: adding meta-data (unique command id) and check on the
          //             server if already processed.
          // solution 2: add an infrastructure component for messaging (broker)
          //
+         // pipelining: with more than one request allowed in flight, answers
+         // are only waited for once the window is full; any that already
+         // arrived are printed right away
          if(!isQuit){
-
-            while(true){
-               size = recv(create_socket, buffer, BUF - 1, 0);
-               //cout << "currently in buffer: --> "<<buffer << "-->END"<<endl;
-               /*if(strncmp("OK", buffer, 3)==0||strncmp("ERR", buffer, 4)==0){
-                  printf("<< %s\n", buffer);
-                  break;
-               }*/
-
-            if (size == -1)
-            {
-               perror("recv error");
-               break;
-            }
-            else if (size == 0)
+            if (receiveReplies(client, pipelineDepth - 1) == -1)
             {
-               printf("Server closed remote socket\n"); // ignore error
                break;
             }
-            else
-            {
-               buffer[size] = '\0';
-               printf("%s\n", buffer);
-
-               //Buffer doesnt receive line by line: check if OK or ERR is contained anywhere in there.
-               char *output = NULL;
-               output = strstr (buffer,"<< OK");
-               if(output) {
-                  //printf("<< OK\n");
-                  break;
-               }
-               output = strstr (buffer,"<< ERR");
-               if(output) {
-                  //printf("<< ERR\n");
-                  break;
-               }
-            }
-            memset(buffer, 0, BUF);
-            }
          }
    } while (!isQuit);
 
-   ////////////////////////////////////////////////////////////////////////////
-   // CLOSES THE DESCRIPTOR
-   if (create_socket != -1)
-   {
-      if (shutdown(create_socket, SHUT_RDWR) == -1)
-      {
-         // invalid in case the server is gone already
-         perror("shutdown create_socket"); 
-      }
-      if (close(create_socket) == -1)
-      {
-         perror("close create_socket");
-      }
-      create_socket = -1;
-   }
-
    return EXIT_SUCCESS;
 }
 // -----------------------Functions for user input and sending-------------------------------
-int sendCommand(int socket){
-   if ((send(socket, "SEND", 4, 0)) == -1) 
-      {
-         perror("send error");
-         return -1;
-      }
+// Every command is collected completely before anything is sent, so the
+// request goes out in one piece in either protocol.
+int sendCommand(Client &client){
+   vector<string> request = {"SEND"};
 
    string sender;
    cout << "Sender: ";
    getline(cin, sender);
-   if ((send(socket, sender.c_str(), sender.size(), 0)) == -1) 
-      {
-         perror("send error");
-         return -1;
-      }
-   
+   request.push_back(sender);
+
    string receiver;
    cout << "Receiver: ";
    getline(cin, receiver);
-   if ((send(socket, receiver.c_str(), receiver.size(), 0)) == -1) 
-      {
-         perror("send error");
-         return -1;
-      }
-   
+   request.push_back(receiver);
+
    string subject;
    cout << "Subject(max. 80 chars): ";
    getline(cin, subject);
@@ -241,95 +246,295 @@ int sendCommand(int socket){
       perror("Maximum size of 80 characters for subject!\n");
       return -1;
    }
-   if ((send(socket, subject.c_str(), subject.size(), 0)) == -1) 
-      {
-         perror("send error");
-         return -1;
-      }
-   
-   string message;
+   request.push_back(subject);
+
+   string message, body;
     std::cout << "Message (end with '.' on new line.):\n";
-    while (true) {
-        getline(cin, message);
-        if ((send(socket, message.c_str(), message.size(), 0)) == -1) 
-         {
-            perror("send error");
-            return -1;
-         }
+    while (getline(cin, message)) {
          if (message == ".")
             break;
+         body += message + "\n";
     }
-   
-   return 1;
-}
+   request.push_back(body);
 
-int listCommand(int socket){
-   if ((send(socket, "LIST", 4, 0)) == -1) 
+   if (sendRequest(client, request) == -1)
       {
-         perror("send error");
          return -1;
       }
-   
+   return 1;
+}
+
+// "LIST <offset> <count>" and "LIST SINCE <token>" are passed on as typed
+int listCommand(Client &client, const string &command){
+   vector<string> request = {command};
+
    string username;
    cout << "Username: ";
    getline(cin, username);
-   if ((send(socket, username.c_str(), username.size(), 0)) == -1) 
+   request.push_back(username);
+   if (sendRequest(client, request) == -1)
       {
-         perror("send error");
          return -1;
       }
 
    return 1;
 }
 
-int readCommand(int socket){
-   if ((send(socket, "READ", 4, 0)) == -1) 
-      {
-         perror("send error");
-         return -1;
-      }
-   
-   if(specificMessage(socket)==-1){
+int readCommand(Client &client){
+   vector<string> request = {"READ"};
+
+   if(specificMessage(client, request)==-1){
       return -1;
    }
-   
+
    return 1;
 }
 
-int delCommand(int socket){
-   if ((send(socket, "DEL", 4, 0)) == -1) 
+int delCommand(Client &client){
+   vector<string> request = {"DEL"};
+
+   if(specificMessage(client, request)==-1){
+      return -1;
+   }
+
+   return 1;
+}
+
+int searchCommand(Client &client){
+   vector<string> request = {"SEARCH"};
+
+   string username;
+   cout << "Username: ";
+   getline(cin, username);
+   request.push_back(username);
+
+   string terms;
+   cout << "Search terms: ";
+   getline(cin, terms);
+   request.push_back(terms);
+   if (sendRequest(client, request) == -1)
       {
-         perror("send error");
          return -1;
       }
-   
-   if(specificMessage(socket)==-1){
-      return -1;
-   }
-   
+
    return 1;
 }
 
-int specificMessage(int socket){
+// blocks until the server answers: new mail or the timeout
+int waitCommand(Client &client){
+   vector<string> request = {"WAIT"};
+
    string username;
    cout << "Username: ";
    getline(cin, username);
-   if ((send(socket, username.c_str(), username.size(), 0)) == -1) 
+   request.push_back(username);
+
+   string timeout;
+   cout << "Timeout (seconds): ";
+   getline(cin, timeout);
+   request.push_back(timeout);
+   if (sendRequest(client, request) == -1)
       {
-         perror("send error");
          return -1;
       }
-   
+
+   return 1;
+}
+
+int specificMessage(Client &client, vector<string> &request){
+   string username;
+   cout << "Username: ";
+   getline(cin, username);
+   request.push_back(username);
+
    string msgNumber;
    cout << "Number of message: ";
    getline(cin, msgNumber);
-   if ((send(socket, msgNumber.c_str(), msgNumber.size(), 0)) == -1) 
+   request.push_back(msgNumber);
+   if (sendRequest(client, request) == -1)
       {
-         perror("send error");
          return -1;
       }
-   
+
    return 1;
 }
 
+// request[0] is the command, the rest its fields; a SEND body is the last
+// field and holds "\n"-terminated lines
+int sendRequest(Client &client, const vector<string> &request){
+   // tag pipelined requests so their answers can be told apart
+   string id;
+   if (pipelineDepth > 1) {
+      id = to_string(nextRequestId++);
+   }
+   if (client.submit(request, id) == -1) {
+      perror("invalid request");
+      return -1;
+   }
+   if (client.flush() == -1) {
+      perror("send error");
+      return -1;
+   }
+   return 0;
+}
+
+// prints answers until at most keep requests are still in flight; answers
+// that are already available are printed even if that is not necessary
+int receiveReplies(Client &client, size_t keep){
+   Reply reply;
+   while (client.pending() > 0 && (client.pending() > keep || client.replyReady())) {
+      if (client.receive(reply) == -1) {
+         printf("Server closed remote socket\n"); // ignore error
+         return -1;
+      }
+      printReply(reply);
+   }
+   return 0;
+}
+
+// the answer text, then "<< OK" or "<< ERR" and the request id if it had one
+void printReply(const Reply &reply){
+   printf("%s<< %s", reply.text.c_str(), reply.ok ? "OK" : "ERR");
+   if (!reply.id.empty()) {
+      printf(" #%s", reply.id.c_str());
+   }
+   printf("\n");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// BATCH MODE
+// --batch <file> or --stdin read one request per line instead of prompting.
+// The fields are separated by tabs; inside a field "\n", "\t" and "\\"
+// stand for a newline, a tab and a backslash:
+//
+//    SEND<TAB>sender<TAB>receiver<TAB>subject<TAB>body
+//    LIST<TAB>user | READ<TAB>user<TAB>nr | DEL<TAB>user<TAB>nr
+//    LIST offset count<TAB>user | LIST SINCE token<TAB>user
+//    SEARCH<TAB>user<TAB>terms | WAIT<TAB>user<TAB>seconds [token]
+//    STATS | STATS JSON
+//
+// Empty lines and lines starting with '#' are skipped. All requests go over
+// the one connection, up to --pipeline of them in flight (64 by default
+// here), and are sent in batches of BATCH_FLUSH bytes. Every request gets
+// one line on stdout, in input order:
+//
+//    <input line number><TAB>OK|ERR<TAB><answer text, escaped the same way>
+//
+// A line that is not a valid request is answered with ERR locally.
+
+string escapeField(const string &field){
+   string escaped;
+   escaped.reserve(field.size());
+   for (char c : field) {
+      if (c == '\n') {
+         escaped += "\\n";
+      } else if (c == '\t') {
+         escaped += "\\t";
+      } else if (c == '\\') {
+         escaped += "\\\\";
+      } else {
+         escaped += c;
+      }
+   }
+   return escaped;
+}
+
+// splits and unescapes a record; -1 if it is not a well-formed request
+int parseRecord(const string &line, vector<string> &request){
+   request.assign(1, string());
+   for (size_t i = 0; i < line.size(); ++i) {
+      char c = line[i];
+      if (c == '\t') {
+         request.push_back(string());
+      } else if (c != '\\') {
+         request.back() += c;
+      } else if (++i < line.size() && (line[i] == 'n' || line[i] == 't' || line[i] == '\\')) {
+         request.back() += line[i] == 'n' ? '\n' : line[i] == 't' ? '\t' : '\\';
+      } else {
+         return -1;
+      }
+   }
+
+   size_t expected;
+   const string &command = request[0];
+   if (command == "SEND") {
+      expected = 5;
+      // the body is a list of lines, like the one typed interactively
+      if (!request.back().empty() && request.back().back() != '\n') {
+         request.back() += '\n';
+      }
+   } else if (command == "LIST" || command.compare(0, 5, "LIST ") == 0) {
+      expected = 2;
+   } else if (command == "READ" || command == "DEL" || command == "SEARCH" || command == "WAIT") {
+      expected = 3;
+   } else if (command == "STATS" || command == "STATS JSON") {
+      expected = 1;
+   } else {
+      return -1;
+   }
+   return request.size() == expected ? 0 : -1;
+}
+
+// 0 if every request was answered OK, the number of the others, -1 if the
+// connection broke
+int runBatch(Client &client, istream &input){
+   deque<long> pending;   // input line numbers of the requests in flight
+   string line;
+   vector<string> request;
+   Reply reply;
+   long lineNumber = 0, requests = 0;
+   int failed = 0;
+
+   // sends what is queued and prints answers until at most keep are in flight
+   auto settle = [&](size_t keep) {
+      if (client.queuedBytes() > 0 && client.flush() == -1) {
+         perror("send error");
+         return -1;
+      }
+      while (pending.size() > keep) {
+         if (client.receive(reply) == -1) {
+            fprintf(stderr, "Server closed remote socket\n");
+            return -1;
+         }
+         if (!reply.ok) {
+            failed++;
+         }
+         printf("%ld\t%s\t%s\n", pending.front(), reply.ok ? "OK" : "ERR", escapeField(reply.text).c_str());
+         pending.pop_front();
+      }
+      return 0;
+   };
+
+   while (getline(input, line)) {
+      lineNumber++;
+      if (!line.empty() && line.back() == '\r') {
+         line.pop_back();
+      }
+      if (line.empty() || line[0] == '#') {
+         continue;
+      }
+      requests++;
+      if (parseRecord(line, request) == -1 || client.submit(request) == -1) {
+         // answered in order, after everything before it
+         if (settle(0) == -1) {
+            return -1;
+         }
+         printf("%ld\tERR\tinvalid request\n", lineNumber);
+         failed++;
+         continue;
+      }
+      pending.push_back(lineNumber);
+      if ((pending.size() >= (size_t)pipelineDepth || client.queuedBytes() >= BATCH_FLUSH) &&
+          settle(pipelineDepth - 1) == -1) {
+         return -1;
+      }
+   }
+   if (settle(0) == -1) {
+      return -1;
+   }
+   fflush(stdout);
+   fprintf(stderr, "%ld requests, %d failed\n", requests, failed);
+   return failed;
+}
+
 // ./twmailer-client 127.0.0.1 1
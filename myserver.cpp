@@ -1,8 +1,15 @@
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -13,6 +20,18 @@
 #include <fstream>
 #include <chrono>
 #include <thread>
+#include <vector>
+#include <atomic>
+#include <unordered_set>
+#include <unordered_map>
+#include <set>
+#include <mutex>
+#include <deque>
+#include <algorithm>
+#include "mailstore.h"
+#include "histogram.h"
+#include "commands.h"
+#include "log.h"
 
 using namespace std;
 
@@ -20,41 +39,611 @@ using namespace std;
 
 #define BUF 1024
 #define PORT 6543
+#define MAX_EVENTS 256
+#define MAX_LINE (1024 * 1024)
+#define MAX_FRAME (4 * 1024 * 1024)   // frame bytes held in memory; SEND bodies are streamed
+#define MAX_INPUT (4 * 1024 * 1024)   // stop reading above this many buffered bytes
+#define MAX_OUTPUT (4 * 1024 * 1024)  // stop parsing above this many queued bytes
+#define MAX_SEGMENT (64 * 1024)       // small replies are gathered into segments of this size
+#define MAX_IOVECS 64
+#define PROTO_FRAMED "FRAMED/1"
+#define MAX_WAIT 3600                 // seconds a WAIT may park its session
 
 ///////////////////////////////////////////////////////////////////////////////
 
-int abortRequested = 0;
-int create_socket = -1;
-int new_socket = -1;
+// what the session parser expects as the next line of the legacy protocol
+enum SessionState
+{
+   STATE_COMMAND,
+   STATE_FIELDS,
+   STATE_BODY,
+   STATE_DISCARD  // the rest of a rejected SEND body, up to its "."
+};
+
+// what the framed protocol parser expects next
+enum FrameState
+{
+   FRAME_HEADER,  // uint32 frame length + uint16 field count
+   FIELD_HEADER,  // uint32 field length
+   FIELD_DATA,
+   BODY_DATA,     // the body of a SEND, streamed into the session
+   BODY_DISCARD   // the body of a rejected SEND
+};
+
+// Growable byte ring used as the per-connection input buffer. Data is
+// received straight into the free space (two iovecs when it wraps) and the
+// parsers consume from the front without moving the remaining bytes.
+class RingBuffer
+{
+public:
+   RingBuffer() : data(4 * BUF), head(0), used(0) {}
+
+   size_t size() const { return used; }
+
+   // makes room for at least n more bytes; capacity stays a power of two
+   void reserve(size_t n)
+   {
+      if (used + n <= data.size())
+      {
+         return;
+      }
+      size_t capacity = data.size();
+      while (capacity < used + n)
+      {
+         capacity *= 2;
+      }
+      vector<char> grown(capacity);
+      peek(0, grown.data(), used);
+      data.swap(grown);
+      head = 0;
+   }
+
+   // the (up to two) free regions behind the stored bytes
+   int freeRegions(struct iovec *iov)
+   {
+      size_t tail = (head + used) % data.size();
+      size_t free = data.size() - used;
+      size_t first = min(free, data.size() - tail);
+      iov[0].iov_base = &data[tail];
+      iov[0].iov_len = first;
+      iov[1].iov_base = &data[0];
+      iov[1].iov_len = free - first;
+      return iov[1].iov_len > 0 ? 2 : 1;
+   }
+
+   void commit(size_t n) { used += n; }
+
+   // copies n bytes starting at offset without consuming them
+   void peek(size_t offset, char *dst, size_t n) const
+   {
+      size_t start = (head + offset) % data.size();
+      size_t first = min(n, data.size() - start);
+      memcpy(dst, &data[start], first);
+      memcpy(dst + first, &data[0], n - first);
+   }
+
+   void consume(size_t n)
+   {
+      head = (head + n) % data.size();
+      used -= n;
+   }
+
+   // offset of the first c at or after from, string::npos if none; the
+   // stored bytes are at most two spans, each searched with memchr()
+   size_t find(char c, size_t from = 0) const
+   {
+      if (from >= used)
+      {
+         return string::npos;
+      }
+      size_t start = (head + from) % data.size();
+      size_t first = min(used - from, data.size() - start);
+      const char *found = (const char *)memchr(&data[start], c, first);
+      if (found != NULL)
+      {
+         return from + (found - &data[start]);
+      }
+      found = (const char *)memchr(&data[0], c, used - from - first);
+      return found != NULL ? from + first + (found - &data[0]) : string::npos;
+   }
+
+   // the stored bytes up to the end of the ring, to be used in place
+   size_t front(const char **p) const
+   {
+      *p = &data[head];
+      return min(used, data.size() - head);
+   }
+
+   // moves n bytes from the front into dst
+   void take(string &dst, size_t n)
+   {
+      size_t start = dst.size();
+      dst.resize(start + n);
+      peek(0, &dst[start], n);
+      consume(n);
+   }
+
+private:
+   vector<char> data;
+   size_t head;
+   size_t used;
+};
+
+// Per-connection output queue. A reply is queued as a whole (large ones are
+// moved in, not copied) and everything queued is flushed with one sendmsg()
+// over an iovec per segment. Message bodies can be queued as file ranges,
+// which go out with sendfile() straight from the page cache. After a partial
+// write the first segment is resumed at the byte where the socket stopped.
+class OutBuffer
+{
+public:
+   OutBuffer() : offset(0), bytes(0), queued(0), sent(0) {}
+
+   size_t size() const { return bytes; }
+   bool empty() const { return bytes == 0; }
+
+   // small pieces are gathered in the last segment
+   void append(const char *data, size_t n)
+   {
+      if (n == 0)
+      {
+         return;
+      }
+      if (segments.empty() || segments.back().file.file ||
+          segments.back().data.size() + n > MAX_SEGMENT)
+      {
+         segments.emplace_back();
+      }
+      segments.back().data.append(data, n);
+      bytes += n;
+      queued += n;
+   }
+
+   void append(const string &data) { append(data.data(), data.size()); }
+
+   void append(string &&data)
+   {
+      if (data.size() < MAX_SEGMENT / 16)
+      {
+         append(data.data(), data.size());
+         return;
+      }
+      bytes += data.size();
+      queued += data.size();
+      segments.emplace_back();
+      segments.back().data = move(data);
+   }
+
+   void append(const FileRange &range)
+   {
+      if (!range.file || range.length == 0)
+      {
+         return;
+      }
+      bytes += range.length;
+      queued += range.length;
+      segments.emplace_back();
+      segments.back().file = range;
+   }
+
+   // bytes queued since the buffer was created, to mark a place for hold()
+   uint64_t position() const { return queued; }
+
+   // Holds everything queued from position on until the group commit has
+   // made ticket durable. Tickets only grow, so fences release in order.
+   void hold(uint64_t position, uint64_t ticket) { fences.push_back({position, ticket}); }
+
+   bool held() const { return !fences.empty(); }
+
+   // unsent bytes that may go out now that everything up to durable is synced
+   size_t ready(uint64_t durable)
+   {
+      while (!fences.empty() && fences.front().ticket <= durable)
+      {
+         fences.pop_front();
+      }
+      return fences.empty() ? bytes : fences.front().position - sent;
+   }
+
+   // the file range at the front, NULL if the front segment is in memory
+   const FileRange *frontFile() const
+   {
+      return segments.front().file.file ? &segments.front().file : NULL;
+   }
+
+   // bytes of the front segment already sent
+   size_t frontOffset() const { return offset; }
+
+   // describes at most limit unsent bytes up to the next file range with at
+   // most max iovecs
+   int pending(struct iovec *iov, int max, size_t limit) const
+   {
+      int count = 0;
+      size_t skip = offset;
+      for (auto segment = segments.begin(); segment != segments.end() && count < max && limit > 0; ++segment)
+      {
+         if (segment->file.file)
+         {
+            break;
+         }
+         iov[count].iov_base = (void *)(segment->data.data() + skip);
+         iov[count].iov_len = min(segment->data.size() - skip, limit);
+         limit -= iov[count].iov_len;
+         skip = 0;
+         count++;
+      }
+      return count;
+   }
+
+   // drops n bytes the socket accepted
+   void consume(size_t n)
+   {
+      bytes -= n;
+      sent += n;
+      while (n > 0)
+      {
+         const Segment &front = segments.front();
+         size_t left = (front.file.file ? front.file.length : front.data.size()) - offset;
+         if (n < left)
+         {
+            offset += n;
+            return;
+         }
+         n -= left;
+         offset = 0;
+         segments.pop_front();
+      }
+   }
+
+   // Fallback for descriptors sendfile() cannot handle: replaces the file
+   // range at the front by a copy of its unsent bytes. -1 on a read error
+   int copyFrontFile()
+   {
+      Segment &front = segments.front();
+      string data(front.file.length - offset, '\0');
+      size_t done = 0;
+      while (done < data.size())
+      {
+         ssize_t got = pread(front.file.file->fd, &data[done], data.size() - done,
+                             front.file.offset + offset + done);
+         if (got <= 0)
+         {
+            return -1;
+         }
+         done += got;
+      }
+      front.data = move(data);
+      front.file.file.reset();
+      offset = 0;
+      return 0;
+   }
+
+private:
+   struct Segment
+   {
+      string data;
+      FileRange file;   // set: the segment is these bytes of a file
+   };
+
+   struct Fence
+   {
+      uint64_t position;
+      uint64_t ticket;
+   };
+
+   deque<Segment> segments;
+   size_t offset;   // bytes of segments.front() already sent
+   size_t bytes;    // bytes not yet sent
+   uint64_t queued; // bytes ever queued
+   uint64_t sent;   // bytes ever sent
+   deque<Fence> fences;   // replies waiting for the group commit
+};
+
+// commands counted separately; anything unknown is COMMAND_OTHER
+enum CommandType
+{
+   COMMAND_SEND,
+   COMMAND_LIST,
+   COMMAND_READ,
+   COMMAND_DEL,
+   COMMAND_SEARCH,
+   COMMAND_WAIT,
+   COMMAND_QUIT,
+   COMMAND_STATS,
+   COMMAND_OTHER,
+   COMMAND_TYPES
+};
+
+const char *commandNames[COMMAND_TYPES] = {"SEND", "LIST", "READ", "DEL", "SEARCH", "WAIT", "QUIT", "STATS", "OTHER"};
+
+struct CommandStats
+{
+   CommandStats() : count(0), errors(0) {}
+
+   atomic<long> count;
+   atomic<long> errors;   // answered with ERR
+   Histogram latency;     // nanoseconds spent executing, without queueing
+};
+
+// resumable state of the framed protocol parser (see parseFrames)
+struct FrameParser
+{
+   FrameState state;
+   uint32_t frameRemaining;   // bytes of the current frame not yet parsed
+   uint16_t fieldsRemaining;  // fields of the current frame not yet started
+   uint32_t fieldRemaining;   // bytes of the current field not yet received
+   uint32_t buffered;         // bytes of the current frame held in fields
+   bool bodyStreamed;         // the last field went into the session's body
+   bool rejected;             // answered before it was complete
+   vector<string> fields;
+};
+
+struct Session;
+
+// one acceptor thread: its own SO_REUSEPORT listener and its own event loop
+struct Worker
+{
+   int id;
+   int listen_socket;
+   int wakeup_fd;                   // written to make epoll_wait() return
+   thread loop;
+   atomic<long> activeConnections;
+   atomic<long> acceptedConnections;
+   // socket syscalls of the event loop, to put against the commands served
+   atomic<long> commands;
+   atomic<long> pollCalls;
+   atomic<long> readCalls;
+   atomic<long> writeCalls;
+   atomic<long> sendfileCalls;
+   // Traffic and commands. Only the worker's own thread writes them, STATS
+   // and SIGUSR1 read them from any thread without stopping it.
+   atomic<long> bytesIn;
+   atomic<long> bytesOut;
+   atomic<long> protocolErrors;   // sessions dropped for a malformed request
+   atomic<long> socketErrors;     // sessions dropped for a failed read or write
+   CommandStats commandStats[COMMAND_TYPES];
+   // WAIT: parked sessions by deadline, touched by the worker's thread only,
+   // and those other workers found mail for, guarded by waitMutex
+   set<pair<chrono::steady_clock::time_point, Session *>> waitDeadlines;
+   vector<Session *> woken;
+   // receivers of SENDs whose group commit tickets are not durable yet, in
+   // ticket order; their waiters are told once the OK may go out
+   deque<pair<uint64_t, string>> undelivered;
+   atomic<long> waitingSessions;
+};
+
+// per-connection state, owned by the event loop of one worker
+struct Session
+{
+   int fd;
+   Worker *worker;
+   RingBuffer in;        // received but not yet parsed bytes
+   size_t scanned;       // leading bytes of in known to hold no newline
+   OutBuffer out;        // replies not yet accepted by the socket
+   bool framed;          // switched to the framed protocol by PROTO
+   FrameParser frame;
+   SessionState state;
+   string requestId;     // "#id" prefix of the current command, echoed in its reply
+   string command;
+   vector<string> fields;
+   size_t fieldsExpected;
+   MessageBody body;      // of a SEND, staged as it arrives
+   bool closing;         // QUIT seen: close as soon as out is flushed
+   bool waiting;         // parked in WAIT: nothing more is parsed until it is answered
+   string waitUser;
+   chrono::steady_clock::time_point waitDeadline;
+   bool readable;        // the socket may still hold unread data
+   bool eof;             // the client closed its sending side
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+atomic<int> abortRequested(0);
+int listenBacklog = SOMAXCONN;
+int workerCount = 1;
+vector<Worker *> workers;
 string mailSpool;
+string storageType = "flat";
+StoreOptions storeOptions = {0.5, 16 * 1024 * 1024, 64, false, LAYOUT_FLAT, 64 * 1024 * 1024};
+GroupCommitter *committer = NULL;   // --durability group
+uint64_t maxMessageBytes = 64 * 1024 * 1024;   // largest SEND body accepted
+mutex waitMutex;                    // guards waiters and the woken list of every worker
+unordered_map<string, vector<Session *>> waiters;   // sessions parked in WAIT, by user
+atomic<long> parkedSessions(0);     // spares SEND the lock while nobody waits
+LogOptions logOptions = {LEVEL_INFO, "", 64 * 1024 * 1024, 4, 100, false};
 
 ///////////////////////////////////////////////////////////////////////////////
 
-void *clientCommunication(void *data);
-void signalHandler(int sig);
-int processSend(int client_socket);
+int createListenSocket(int port);
+void runWorker(Worker *worker);
+int runEventLoop(Worker *worker);
+int acceptClients(Worker *worker, int epoll_fd, unordered_set<Session *> &sessions);
+void runSession(Session *session, unordered_set<Session *> &sessions, unordered_set<Session *> &held);
+int serviceSession(Session *session);
+int readSession(Session *session);
+int flushSession(Session *session);
+void closeSession(Session *session);
+int parseSession(Session *session);
+int parseLines(Session *session);
+int parseFrames(Session *session);
+void handleLine(Session *session, const string &line);
+void handleFrame(Session *session);
+void splitRequestId(const string &token, string &requestId, string &command);
+void executeCommand(Session *session);
+int stageBody(Session *session, const char *data, size_t length);
+void rejectSend(Session *session, const char *reason);
+void queueReply(Session *session, int result, string reply, const FileRange &body = FileRange());
+void appendFrame(OutBuffer &out, vector<string> &fields, const FileRange &payloadTail = FileRange());
+void wakeWorker(Worker *worker);
+int parkSession(Session *session, const string &username, const string &arguments, string &reply);
+void notifyWaiters(const string &username);
+void notifyDurable(Worker *worker);
+void unparkSession(Session *session);
+void finishWait(Session *session, const char *answer);
+int waitTimeout(Worker *worker);
+CommandType commandType(const string &command);
+string formatStats();
+string formatStatsJson();
+void printWorkerStats();
 int createMailSpool(string dirName);
-int writeUserFile(string username, string sender, string subject, string message);
-int processList(int client_socket);
-int processRead(int client_socket);
-int processDel(int client_socket);
 
 ///////////////////////////////////////////////////////////////////////////////
 
 int main(int argc, char **argv)
 {
-   socklen_t addrlen;
-   struct sockaddr_in address, cliaddress;
-   int reuseValue = 1;
+   int option;
+   const char *usage = "Usage: ./twmailer-server [--backlog n] [--workers n] [--storage flat|maildir] [--layout flat|sharded] [--compact-ratio r] [--cache-mb n] [--search-mb n] [--lock-stripes n] [--durability none|group] [--log-level error|warn|info|debug] [--log-file path] [--log-size-mb n] [--log-files n] [--log-rate n] [--log-bodies] [--max-message-mb n] <port> <mail-spool-directoryname>";
+
+   static struct option longOptions[] = {
+      {"backlog", required_argument, NULL, 'b'},
+      {"workers", required_argument, NULL, 'w'},
+      {"storage", required_argument, NULL, 's'},
+      {"layout", required_argument, NULL, 'y'},
+      {"compact-ratio", required_argument, NULL, 'c'},
+      {"cache-mb", required_argument, NULL, 'm'},
+      {"search-mb", required_argument, NULL, 'S'},
+      {"lock-stripes", required_argument, NULL, 'l'},
+      {"durability", required_argument, NULL, 'd'},
+      {"log-level", required_argument, NULL, 'L'},
+      {"log-file", required_argument, NULL, 'F'},
+      {"log-size-mb", required_argument, NULL, 'Z'},
+      {"log-files", required_argument, NULL, 'N'},
+      {"log-rate", required_argument, NULL, 'R'},
+      {"log-bodies", no_argument, NULL, 'B'},
+      {"max-message-mb", required_argument, NULL, 'M'},
+      {NULL, 0, NULL, 0}};
+
+   while ((option = getopt_long(argc, argv, "b:w:s:y:c:m:S:l:d:L:F:Z:N:R:BM:", longOptions, NULL)) != -1)
+   {
+      switch (option)
+      {
+      case 'b':
+         listenBacklog = atoi(optarg);
+         if (listenBacklog <= 0)
+         {
+            cerr << "Invalid backlog - must be a positive number";
+            return EXIT_FAILURE;
+         }
+         break;
+      case 'w':
+         workerCount = atoi(optarg);
+         if (workerCount <= 0)
+         {
+            cerr << "Invalid worker count - must be a positive number";
+            return EXIT_FAILURE;
+         }
+         break;
+      case 's':
+         storageType = optarg;
+         break;
+      case 'y':
+         if (strcmp(optarg, "flat") != 0 && strcmp(optarg, "sharded") != 0)
+         {
+            cerr << "Invalid layout - must be flat or sharded";
+            return EXIT_FAILURE;
+         }
+         storeOptions.layout = strcmp(optarg, "sharded") == 0 ? LAYOUT_SHARDED : LAYOUT_FLAT;
+         break;
+      case 'c':
+         storeOptions.compactRatio = atof(optarg);
+         if (storeOptions.compactRatio <= 0 || storeOptions.compactRatio > 1)
+         {
+            cerr << "Invalid compact ratio - must be in (0, 1]";
+            return EXIT_FAILURE;
+         }
+         break;
+      case 'm':
+         if (atoi(optarg) < 0)
+         {
+            cerr << "Invalid cache size - must not be negative";
+            return EXIT_FAILURE;
+         }
+         storeOptions.cacheBytes = (size_t)atoi(optarg) * 1024 * 1024;
+         break;
+      case 'S':
+         if (atoi(optarg) < 0)
+         {
+            cerr << "Invalid search index size - must not be negative";
+            return EXIT_FAILURE;
+         }
+         storeOptions.searchBytes = (size_t)atoi(optarg) * 1024 * 1024;
+         break;
+      case 'l':
+         if (atoi(optarg) <= 0)
+         {
+            cerr << "Invalid lock stripe count - must be a positive number";
+            return EXIT_FAILURE;
+         }
+         storeOptions.lockStripes = atoi(optarg);
+         break;
+      case 'd':
+         if (strcmp(optarg, "none") != 0 && strcmp(optarg, "group") != 0)
+         {
+            cerr << "Invalid durability - must be none or group";
+            return EXIT_FAILURE;
+         }
+         storeOptions.durable = strcmp(optarg, "group") == 0;
+         break;
+      case 'L':
+         logOptions.level = parseLogLevel(optarg);
+         if (logOptions.level == -1)
+         {
+            cerr << "Invalid log level - must be error, warn, info or debug";
+            return EXIT_FAILURE;
+         }
+         break;
+      case 'F':
+         logOptions.file = optarg;
+         break;
+      case 'Z':
+         if (atoi(optarg) <= 0)
+         {
+            cerr << "Invalid log size - must be a positive number";
+            return EXIT_FAILURE;
+         }
+         logOptions.rotateBytes = (size_t)atoi(optarg) * 1024 * 1024;
+         break;
+      case 'N':
+         logOptions.keepFiles = atoi(optarg);
+         if (logOptions.keepFiles < 0)
+         {
+            cerr << "Invalid log file count - must not be negative";
+            return EXIT_FAILURE;
+         }
+         break;
+      case 'R':
+         logOptions.ratePerSecond = atoi(optarg);
+         if (logOptions.ratePerSecond < 0)
+         {
+            cerr << "Invalid log rate - must not be negative";
+            return EXIT_FAILURE;
+         }
+         break;
+      case 'B':
+         logOptions.bodies = true;
+         break;
+      case 'M':
+         // mailbox index records hold 32-bit lengths
+         if (atoi(optarg) <= 0 || atoi(optarg) >= 4096)
+         {
+            cerr << "Invalid message size - must be between 1 and 4095";
+            return EXIT_FAILURE;
+         }
+         maxMessageBytes = (uint64_t)atoi(optarg) * 1024 * 1024;
+         break;
+      default:
+         cerr << usage;
+         return EXIT_FAILURE;
+      }
+   }
 
-   if(argc != 3){
-      argv = argv;
-      cerr << "Usage: ./twmailer-server <port> <mail-spool-directoryname>";
+   if(argc - optind != 2){
+      cerr << usage;
       return EXIT_FAILURE;
    }
 
    //get port from console argument: convert to int
-   std::istringstream iss(argv[1]);
+   std::istringstream iss(argv[optind]);
    int port;
    if(!(iss >> port)){
       cerr << "Invalid port - not a number";
@@ -62,23 +651,179 @@ int main(int argc, char **argv)
    }
 
    //mail directory name
-   string directory = argv[2];
+   string directory = argv[optind + 1];
    //set global varaible for mail spool directory
    mailSpool = directory;
    if(createMailSpool(directory)==-1){
       perror("Cannot create mail spool directory");
       return EXIT_FAILURE;
    }
+   // large bodies are staged next to the mailboxes they are copied into
+   MessageBody::stagingDirectory = mailSpool;
 
    ////////////////////////////////////////////////////////////////////////////
-   // SIGNAL HANDLER
-   // SIGINT (Interrup: ctrl+c)
-   // https://man7.org/linux/man-pages/man2/signal.2.html
-   if (signal(SIGINT, signalHandler) == SIG_ERR)
+   // SIGNAL HANDLING
+   // SIGINT (Interrup: ctrl+c), SIGTERM: shut down
+   // SIGUSR1: print the worker, command and store statistics
+   // The signals are blocked before any worker starts, so every thread
+   // inherits the mask and only the main thread receives them via sigwait().
+   // https://man7.org/linux/man-pages/man3/sigwait.3.html
+   sigset_t signals;
+   sigemptyset(&signals);
+   sigaddset(&signals, SIGINT);
+   sigaddset(&signals, SIGTERM);
+   sigaddset(&signals, SIGUSR1);
+   // an ignored signal is discarded before sigwait() could see it, and
+   // background jobs start with SIGINT ignored
+   signal(SIGINT, SIG_DFL);
+   signal(SIGTERM, SIG_DFL);
+   signal(SIGUSR1, SIG_DFL);
+   if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0)
    {
       perror("signal can not be registered");
       return EXIT_FAILURE;
    }
+   // a client vanishing mid-reply must not kill the server
+   signal(SIGPIPE, SIG_IGN);
+
+   // like every other thread, the log writer starts with the signals blocked
+   if (startLogger(logOptions) == -1)
+   {
+      perror("Cannot open log file");
+      return EXIT_FAILURE;
+   }
+
+   // the store may start background threads, which inherit the signal mask
+   mailStore = createMailStore(storageType, mailSpool, storeOptions);
+   if (mailStore == NULL)
+   {
+      cerr << "Invalid storage - must be flat or maildir";
+      stopLogger();
+      return EXIT_FAILURE;
+   }
+   if (mailStore->open() == -1)
+   {
+      perror("Cannot open mail store");
+      delete mailStore;
+      stopLogger();
+      return EXIT_FAILURE;
+   }
+
+   ////////////////////////////////////////////////////////////////////////////
+   // START WORKERS
+   // every worker binds its own listener to the same port; with SO_REUSEPORT
+   // the kernel spreads incoming connections across them
+   for (int i = 0; i < workerCount; ++i)
+   {
+      Worker *worker = new Worker();
+      worker->id = i;
+      worker->activeConnections = 0;
+      worker->acceptedConnections = 0;
+      worker->commands = 0;
+      worker->pollCalls = 0;
+      worker->readCalls = 0;
+      worker->writeCalls = 0;
+      worker->sendfileCalls = 0;
+      worker->bytesIn = 0;
+      worker->bytesOut = 0;
+      worker->protocolErrors = 0;
+      worker->socketErrors = 0;
+      worker->waitingSessions = 0;
+      worker->listen_socket = createListenSocket(port);
+      // https://man7.org/linux/man-pages/man2/eventfd.2.html
+      worker->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      workers.push_back(worker);
+      if (worker->listen_socket == -1 || worker->wakeup_fd == -1)
+      {
+         perror("worker setup failed");
+         abortRequested = 1;
+         break;
+      }
+      worker->loop = thread(runWorker, worker);
+   }
+
+   // Started once the worker list is complete, since every batch wakes all
+   // workers. SENDs accepted before are simply in the first batch.
+   if (storeOptions.durable)
+   {
+      committer = new GroupCommitter(mailStore);
+      committer->setCommitHandler([]() {
+         for (Worker *worker : workers)
+         {
+            wakeWorker(worker);
+         }
+      });
+      committer->start();
+   }
+
+   if (!abortRequested)
+   {
+      LOG(LEVEL_INFO, "Waiting for connections on %d worker(s)...", workerCount);
+   }
+
+   while (!abortRequested)
+   {
+      int sig;
+      if (sigwait(&signals, &sig) != 0)
+      {
+         continue;
+      }
+      if (sig == SIGUSR1)
+      {
+         printWorkerStats();
+         continue;
+      }
+      LOG(LEVEL_INFO, "abort Requested...");
+      abortRequested = 1;
+   }
+
+   // stop and join every worker, then the commit thread, which wakes them
+   for (Worker *worker : workers)
+   {
+      if (worker->loop.joinable())
+      {
+         wakeWorker(worker);
+         worker->loop.join();
+      }
+   }
+   delete committer;
+
+   // free every worker
+   for (Worker *worker : workers)
+   {
+      // frees the descriptor
+      if (worker->listen_socket != -1)
+      {
+         if (shutdown(worker->listen_socket, SHUT_RDWR) == -1 && errno != ENOTCONN)
+         {
+            perror("shutdown create_socket");
+         }
+         if (close(worker->listen_socket) == -1)
+         {
+            perror("close create_socket");
+         }
+      }
+      if (worker->wakeup_fd != -1)
+      {
+         close(worker->wakeup_fd);
+      }
+      delete worker;
+   }
+   workers.clear();
+
+   // only now that no worker can use it any more
+   delete mailStore;
+   stopLogger();
+
+   return EXIT_SUCCESS;
+}
+
+// creates a non-blocking, bound and listening socket; -1 on error
+int createListenSocket(int port)
+{
+   struct sockaddr_in address;
+   int reuseValue = 1;
+   int create_socket;
 
    ////////////////////////////////////////////////////////////////////////////
    // CREATE A SOCKET
@@ -86,10 +831,11 @@ int main(int argc, char **argv)
    // https://man7.org/linux/man-pages/man7/ip.7.html
    // https://man7.org/linux/man-pages/man7/tcp.7.html
    // IPv4, TCP (connection oriented), IP (same as client)
-   if ((create_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+   // non-blocking: the event loop accepts until EAGAIN
+   if ((create_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
    {
       perror("Socket error"); // errno set by socket()
-      return EXIT_FAILURE;
+      return -1;
    }
 
    ////////////////////////////////////////////////////////////////////////////
@@ -99,12 +845,13 @@ int main(int argc, char **argv)
    // socket, level, optname, optvalue, optlen
    if (setsockopt(create_socket,
                   SOL_SOCKET,
-                  SO_REUSEADDR, 
+                  SO_REUSEADDR,
                   &reuseValue,
                   sizeof(reuseValue)) == -1)
    {
       perror("set socket options - reuseAddr");
-      return EXIT_FAILURE;
+      close(create_socket);
+      return -1;
    }
 
    if (setsockopt(create_socket,
@@ -114,7 +861,8 @@ int main(int argc, char **argv)
                   sizeof(reuseValue)) == -1)
    {
       perror("set socket options - reusePort");
-      return EXIT_FAILURE;
+      close(create_socket);
+      return -1;
    }
 
    ////////////////////////////////////////////////////////////////////////////
@@ -130,535 +878,1379 @@ int main(int argc, char **argv)
    if (bind(create_socket, (struct sockaddr *)&address, sizeof(address)) == -1)
    {
       perror("bind error");
-      return EXIT_FAILURE;
+      close(create_socket);
+      return -1;
    }
 
    ////////////////////////////////////////////////////////////////////////////
    // ALLOW CONNECTION ESTABLISHING
    // Socket, Backlog (= count of waiting connections allowed)
-   if (listen(create_socket, 5) == -1)
+   if (listen(create_socket, listenBacklog) == -1)
    {
       perror("listen error");
-      return EXIT_FAILURE;
+      close(create_socket);
+      return -1;
    }
 
-   while (!abortRequested)
-   {
-      /////////////////////////////////////////////////////////////////////////
-      // ignore errors here... because only information message
-      // https://linux.die.net/man/3/printf
-      printf("Waiting for connections...\n");
-
-      /////////////////////////////////////////////////////////////////////////
-      // ACCEPTS CONNECTION SETUP
-      // blocking, might have an accept-error on ctrl+c
-      addrlen = sizeof(struct sockaddr_in);
-      if ((new_socket = accept(create_socket,
-                               (struct sockaddr *)&cliaddress,
-                               &addrlen)) == -1)
-      {
-         if (abortRequested)
-         {
-            perror("accept error after aborted");
-         }
-         else
-         {
-            perror("accept error");
-         }
-         break;
-      }
-
-      /////////////////////////////////////////////////////////////////////////
-      // START CLIENT
-      // ignore printf error handling
-      printf("Client connected from %s:%d...\n",
-             inet_ntoa(cliaddress.sin_addr),
-             ntohs(cliaddress.sin_port));
-      clientCommunication(&new_socket); // returnValue can be ignored
-      new_socket = -1;
-   }
+   return create_socket;
+}
 
-   // frees the descriptor
-   if (create_socket != -1)
+void runWorker(Worker *worker)
+{
+   if (runEventLoop(worker) == -1)
    {
-      if (shutdown(create_socket, SHUT_RDWR) == -1)
-      {
-         perror("shutdown create_socket");
-      }
-      if (close(create_socket) == -1)
-      {
-         perror("close create_socket");
-      }
-      create_socket = -1;
+      // a dead worker would silently drop its share of the connections
+      LOG(LEVEL_ERROR, "worker %d failed - shutting down", worker->id);
+      kill(getpid(), SIGTERM);
    }
-
-   return EXIT_SUCCESS;
 }
 
-void *clientCommunication(void *data)
+///////////////////////////////////////////////////////////////////////////////
+// EVENT LOOP
+// One edge-triggered epoll instance per worker multiplexes its listening
+// socket, its wakeup eventfd and every client session it accepted.
+// Handlers never block: sockets are non-blocking, input is buffered per
+// session until a full line is available and replies are queued until the
+// socket accepts them.
+// https://man7.org/linux/man-pages/man7/epoll.7.html
+
+int runEventLoop(Worker *worker)
 {
-   char buffer[BUF];
-   int size;
-   int *current_socket = (int *)data;
-
-   ////////////////////////////////////////////////////////////////////////////
-   // SEND welcome message
-   strcpy(buffer, "Welcome to myserver!\r\nPlease enter your commands: \n SEND, LIST, READ, DEL, QUIT...\r\n");
-   if (send(*current_socket, buffer, strlen(buffer), 0) == -1)
+   struct epoll_event event, events[MAX_EVENTS];
+   unordered_set<Session *> sessions;
+   unordered_set<Session *> held;   // sessions with replies waiting for the group commit
+   vector<Session *> released;
+   bool woken = false;
+   int epoll_fd;
+
+   if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
    {
-      perror("send failed");
-      return NULL;
+      perror("epoll_create1 error");
+      return -1;
    }
 
-   do
+   // data.ptr == &listen_socket / &wakeup_fd marks the two special descriptors
+   memset(&event, 0, sizeof(event));
+   event.events = EPOLLIN | EPOLLET;
+   event.data.ptr = &worker->listen_socket;
+   if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, worker->listen_socket, &event) == -1)
    {
-      /////////////////////////////////////////////////////////////////////////
-      // RECEIVE
-      size = recv(*current_socket, buffer, BUF - 1, 0);
-      if (size == -1)
-      {
-         if (abortRequested)
-         {
-            perror("recv error after aborted");
-         }
-         else
+      perror("epoll_ctl listen socket");
+      close(epoll_fd);
+      return -1;
+   }
+   event.events = EPOLLIN;
+   event.data.ptr = &worker->wakeup_fd;
+   if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, worker->wakeup_fd, &event) == -1)
+   {
+      perror("epoll_ctl wakeup fd");
+      close(epoll_fd);
+      return -1;
+   }
+
+   while (!abortRequested)
+   {
+      int count = epoll_wait(epoll_fd, events, MAX_EVENTS, waitTimeout(worker));
+      worker->pollCalls++;
+      if (count == -1)
+      {
+         if (errno == EINTR)
          {
-            perror("recv error");
+            continue;
          }
-         break;
+         perror("epoll_wait error");
+         close(epoll_fd);
+         return -1;
       }
 
-      if (size == 0)
+      for (int i = 0; i < count; ++i)
       {
-         printf("Client closed remote socket\n"); // ignore error
-         break;
+         if (events[i].data.ptr == &worker->listen_socket)
+         {
+            acceptClients(worker, epoll_fd, sessions);
+            continue;
+         }
+         if (events[i].data.ptr == &worker->wakeup_fd)
+         {
+            uint64_t value;
+            if (read(worker->wakeup_fd, &value, sizeof(value)) == -1)
+            {
+               // EAGAIN: the counter was already consumed
+            }
+            // abortRequested is checked by the loop condition; otherwise
+            // the commit thread may have made held replies sendable
+            released.assign(held.begin(), held.end());
+            held.clear();
+            for (Session *session : released)
+            {
+               runSession(session, sessions, held);
+            }
+            notifyDurable(worker);
+            // or a SEND has mail for sessions parked in WAIT
+            woken = true;
+            continue;
+         }
+
+         Session *session = (Session *)events[i].data.ptr;
+         if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+         {
+            session->readable = true;
+         }
+         runSession(session, sessions, held);
       }
-      
-      // remove ugly debug message, because of the sent newline of client
-      if (buffer[size - 2] == '\r' && buffer[size - 1] == '\n')
+
+      // answered once the events are done, since an answered session may
+      // be closed and the events could still point to it
+      if (woken)
       {
-         size -= 2;
+         {
+            lock_guard<mutex> lock(waitMutex);
+            released.swap(worker->woken);
+            worker->woken.clear();
+         }
+         for (Session *session : released)
+         {
+            finishWait(session, "New mail\n");
+            runSession(session, sessions, held);
+         }
+         woken = false;
       }
-      else if (buffer[size - 1] == '\n')
+      // WAITs that timed out
+      auto now = chrono::steady_clock::now();
+      while (!worker->waitDeadlines.empty() && worker->waitDeadlines.begin()->first <= now)
       {
-         --size;
+         Session *session = worker->waitDeadlines.begin()->second;
+         finishWait(session, "No new mail\n");
+         runSession(session, sessions, held);
       }
+   }
 
-      buffer[size] = '\0';
+   for (Session *session : sessions)
+   {
+      closeSession(session);
+   }
+   close(epoll_fd);
+   return 0;
+}
 
-      printf("Message received: %s\n", buffer); // ignore error
+int acceptClients(Worker *worker, int epoll_fd, unordered_set<Session *> &sessions)
+{
+   struct sockaddr_in cliaddress;
+   socklen_t addrlen;
+   int new_socket;
 
-      if(strcmp(buffer, "SEND")==0){
-         if(processSend(*current_socket)!=-1){
-            if (send(*current_socket, "<< OK", 6, 0) == -1)
-               {
-                  perror("send answer failed");
-                  return NULL;
-               }
-         } else {
-            //send error if it didnt work
-            if (send(*current_socket, "<< ERR", 7, 0) == -1)
-               {
-                  perror("send answer failed");
-                  return NULL;
-               }
+   while (true)
+   {
+      /////////////////////////////////////////////////////////////////////////
+      // ACCEPTS CONNECTION SETUP
+      // edge-triggered: drain the whole accept queue
+      addrlen = sizeof(struct sockaddr_in);
+      new_socket = accept4(worker->listen_socket,
+                           (struct sockaddr *)&cliaddress,
+                           &addrlen,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (new_socket == -1)
+      {
+         if (errno == EAGAIN || errno == EWOULDBLOCK)
+         {
+            return 0;
          }
-      }
-      else if (strcmp(buffer, "LIST") == 0) {
-         if(processList(*current_socket)!=-1){
-            if (send(*current_socket, "<< OK", 6, 0) == -1)
-               {
-                  perror("send answer failed");
-                  return NULL;
-               }
-         }  else {
-            //send error if it didnt work
-            if (send(*current_socket, "<< ERR", 7, 0) == -1)
-               {
-                  perror("send answer failed");
-                  return NULL;
-               }
+         if (errno == EINTR || errno == ECONNABORTED)
+         {
+            continue;
          }
+         perror("accept error");
+         return -1;
       }
-      else if(strcmp(buffer, "READ")==0){
-         if(processRead(*current_socket)!=-1){
-            if (send(*current_socket, "<< OK", 6, 0) == -1)
-               {
-                  perror("send answer failed");
-                  return NULL;
-               }
-         } else {
-            //send error if it didnt work
-            if (send(*current_socket, "<< ERR", 7, 0) == -1)
-               {
-                  perror("send answer failed");
-                  return NULL;
-               }
-         }
+
+      /////////////////////////////////////////////////////////////////////////
+      // START CLIENT
+      // ignore printf error handling
+      // inet_ntop: inet_ntoa's static buffer is shared by all workers
+      char clientIp[INET_ADDRSTRLEN];
+      inet_ntop(AF_INET, &cliaddress.sin_addr, clientIp, sizeof(clientIp));
+      LOG(LEVEL_INFO, "Client connected from %s:%d on worker %d...",
+          clientIp,
+          ntohs(cliaddress.sin_port),
+          worker->id);
+
+      Session *session = new Session();
+      session->fd = new_socket;
+      session->worker = worker;
+      session->scanned = 0;
+      session->state = STATE_COMMAND;
+      session->fieldsExpected = 0;
+      session->closing = false;
+      session->waiting = false;
+      session->readable = false;
+      session->eof = false;
+      session->framed = false;
+      session->frame.state = FRAME_HEADER;
+
+      // SEND welcome message, the last line advertises the wire protocols
+      session->out.append(string("Welcome to myserver!\r\nPlease enter your commands: \n SEND, LIST, READ, DEL, SEARCH, WAIT, STATS, QUIT...\r\n"
+                                 "Protocols: LINE " PROTO_FRAMED "\r\n"));
+
+      struct epoll_event event;
+      memset(&event, 0, sizeof(event));
+      event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+      event.data.ptr = session;
+      if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_socket, &event) == -1)
+      {
+         perror("epoll_ctl client socket");
+         close(new_socket);
+         delete session;
+         continue;
       }
-      else if (strcmp(buffer, "DEL") == 0) {
-         if (processDel(*current_socket) != -1) {
-            if (send(*current_socket, "<< OK", 6, 0) == -1) {
-                  perror("send answer failed");
-                  return NULL;
-            }
-         } else {
-            // Send an error if the delete didn't work
-            if (send(*current_socket, "<< ERR", 7, 0) == -1) {
-                  perror("send answer failed");
-                  return NULL;
-            }
+      sessions.insert(session);
+      worker->activeConnections++;
+      worker->acceptedConnections++;
+   }
+}
+
+// services a session and closes it once it is done or failed
+void runSession(Session *session, unordered_set<Session *> &sessions, unordered_set<Session *> &held)
+{
+   int status = serviceSession(session);
+   // a client that closed its side stops waiting, or a closed connection
+   // would stay parked until the WAIT times out
+   if (status == 0 && session->eof && session->waiting)
+   {
+      finishWait(session, "No new mail\n");
+      status = serviceSession(session);
+   }
+   // commands that arrived together with the EOF are still answered
+   bool finished = session->closing ||
+                   (session->eof && session->out.size() < MAX_OUTPUT);
+   if (status == -1 || (finished && session->out.empty()))
+   {
+      sessions.erase(session);
+      held.erase(session);
+      closeSession(session);
+      return;
+   }
+   if (session->out.held())
+   {
+      held.insert(session);
+   }
+}
+
+// Reads, parses and answers as far as the buffers allow. Input is only read
+// while the ring is below MAX_INPUT and only parsed while the queued replies
+// are below MAX_OUTPUT, so a client pipelining thousands of commands without
+// reading the answers cannot grow the server's memory. -1: drop the session
+int serviceSession(Session *session)
+{
+   while (true)
+   {
+      if (session->readable && session->in.size() < MAX_INPUT)
+      {
+         if (readSession(session) == -1)
+         {
+            session->worker->socketErrors++;
+            return -1;
          }
       }
-      else if(strcmp(buffer, "QUIT")==0){
-         cout << "Client is quitting" <<endl;
-         abortRequested = 1;//handled in signalHandler
+      if (parseSession(session) == -1)
+      {
+         session->worker->protocolErrors++;
+         return -1;
+      }
+      bool parseBlocked = session->out.size() >= MAX_OUTPUT;
+      if (flushSession(session) == -1)
+      {
+         session->worker->socketErrors++;
+         return -1;
       }
-      else {
-         if (send(*current_socket, "<< ERR", 7, 0) == -1)
-               {
-                  perror("send answer failed");
-                  return NULL;
-               }
+      // the socket took enough answers to continue parsing: no EPOLLOUT
+      // edge will announce that, so go on right away
+      if (parseBlocked && session->out.size() < MAX_OUTPUT)
+      {
+         continue;
       }
+      // stopped reading because the ring was full and parsing made room
+      if (!session->readable || session->in.size() >= MAX_INPUT)
+      {
+         return 0;
+      }
+   }
+}
 
-      
-
-   } while (!abortRequested);
+// reads until the socket is drained or the ring holds MAX_INPUT bytes;
+// -1 on error
+int readSession(Session *session)
+{
+   struct iovec iov[2];
+   ssize_t size;
 
-   // closes/frees the descriptor if not already
-   if (*current_socket != -1)
+   while (session->in.size() < MAX_INPUT)
    {
-      if (shutdown(*current_socket, SHUT_RDWR) == -1)
+      /////////////////////////////////////////////////////////////////////////
+      // RECEIVE
+      // straight into the free part of the ring, no intermediate copy
+      session->in.reserve(16 * BUF);
+      int count = session->in.freeRegions(iov);
+      size = readv(session->fd, iov, count);
+      session->worker->readCalls++;
+      if (size == -1)
       {
-         perror("shutdown new_socket");
+         if (errno == EAGAIN || errno == EWOULDBLOCK)
+         {
+            session->readable = false; // edge-triggered: wait for EPOLLIN
+            return 0;
+         }
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         perror("recv error");
+         return -1;
       }
-      if (close(*current_socket) == -1)
+
+      if (size == 0)
       {
-         perror("close new_socket");
+         LOG(LEVEL_INFO, "Client closed remote socket");
+         session->readable = false;
+         session->eof = true;
+         return 0;
       }
-      *current_socket = -1;
-   }
 
-   return NULL;
+      session->in.commit(size);
+      session->worker->bytesIn += size;
+   }
+   return 0;
 }
 
-void signalHandler(int sig)
+// writes as much of the queued replies as the socket takes, gathering the
+// queued segments into each sendmsg() and sending file ranges with
+// sendfile(); replies behind a SEND that is not yet durable stay queued.
+// -1 on error
+int flushSession(Session *session)
 {
-   if (sig == SIGINT)
+   struct iovec iov[MAX_IOVECS];
+   struct msghdr message;
+   ssize_t size;
+   uint64_t durable = committer != NULL ? committer->durable() : 0;
+
+   while (!session->out.empty())
    {
-      printf("abort Requested... "); // ignore error
-      abortRequested = 1;
-      /////////////////////////////////////////////////////////////////////////
-      // With shutdown() one can initiate normal TCP close sequence ignoring
-      // the reference count.
-      // https://beej.us/guide/bgnet/html/#close-and-shutdownget-outta-my-face
-      // https://linux.die.net/man/3/shutdown
-      if (new_socket != -1)
+      size_t ready = session->out.ready(durable);
+      if (ready == 0)
       {
-         if (shutdown(new_socket, SHUT_RDWR) == -1)
+         break; // the commit thread wakes the worker
+      }
+      const FileRange *file = session->out.frontFile();
+      if (file != NULL)
+      {
+         // https://man7.org/linux/man-pages/man2/sendfile.2.html
+         off_t position = file->offset + session->out.frontOffset();
+         size = sendfile(session->fd, file->file->fd, &position,
+                         min((size_t)(file->length - session->out.frontOffset()), ready));
+         session->worker->sendfileCalls++;
+         if (size == -1 && (errno == EINVAL || errno == ENOSYS))
          {
-            perror("shutdown new_socket");
+            if (session->out.copyFrontFile() == -1)
+            {
+               perror("read message body");
+               return -1;
+            }
+            continue;
          }
-         if (close(new_socket) == -1)
+         if (size == 0)
          {
-            perror("close new_socket");
+            // the file is shorter than its range
+            LOG(LEVEL_ERROR, "message body truncated");
+            return -1;
          }
-         new_socket = -1;
       }
-
-      if (create_socket != -1)
+      else
       {
-         if (shutdown(create_socket, SHUT_RDWR) == -1)
+         memset(&message, 0, sizeof(message));
+         message.msg_iov = iov;
+         message.msg_iovlen = session->out.pending(iov, MAX_IOVECS, ready);
+         size = sendmsg(session->fd, &message, MSG_NOSIGNAL);
+         session->worker->writeCalls++;
+      }
+      if (size == -1)
+      {
+         if (errno == EAGAIN || errno == EWOULDBLOCK)
          {
-            perror("shutdown create_socket");
+            break; // EPOLLOUT fires once the socket drains
          }
-         if (close(create_socket) == -1)
+         if (errno == EINTR)
          {
-            perror("close create_socket");
+            continue;
          }
-         create_socket = -1;
+         perror("send answer failed");
+         return -1;
       }
+      session->out.consume(size);
+      session->worker->bytesOut += size;
    }
-   else
+   return 0;
+}
+
+void closeSession(Session *session)
+{
+   // closes/frees the descriptor; close() also drops it from the epoll set
+   if (shutdown(session->fd, SHUT_RDWR) == -1 && errno != ENOTCONN)
    {
-      exit(sig);
+      perror("shutdown new_socket");
    }
+   if (close(session->fd) == -1)
+   {
+      perror("close new_socket");
+   }
+   session->worker->activeConnections--;
+   unparkSession(session);
+   delete session;
 }
 
-int processSend(int client_socket){
-   ifstream file;
-   
-   char buffer[BUF];
-   string sender, receiver, subject, message;
+// feeds buffered input to the parser of the session's protocol; -1 if the
+// client violated the protocol and has to be dropped
+int parseSession(Session *session)
+{
+   int result;
 
-   //Get sender of message
-   recv(client_socket, buffer, sizeof(buffer), 0);
-   sender = buffer;
-   memset(buffer, 0, BUF);
+   // PROTO switches protocols mid-buffer: hand the rest to the new parser
+   do
+   {
+      result = session->framed ? parseFrames(session) : parseLines(session);
+   } while (result == 1);
 
-   //Get receiver of message
-   recv(client_socket, buffer, sizeof(buffer), 0);
-   receiver = buffer;
-   memset(buffer, 0, BUF);
+   return result;
+}
 
-   //Get subject of message
-   recv(client_socket, buffer, sizeof(buffer), 0);
-   subject = buffer;
-   memset(buffer, 0, BUF);
+///////////////////////////////////////////////////////////////////////////////
+// LINE PROTOCOL
+// Every command and every field is terminated by "\n" (or "\r\n"), so a
+// session can receive any number of lines per recv() and any line may be
+// split across several recv() calls.
 
-   //Get message
-   while(true){
-      recv(client_socket, buffer, sizeof(buffer), 0);
-      if(buffer[0]=='.'){
+// 0 when the buffer is drained, 1 after a protocol switch, -1 on error
+int parseLines(Session *session)
+{
+   size_t end;
+   string line;
+
+   while (!session->closing && !session->waiting && session->out.size() < MAX_OUTPUT)
+   {
+      // a partial line is not searched again from its start on every read
+      end = session->in.find('\n', session->scanned);
+      if (end == string::npos)
+      {
+         session->scanned = session->in.size();
          break;
       }
-
-      message += buffer;
-      message +="\n";
-      memset(buffer, 0, BUF);
+      session->scanned = 0;
+      line.clear();
+      session->in.take(line, end + 1);
+      line.pop_back();
+      // remove ugly debug message, because of the sent newline of client
+      if (!line.empty() && line.back() == '\r')
+      {
+         line.pop_back();
+      }
+      handleLine(session, line);
+      if (session->framed)
+      {
+         return 1;
+      }
    }
 
-   if(writeUserFile(receiver, sender, subject, message)==-1){
+   if (session->scanned > MAX_LINE)
+   {
+      LOG(LEVEL_WARN, "line too long - dropping client");
       return -1;
    }
-
-   cout << "Message from: "+ sender + " to: "+ receiver + "\nSubject: "+subject+"\n Message: "+message<< endl;
-   return 1;    
+   return 0;
 }
 
-int createMailSpool(string dirName){
-   // Path to the directory
-   string dir = "./"+dirName;
-   // Structure which would store the metadata
-   struct stat sb;
+void handleLine(Session *session, const string &line)
+{
+   switch (session->state)
+   {
+   case STATE_COMMAND:
+      if (line.empty())
+      {
+         return;
+      }
+      LOG(LEVEL_DEBUG, "Message received: %s", line.c_str());
+      splitRequestId(line, session->requestId, session->command);
+      session->fields.clear();
+      session->body.clear();
 
-   //only create mail spool directory with name if it doesnt exist yet
-   if(stat(dir.c_str(), &sb) != 0){
-      if (mkdir(dirName.c_str(), 0777) != 0) { 
-         return -1; 
+      if (session->command == "PROTO " PROTO_FRAMED)
+      {
+         // acknowledged in the old protocol, everything after it is framed
+         queueReply(session, 0, "");
+         session->framed = true;
+         session->frame.state = FRAME_HEADER;
+         return;
       }
+      if (session->command == "SEND")
+      {
+         session->fieldsExpected = 3; // sender, receiver, subject
+      }
+      else if (commandType(session->command) == COMMAND_LIST)
+      {
+         session->fieldsExpected = 1; // username; a page or SINCE is on the command line
+      }
+      else if (session->command == "READ" || session->command == "DEL")
+      {
+         session->fieldsExpected = 2; // username, message number
+      }
+      else if (session->command == "SEARCH")
+      {
+         session->fieldsExpected = 2; // username, search terms
+      }
+      else if (session->command == "WAIT")
+      {
+         session->fieldsExpected = 2; // username, timeout and optional token
+      }
+      else
+      {
+         session->fieldsExpected = 0;
+         executeCommand(session);
+         return;
+      }
+      session->state = STATE_FIELDS;
+      return;
+
+   case STATE_FIELDS:
+      session->fields.push_back(line);
+      if (session->fields.size() < session->fieldsExpected)
+      {
+         return;
+      }
+      if (session->command == "SEND")
+      {
+         session->state = STATE_BODY;
+         return;
+      }
+      executeCommand(session);
+      return;
+
+   case STATE_BODY:
+      if (line == ".")
+      {
+         executeCommand(session);
+         return;
+      }
+      if (stageBody(session, line.data(), line.size()) == 0)
+      {
+         stageBody(session, "\n", 1);
+      }
+      return;
+
+   case STATE_DISCARD:
+      if (line == ".")
+      {
+         session->state = STATE_COMMAND;
+      }
+      return;
    }
-   
-   return 0;
 }
 
-int writeUserFile(string username, string sender, string subject, string message){
-   string filename = username;
-   string filepath = "./"+mailSpool+"/"+username;
-   ofstream file;
-   file.open(filepath, ios::app);
-   if(!file){
-      return -1;
-   }
+///////////////////////////////////////////////////////////////////////////////
+// FRAMED PROTOCOL (FRAMED/1)
+// Negotiated with the line "PROTO FRAMED/1" after the welcome message.
+// All integers are big-endian:
+//
+//    frame := uint32 length (of everything that follows)
+//             uint16 field count
+//             field count * (uint32 field length, field bytes)
+//
+// Request fields: SEND sender receiver subject body | LIST user (or
+// "LIST offset count" / "LIST SINCE token" as the first field) |
+// READ user nr | DEL user nr | SEARCH user terms | WAIT user timeout | QUIT.
+// Every reply is one frame with the fields "OK" or "ERR" and the payload
+// the line protocol would print.
+// Fields are binary safe; nothing depends on how TCP segments the stream.
+
+static uint32_t peekUint32(const RingBuffer &in)
+{
+   unsigned char bytes[4];
+   in.peek(0, (char *)bytes, sizeof(bytes));
+   return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) |
+          ((uint32_t)bytes[2] << 8) | (uint32_t)bytes[3];
+}
 
-   file << "\nMESSAGE\n";
-   file << sender+"\n";
-   file << subject+"\n";
-   file << message+"\n";
-   file.close();
-   return 0;
+static void appendUint32(string &out, uint32_t value)
+{
+   uint32_t network = htonl(value);
+   out.append((const char *)&network, sizeof(network));
 }
 
+// Incremental: it consumes whatever part of a frame is buffered and picks up
+// where it stopped on the next call, so a frame may arrive in any number of
+// pieces. 0 when the buffer is drained, -1 on a malformed frame.
+int parseFrames(Session *session)
+{
+   FrameParser &frame = session->frame;
+   RingBuffer &in = session->in;
 
-// ./twmailer-server 1234 Users
-// ./twmailer-client 127.0.0.1 1234 port kann alles sein muss einfach nur matchen
+   while (!session->closing && !session->waiting && session->out.size() < MAX_OUTPUT)
+   {
+      switch (frame.state)
+      {
+      case FRAME_HEADER:
+      {
+         if (in.size() < 6)
+         {
+            return 0;
+         }
+         uint32_t length = peekUint32(in);
+         in.consume(4);
+         unsigned char count[2];
+         in.peek(0, (char *)count, 2);
+         in.consume(2);
+         frame.fieldsRemaining = (count[0] << 8) | count[1];
+         if (length < 2 || frame.fieldsRemaining == 0)
+         {
+            LOG(LEVEL_WARN, "invalid frame header - dropping client");
+            return -1;
+         }
+         frame.frameRemaining = length - 2;
+         frame.buffered = 0;
+         frame.bodyStreamed = false;
+         frame.rejected = false;
+         frame.fields.clear();
+         frame.state = FIELD_HEADER;
+         break;
+      }
 
-int processList(int client_socket) {
-   char buffer[BUF];
-   string username;
+      case FIELD_HEADER:
+         if (frame.fieldsRemaining == 0)
+         {
+            if (frame.frameRemaining != 0)
+            {
+               LOG(LEVEL_WARN, "frame length mismatch - dropping client");
+               return -1;
+            }
+            frame.state = FRAME_HEADER;
+            if (!frame.rejected)
+            {
+               handleFrame(session);
+            }
+            break;
+         }
+         if (in.size() < 4)
+         {
+            return 0;
+         }
+         frame.fieldRemaining = peekUint32(in);
+         in.consume(4);
+         if (frame.frameRemaining < 4 ||
+             frame.fieldRemaining > frame.frameRemaining - 4)
+         {
+            LOG(LEVEL_WARN, "field exceeds frame - dropping client");
+            return -1;
+         }
+         frame.frameRemaining -= 4 + frame.fieldRemaining;
+         frame.fieldsRemaining--;
+         if (frame.fieldsRemaining == 0 && frame.fields.size() == 4)
+         {
+            string requestId, command;
+            splitRequestId(frame.fields[0], requestId, command);
+            if (command == "SEND")
+            {
+               // the body goes to the session's staging as it arrives
+               frame.bodyStreamed = true;
+               frame.state = BODY_DATA;
+               session->body.clear();
+               session->requestId = requestId;
+               if (frame.fieldRemaining > maxMessageBytes)
+               {
+                  rejectSend(session, "Message too large!");
+                  frame.rejected = true;
+                  frame.state = BODY_DISCARD;
+               }
+               break;
+            }
+         }
+         frame.buffered += frame.fieldRemaining;
+         if (frame.buffered > MAX_FRAME)
+         {
+            LOG(LEVEL_WARN, "frame too large - dropping client");
+            return -1;
+         }
+         frame.fields.push_back(string());
+         frame.fields.back().reserve(frame.fieldRemaining);
+         frame.state = FIELD_DATA;
+         break;
 
-   //Get sender of message
-   recv(client_socket, buffer, sizeof(buffer), 0);
-   username = buffer;
-   memset(buffer, 0, BUF);
+      case FIELD_DATA:
+      {
+         size_t chunk = min((size_t)frame.fieldRemaining, in.size());
+         in.take(frame.fields.back(), chunk);
+         frame.fieldRemaining -= chunk;
+         if (frame.fieldRemaining > 0)
+         {
+            return 0;
+         }
+         frame.state = FIELD_HEADER;
+         break;
+      }
 
-   printf("Listing messages for user: %s\n", username.c_str());
+      case BODY_DATA:
+      case BODY_DISCARD:
+      {
+         const char *data;
+         size_t chunk = min((size_t)frame.fieldRemaining, in.front(&data));
+         if (chunk == 0 && frame.fieldRemaining > 0)
+         {
+            return 0;
+         }
+         if (frame.state == BODY_DATA && stageBody(session, data, chunk) == -1)
+         {
+            frame.rejected = true;
+            frame.state = BODY_DISCARD;
+         }
+         in.consume(chunk);
+         frame.fieldRemaining -= chunk;
+         if (frame.fieldRemaining == 0)
+         {
+            frame.state = FIELD_HEADER;
+         }
+         break;
+      }
+      }
+   }
+   return 0;
+}
 
-   // Open the user's file and read messages
-   string userFilename = "./" + mailSpool + "/" + username;
-   ifstream userFile(userFilename.c_str());
+// maps a complete frame onto the command fields of the line protocol
+void handleFrame(Session *session)
+{
+   vector<string> &fields = session->frame.fields;
+   string command;
+   size_t expected;
 
-   if (userFile.is_open()) {
-      string line;
-      int messageNumber = 0; // Track the message number
-      while (getline(userFile, line)) {
+   LOG(LEVEL_DEBUG, "Frame received: %s", fields[0].c_str());
+   splitRequestId(fields[0], session->requestId, command);
 
-         if (line == "MESSAGE") {
-               string sender, subject, message;
-               getline(userFile, sender);
-               getline(userFile, subject);
+   if (command == "SEND")
+   {
+      expected = 4;   // and the body, already staged by parseFrames
+   }
+   else if (commandType(command) == COMMAND_LIST)
+   {
+      expected = 2;
+   }
+   else if (command == "READ" || command == "DEL" || command == "SEARCH" || command == "WAIT")
+   {
+      expected = 3;
+   }
+   else
+   {
+      expected = 1;
+   }
 
-               string messageLine;
-               while (getline(userFile, messageLine)) {
-                  if (messageLine.empty()) {
-                     break;
-                  }
-                  message += messageLine + "\n";
-               }
+   session->command = command;
+   session->fields.clear();
+   if (fields.size() != expected || (command == "SEND") != session->frame.bodyStreamed)
+   {
+      session->command = "";  // answered with ERR
+   }
+   else
+   {
+      session->fields.assign(fields.begin() + 1, fields.end());
+   }
+   executeCommand(session);
+}
 
-               // Send message number and subject to the client
-               messageNumber++; // Increment the message number
-               send(client_socket, to_string(messageNumber).c_str(), to_string(messageNumber).size(), 0);
-               send(client_socket, ". Subject: ", 11, 0); // Add a period to distinguish the subject
-               send(client_socket, subject.c_str(), subject.size(), 0);
-               send(client_socket, "\n", 1, 0); // Add a newline
-         }
+// runs a fully received command and queues its answer
+void executeCommand(Session *session)
+{
+   const string &command = session->command;
+   const vector<string> &fields = session->fields;
+   string reply;
+   FileRange body;
+   uint64_t ticket = 0;
+   int result;
+   CommandType type = commandType(command);
+   CommandStats &stats = session->worker->commandStats[type];
+   auto started = chrono::steady_clock::now();
+
+   session->state = STATE_COMMAND;
+   session->worker->commands++;
+   stats.count++;
+
+   if (command == "SEND")
+   {
+      result = processSend(fields[0], fields[1], fields[2], session->body);
+      if (result != -1 && committer != NULL)
+      {
+         // waiters learn of the mail together with the sender's OK
+         ticket = committer->submit(fields[1]);
+         session->worker->undelivered.push_back({ticket, fields[1]});
+      }
+      else if (result != -1)
+      {
+         notifyWaiters(fields[1]);
       }
-      userFile.close();
-   } else {
-      printf("User file not found for user: %s\n", username.c_str());
+   }
+   else if (type == COMMAND_LIST)
+   {
+      result = processList(fields[0], command.size() > 5 ? command.substr(5) : "", reply);
+   }
+   else if (command == "READ")
+   {
+      result = processRead(fields[0], fields[1], reply, body);
+   }
+   else if (command == "DEL")
+   {
+      result = processDel(fields[0], fields[1], reply);
+   }
+   else if (command == "SEARCH")
+   {
+      result = processSearch(fields[0], fields[1], reply);
+   }
+   else if (command == "WAIT")
+   {
+      result = parkSession(session, fields[0], fields[1], reply);
+   }
+   else if (command == "QUIT")
+   {
+      // only this session ends, the server keeps running
+      LOG(LEVEL_DEBUG, "Client is quitting");
+      session->closing = true;
+      return;
+   }
+   else if (type == COMMAND_STATS)
+   {
+      reply = command == "STATS JSON" ? formatStatsJson() : formatStats();
+      result = 0;
+   }
+   else
+   {
+      result = -1;
+   }
+
+   if (result == -1)
+   {
+      stats.errors++;
+   }
+   stats.latency.record(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started).count());
+   // answered by finishWait(), with the request id kept until then
+   if (session->waiting)
+   {
+      session->body.clear();
+      return;
+   }
+
+   // the OK of a SEND, and every reply after it, waits until it is durable
+   uint64_t start = session->out.position();
+   queueReply(session, result, move(reply), body);
+   if (ticket != 0)
+   {
+      session->out.hold(start, ticket);
+   }
+   session->body.clear();
+   session->requestId.clear();
+}
+
+// Adds received bytes to the body of the SEND in progress. A body that
+// grows past --max-message-mb or cannot be staged is answered with ERR right
+// away and the rest of it is dropped unread; -1 then.
+int stageBody(Session *session, const char *data, size_t length)
+{
+   if (session->body.size() + length > maxMessageBytes)
+   {
+      rejectSend(session, "Message too large!");
+      return -1;
+   }
+   if (session->body.append(data, length) == -1)
+   {
+      LOG(LEVEL_ERROR, "stage message body: %s", strerror(errno));
+      rejectSend(session, "Message could not be stored!");
       return -1;
    }
    return 0;
 }
 
-int processRead(int client_socket){
-   char buffer[BUF];
-   string username, messageNr;
+// answers a SEND before its body is complete; the caller skips the rest
+void rejectSend(Session *session, const char *reason)
+{
+   CommandStats &stats = session->worker->commandStats[COMMAND_SEND];
+   session->worker->commands++;
+   stats.count++;
+   stats.errors++;
+   LOG(LEVEL_INFO, "SEND rejected after %llu bytes: %s", (unsigned long long)session->body.size(), reason);
+   queueReply(session, -1, string(reason) + "\n");
+   session->body.clear();
+   session->requestId.clear();
+   if (!session->framed)
+   {
+      session->state = STATE_DISCARD;
+   }
+}
 
-   //Get username
-   recv(client_socket, buffer, sizeof(buffer), 0);
-   username = buffer;
-   memset(buffer, 0, BUF);
-   //Get number of message
-   recv(client_socket, buffer, sizeof(buffer), 0);
-   messageNr = buffer;
-   memset(buffer, 0, BUF);
+///////////////////////////////////////////////////////////////////////////////
+// PIPELINING
+// A client may send any number of commands without waiting for answers;
+// they are executed and answered strictly in order. A command may carry a
+// request id as "#<id> COMMAND" (line protocol) or as the prefix of the
+// command field (framed); the id is echoed in its reply as "<< OK #<id>" or
+// as a third reply field.
+
+void splitRequestId(const string &token, string &requestId, string &command)
+{
+   size_t space = token.find(' ');
+   if (token.size() > 1 && token[0] == '#' && space != string::npos && space > 1)
+   {
+      requestId = token.substr(1, space - 1);
+      command = token.substr(space + 1);
+      return;
+   }
+   requestId.clear();
+   command = token;
+}
 
-   //Check if number of message is in fact an int
-   char* p;
-   long converted = strtol(messageNr.c_str(), &p, 10);
-   if (*p) {
-      return -1;
+// Appends the answer to a command in the session's protocol. The reply text
+// (callers move it in) goes into the output queue as it is, followed by the
+// message body if READ left it in its file; only the status line or the
+// frame headers around them are written separately.
+void queueReply(Session *session, int result, string reply, const FileRange &body)
+{
+   const char *status = result != -1 ? "OK" : "ERR";
+
+   if (session->framed)
+   {
+      vector<string> fields = {status, move(reply)};
+      if (!session->requestId.empty())
+      {
+         fields.push_back(session->requestId);
+      }
+      appendFrame(session->out, fields, body);
+      return;
    }
-   int messageToFind = converted;
-   //Open file of user
-   string userFilename = "./" + mailSpool + "/" + username;
-   cout << "Trying to find: " << userFilename << endl;
-   ifstream userFile(userFilename.c_str());
-   if (userFile.is_open()) {
-      //find specific message
-      int messageNumber = 1;
-      string line;
-      while(getline(userFile, line)){
-         //Message found
-         if(line=="MESSAGE"&&messageNumber==messageToFind){
-            cout << "FOUND MESSAGE NUMBER "<<messageToFind << endl;
-            string sender, subject, message;
-               getline(userFile, sender);
-               getline(userFile, subject);
-
-               string messageLine;
-               while (getline(userFile, messageLine)) {
-                  if (messageLine.empty()) {
-                     break;
-                  }
-                  message += messageLine + "\n";
-               }
-               //Send the specific message to client
-               send(client_socket, sender.c_str(), sender.size(), 0);
-               send(client_socket, "\n", 1, 0);
-               send(client_socket, subject.c_str(), subject.size(), 0);
-               send(client_socket, "\n", 1, 0);
-               send(client_socket, message.c_str(), message.size(), 0);
-               return 0;
+   string trailer = "<< ";
+   trailer += status;
+   if (!session->requestId.empty())
+   {
+      trailer += " #" + session->requestId;
+   }
+   trailer += "\n";
+   session->out.append(move(reply));
+   session->out.append(body);
+   session->out.append(trailer);
+}
 
-         } else if(line=="MESSAGE") {
-            messageNumber++;
-         }
+// queues one frame; the fields are moved into the queue and payloadTail is
+// sent as the end of fields[1]
+void appendFrame(OutBuffer &out, vector<string> &fields, const FileRange &payloadTail)
+{
+   uint32_t length = 2 + payloadTail.length;
+   for (const string &field : fields)
+   {
+      length += 4 + field.size();
+   }
+   string header;
+   appendUint32(header, length);
+   header += (char)(fields.size() >> 8);
+   header += (char)(fields.size() & 0xff);
+   for (size_t i = 0; i < fields.size(); ++i)
+   {
+      appendUint32(header, fields[i].size() + (i == 1 ? payloadTail.length : 0));
+      out.append(header);
+      out.append(move(fields[i]));
+      if (i == 1)
+      {
+         out.append(payloadTail);
       }
-      //if message was not found
-      string errMsg = "Message nr. "+to_string(messageToFind)+" doesn't exist!\n";
-      send(client_socket, errMsg.c_str(), errMsg.size(), 0);
+      header.clear();
+   }
+   out.append(header);
+}
+
+// makes the worker's epoll_wait() return
+void wakeWorker(Worker *worker)
+{
+   uint64_t one = 1;
+   if (write(worker->wakeup_fd, &one, sizeof(one)) == -1)
+   {
+      perror("wake worker");
+   }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WAIT
+// "WAIT <user> <seconds> [token]" parks the session until a SEND delivers
+// to user or the time is up, and answers "New mail" or "No new mail". A
+// parked session costs no thread: it stays in its worker's epoll set, its
+// input is buffered but not parsed, and its deadline is in the worker's
+// timer set, which bounds epoll_wait(). A SEND on any worker looks the user
+// up in the waiters table, hands every parked session to its own worker
+// and wakes that worker through its eventfd; with the group commit it does
+// so only once the message is durable, when its OK is released. Only the
+// session's worker answers it, removes it from the table or frees it.
+// With a token from LIST SINCE, WAIT answers right away if mail arrived
+// since; registering before that check closes the gap between a LIST SINCE
+// and the WAIT after it.
+
+int parkSession(Session *session, const string &username, const string &arguments, string &reply)
+{
+   size_t space = arguments.find(' ');
+   string seconds = arguments.substr(0, space);
+   char *end;
+   long timeout = strtol(seconds.c_str(), &end, 10);
+   SyncToken since;
+   if (seconds.empty() || *end || timeout < 0 || timeout > MAX_WAIT ||
+       (space != string::npos && parseSyncToken(arguments.substr(space + 1), since) == -1))
+   {
+      reply += "Invalid WAIT arguments!\n";
       return -1;
-      userFile.close();
-   } else {
-      printf("User file not found for user: %s\n", username.c_str());
-      return -1;  
    }
 
+   {
+      lock_guard<mutex> lock(waitMutex);
+      waiters[username].push_back(session);
+      parkedSessions++;
+   }
+   session->waiting = true;
+   session->waitUser = username;
+   session->waitDeadline = chrono::steady_clock::now() + chrono::seconds(timeout);
+   session->worker->waitDeadlines.insert({session->waitDeadline, session});
+   session->worker->waitingSessions++;
+
+   MailboxChanges changes;
+   if (space != string::npos && mailStore->listChanges(username, since, changes) == 0 &&
+       (changes.reset || !changes.added.empty()))
+   {
+      unparkSession(session);
+      reply += "New mail\n";
+   }
    return 0;
 }
 
-int processDel(int client_socket) {
-   char buffer[BUF];
-   string username, messageNr;
+// called after every successful SEND, once it is durable with --durability group
+void notifyWaiters(const string &username)
+{
+   if (parkedSessions == 0)
+   {
+      return;
+   }
+   vector<Worker *> wake;
+   {
+      lock_guard<mutex> lock(waitMutex);
+      auto found = waiters.find(username);
+      if (found == waiters.end())
+      {
+         return;
+      }
+      for (Session *session : found->second)
+      {
+         session->worker->woken.push_back(session);
+         if (find(wake.begin(), wake.end(), session->worker) == wake.end())
+         {
+            wake.push_back(session->worker);
+         }
+      }
+      parkedSessions -= found->second.size();
+      waiters.erase(found);
+   }
+   for (Worker *worker : wake)
+   {
+      wakeWorker(worker);
+   }
+}
+
+// notifies the receivers of the worker's SENDs the group commit has made
+// durable; on the worker's thread, after the commit handler woke it
+void notifyDurable(Worker *worker)
+{
+   uint64_t durable = committer != NULL ? committer->durable() : 0;
+   while (!worker->undelivered.empty() && worker->undelivered.front().first <= durable)
+   {
+      notifyWaiters(worker->undelivered.front().second);
+      worker->undelivered.pop_front();
+   }
+}
+
+// takes a parked session out of every list; on the session's worker only
+void unparkSession(Session *session)
+{
+   if (!session->waiting)
+   {
+      return;
+   }
+   {
+      lock_guard<mutex> lock(waitMutex);
+      auto found = waiters.find(session->waitUser);
+      if (found != waiters.end())
+      {
+         vector<Session *> &parked = found->second;
+         auto position = find(parked.begin(), parked.end(), session);
+         if (position != parked.end())
+         {
+            parked.erase(position);
+            parkedSessions--;
+         }
+         if (parked.empty())
+         {
+            waiters.erase(found);
+         }
+      }
+      vector<Session *> &woken = session->worker->woken;
+      woken.erase(remove(woken.begin(), woken.end(), session), woken.end());
+   }
+   session->worker->waitDeadlines.erase({session->waitDeadline, session});
+   session->worker->waitingSessions--;
+   session->waiting = false;
+}
 
-   // Gets username
-   recv(client_socket, buffer, sizeof(buffer), 0);
-   username = buffer;
-   memset(buffer, 0, BUF);
-   // Get number of message
-   recv(client_socket, buffer, sizeof(buffer), 0);
-   messageNr = buffer;
-   memset(buffer, 0, BUF);
+// answers the WAIT of a parked session; runSession() then sends it and
+// goes on with the commands queued behind it
+void finishWait(Session *session, const char *answer)
+{
+   unparkSession(session);
+   queueReply(session, 0, answer);
+   session->requestId.clear();
+}
 
-   // Checks if number of message is in fact an int
-   char *p;
-   long converted = strtol(messageNr.c_str(), &p, 10);
-   if (*p) {
+// milliseconds until the worker's first WAIT times out, -1 for none
+int waitTimeout(Worker *worker)
+{
+   if (worker->waitDeadlines.empty())
+   {
       return -1;
    }
-   int messageToDelete = converted;
-   // Opens file of user
-   string userFilename = "./" + mailSpool + "/" + username;
-   cout << "Trying to find: " << userFilename << endl;
-   ifstream userFile(userFilename.c_str());
-   if (userFile.is_open()) {
-      // Creates a temporary file to rewrite the user's file
-      string tempFilename = "./" + mailSpool + "/temp_" + username;
-      ofstream tempFile(tempFilename.c_str());
-
-      if (tempFile.is_open()) {
-         // Copys lines from the original file to the temporary file
-         int messageNumber = 1;
-         string line;
-         bool inMessage = false;
-
-         while (getline(userFile, line)) {
-               if (line == "MESSAGE") {
-                  inMessage = true;
-                  if (messageNumber == messageToDelete) {
-                     // Skips this message if it matches the one to be deleted
-                     while (getline(userFile, line) && !line.empty()) {
-                           // Skips the entire message
-                     }
-                     messageNumber++;
-                     continue;
-                  }
-               }
+   auto left = worker->waitDeadlines.begin()->first - chrono::steady_clock::now();
+   long milliseconds = chrono::duration_cast<chrono::milliseconds>(left).count() + 1;
+   return milliseconds > 0 ? (int)milliseconds : 0;
+}
 
-               if (inMessage) {
-                  if (line.empty()) {
-                     inMessage = false;
-                     messageNumber++;
-                  }
-               }
+///////////////////////////////////////////////////////////////////////////////
+// STATISTICS
+// Every worker counts into its own Worker struct. STATS (text) and
+// STATS JSON (one line of JSON) sum them up while the workers keep running,
+// so a report may be a few requests behind but never stalls a worker.
+// SIGUSR1 prints the text report together with the store statistics.
+// Latencies are the time spent executing a command in nanoseconds; the wait
+// of a SEND for the group commit is in the commit latency histogram, the
+// time a WAIT stays parked is not counted.
+
+enum WorkerCounter
+{
+   COUNTER_ACTIVE,
+   COUNTER_WAITING,
+   COUNTER_ACCEPTED,
+   COUNTER_COMMANDS,
+   COUNTER_POLLS,
+   COUNTER_READS,
+   COUNTER_WRITES,
+   COUNTER_SENDFILES,
+   COUNTER_BYTES_IN,
+   COUNTER_BYTES_OUT,
+   COUNTER_PROTOCOL_ERRORS,
+   COUNTER_SOCKET_ERRORS,
+   COUNTERS
+};
+
+const char *counterNames[COUNTERS] = {"active", "waiting", "accepted", "commands", "epollWait", "readv", "sendmsg",
+                                      "sendfile", "bytesIn", "bytesOut", "protocolErrors", "socketErrors"};
+
+static void readCounters(const Worker *worker, long *counters)
+{
+   counters[COUNTER_ACTIVE] = worker->activeConnections;
+   counters[COUNTER_WAITING] = worker->waitingSessions;
+   counters[COUNTER_ACCEPTED] = worker->acceptedConnections;
+   counters[COUNTER_COMMANDS] = worker->commands;
+   counters[COUNTER_POLLS] = worker->pollCalls;
+   counters[COUNTER_READS] = worker->readCalls;
+   counters[COUNTER_WRITES] = worker->writeCalls;
+   counters[COUNTER_SENDFILES] = worker->sendfileCalls;
+   counters[COUNTER_BYTES_IN] = worker->bytesIn;
+   counters[COUNTER_BYTES_OUT] = worker->bytesOut;
+   counters[COUNTER_PROTOCOL_ERRORS] = worker->protocolErrors;
+   counters[COUNTER_SOCKET_ERRORS] = worker->socketErrors;
+}
 
-               tempFile << line << "\n";
-         }
+// the worker's counters in counters, added to totals
+static void sumCounters(const Worker *worker, long *counters, long *totals)
+{
+   readCounters(worker, counters);
+   for (int i = 0; i < COUNTERS; ++i)
+   {
+      totals[i] += counters[i];
+   }
+}
 
-         // Closes both files
-         userFile.close();
-         tempFile.close();
+static void appendCounterRow(string &out, const char *name, const long *counters)
+{
+   long calls = counters[COUNTER_POLLS] + counters[COUNTER_READS] + counters[COUNTER_WRITES] + counters[COUNTER_SENDFILES];
+   char line[256];
+   snprintf(line, sizeof(line), "%6s  %6ld  %7ld  %8ld  %8ld  %10ld  %8ld  %8ld  %8ld  %12.3f  %12ld  %12ld  %8ld  %8ld\n",
+            name,
+            counters[COUNTER_ACTIVE],
+            counters[COUNTER_WAITING],
+            counters[COUNTER_ACCEPTED],
+            counters[COUNTER_COMMANDS],
+            counters[COUNTER_POLLS],
+            counters[COUNTER_READS],
+            counters[COUNTER_WRITES],
+            counters[COUNTER_SENDFILES],
+            counters[COUNTER_COMMANDS] > 0 ? (double)calls / counters[COUNTER_COMMANDS] : 0.0,
+            counters[COUNTER_BYTES_IN],
+            counters[COUNTER_BYTES_OUT],
+            counters[COUNTER_PROTOCOL_ERRORS],
+            counters[COUNTER_SOCKET_ERRORS]);
+   out += line;
+}
 
-         // Removes the original file and rename the temporary file
-         if (remove(userFilename.c_str()) == 0) {
-               if (rename(tempFilename.c_str(), userFilename.c_str()) == 0) {
-                  string successMsg = "Message " + messageNr + " deleted successfully.\n";
-                  send(client_socket, successMsg.c_str(), successMsg.size(), 0);
-                  send(client_socket, "<< OK", 6, 0);
-                  return 0;
-               }
-         }
+// the latency histograms of one command, summed over all workers
+static void sumLatency(CommandType type, Histogram &latency, long &count, long &errors)
+{
+   count = 0;
+   errors = 0;
+   for (Worker *worker : workers)
+   {
+      const CommandStats &stats = worker->commandStats[type];
+      count += stats.count;
+      errors += stats.errors;
+      latency.merge(stats.latency);
+   }
+}
+
+CommandType commandType(const string &command)
+{
+   for (int type = 0; type < COMMAND_OTHER; ++type)
+   {
+      if (command == commandNames[type])
+      {
+         return (CommandType)type;
       }
+   }
+   if (command.compare(0, 5, "LIST ") == 0)
+   {
+      return COMMAND_LIST;   // a page or SINCE
+   }
+   return command == "STATS JSON" ? COMMAND_STATS : COMMAND_OTHER;
+}
 
-      send(client_socket, "<< ERR", 7, 0);
-   } else {
-      printf("User file not found for user: %s\n", username.c_str());
-      return -1;
+// three tables, per worker, per command and of the store; percentiles are
+// bucket bounds
+string formatStats()
+{
+   string out;
+   char line[256];
+   long counters[COUNTERS], totals[COUNTERS] = {0};
+
+   out += "worker  active  waiting  accepted  commands  epoll_wait     readv   sendmsg  sendfile  syscalls/cmd      bytes in     bytes out  protocol  socket\n";
+   for (Worker *worker : workers)
+   {
+      sumCounters(worker, counters, totals);
+      appendCounterRow(out, to_string(worker->id).c_str(), counters);
+   }
+   appendCounterRow(out, "total", totals);
+
+   out += "command     count  errors   mean ns  p50 ns <  p90 ns <  p99 ns < p999 ns <      max ns\n";
+   for (int type = 0; type < COMMAND_TYPES; ++type)
+   {
+      Histogram latency;
+      long count, errors;
+      sumLatency((CommandType)type, latency, count, errors);
+      snprintf(line, sizeof(line), "%-7s  %8ld  %6ld  %8.0f  %8llu  %8llu  %8llu  %8llu  %10llu\n",
+               commandNames[type], count, errors, latency.mean(),
+               (unsigned long long)latency.percentile(0.5),
+               (unsigned long long)latency.percentile(0.9),
+               (unsigned long long)latency.percentile(0.99),
+               (unsigned long long)latency.percentile(0.999),
+               (unsigned long long)latency.max());
+      out += line;
    }
 
-   return -1;
+   StoreStats store = {};
+   mailStore->addStats(store);
+   out += "compactions  reclaimed bytes  cache hits  cache misses  lock acquisitions  lock waits  search bytes  search mailboxes\n";
+   snprintf(line, sizeof(line), "%11ld  %15ld  %10ld  %12ld  %17ld  %10ld  %12zu  %16zu\n",
+            store.compactions, store.reclaimedBytes, store.cacheHits, store.cacheMisses,
+            store.lockAcquisitions, store.lockWaits, store.searchBytes, store.searchMailboxes);
+   out += line;
+   return out;
+}
+
+// {"workers":[{"id":0,<counter>:n,...},...],"total":{<counter>:n,...},
+//  "commands":{"SEND":{"count":n,"errors":n,"latencyNs":{...}},...},
+//  "store":{"compactions":n,...}}
+string formatStatsJson()
+{
+   string out = "{\"workers\":[";
+   char number[64];
+   long counters[COUNTERS], totals[COUNTERS] = {0};
+
+   for (size_t i = 0; i < workers.size(); ++i)
+   {
+      sumCounters(workers[i], counters, totals);
+      out += i > 0 ? ",{\"id\":" : "{\"id\":";
+      out += to_string(workers[i]->id);
+      for (int counter = 0; counter < COUNTERS; ++counter)
+      {
+         out += string(",\"") + counterNames[counter] + "\":" + to_string(counters[counter]);
+      }
+      out += "}";
+   }
+   out += "],\"total\":{";
+   for (int counter = 0; counter < COUNTERS; ++counter)
+   {
+      out += string(counter > 0 ? ",\"" : "\"") + counterNames[counter] + "\":" + to_string(totals[counter]);
+   }
+   out += "},\"commands\":{";
+   for (int type = 0; type < COMMAND_TYPES; ++type)
+   {
+      Histogram latency;
+      long count, errors;
+      sumLatency((CommandType)type, latency, count, errors);
+      snprintf(number, sizeof(number), "%.1f", latency.mean());
+      out += string(type > 0 ? ",\"" : "\"") + commandNames[type] + "\":{";
+      out += "\"count\":" + to_string(count) + ",\"errors\":" + to_string(errors);
+      out += string(",\"latencyNs\":{\"mean\":") + number;
+      out += ",\"p50\":" + to_string(latency.percentile(0.5));
+      out += ",\"p90\":" + to_string(latency.percentile(0.9));
+      out += ",\"p99\":" + to_string(latency.percentile(0.99));
+      out += ",\"p999\":" + to_string(latency.percentile(0.999));
+      out += ",\"max\":" + to_string(latency.max()) + "}}";
+   }
+
+   StoreStats store = {};
+   mailStore->addStats(store);
+   out += "},\"store\":{\"compactions\":" + to_string(store.compactions);
+   out += ",\"reclaimedBytes\":" + to_string(store.reclaimedBytes);
+   out += ",\"cacheHits\":" + to_string(store.cacheHits);
+   out += ",\"cacheMisses\":" + to_string(store.cacheMisses);
+   out += ",\"lockAcquisitions\":" + to_string(store.lockAcquisitions);
+   out += ",\"lockWaits\":" + to_string(store.lockWaits);
+   out += ",\"searchBytes\":" + to_string(store.searchBytes);
+   out += ",\"searchMailboxes\":" + to_string(store.searchMailboxes);
+   out += "}}\n";
+   return out;
+}
+
+void printWorkerStats()
+{
+   fputs(formatStats().c_str(), stdout);
+   mailStore->printStats();
+   if (committer != NULL)
+   {
+      committer->printStats();
+   }
+   fflush(stdout);
+}
+
+int createMailSpool(string dirName){
+   // Path to the directory
+   string dir = "./"+dirName;
+   // Structure which would store the metadata
+   struct stat sb;
+
+   //only create mail spool directory with name if it doesnt exist yet
+   if(stat(dir.c_str(), &sb) != 0){
+      if (mkdir(dirName.c_str(), 0777) != 0) {
+         return -1;
+      }
+   }
+
+   return 0;
 }
@@ -0,0 +1,350 @@
+#include <sys/types.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <algorithm>
+#include "search.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define SCAN_CHUNK (64 * 1024)   // bytes read at once while indexing a file
+#define TERM_OVERHEAD 64         // hash node, key and vector of a term, roughly
+
+///////////////////////////////////////////////////////////////////////////////
+// TERMS
+
+void TermScanner::feed(const char *data, size_t length)
+{
+   for (size_t i = 0; i < length; ++i)
+   {
+      unsigned char c = data[i];
+      if (c >= 'A' && c <= 'Z')
+      {
+         c += 'a' - 'A';
+      }
+      else if (!(c >= 'a' && c <= 'z') && !(c >= '0' && c <= '9') && c < 0x80)
+      {
+         if (!term.empty())
+         {
+            terms.push_back(term);
+            term.clear();
+         }
+         continue;
+      }
+      if (term.size() < MAX_TERM)
+      {
+         term += c;
+      }
+   }
+}
+
+int TermScanner::feedFile(int fd, uint64_t offset, uint64_t length)
+{
+   char buffer[SCAN_CHUNK];
+   while (length > 0)
+   {
+      ssize_t got = pread(fd, buffer, min(length, (uint64_t)sizeof(buffer)), offset);
+      if (got == -1 && errno == EINTR)
+      {
+         continue;
+      }
+      if (got <= 0)
+      {
+         return -1;
+      }
+      feed(buffer, got);
+      offset += got;
+      length -= got;
+   }
+   return 0;
+}
+
+vector<string> &TermScanner::finish()
+{
+   if (!term.empty())
+   {
+      terms.push_back(term);
+      term.clear();
+   }
+   sort(terms.begin(), terms.end());
+   terms.erase(unique(terms.begin(), terms.end()), terms.end());
+   return terms;
+}
+
+void TermScanner::clear()
+{
+   term.clear();
+   terms.clear();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// POSTINGS
+
+// Numbers usually arrive in ascending order; one that does not (a build
+// racing an append) is sorted in, and one already there is ignored.
+void Postings::add(uint32_t number, const vector<string> &messageTerms)
+{
+   for (const string &term : messageTerms)
+   {
+      vector<uint32_t> &numbers = terms[term];
+      if (numbers.empty())
+      {
+         bytes += term.size() + TERM_OVERHEAD;
+      }
+      if (numbers.empty() || numbers.back() < number)
+      {
+         numbers.push_back(number);
+      }
+      else
+      {
+         auto position = lower_bound(numbers.begin(), numbers.end(), number);
+         if (*position == number)
+         {
+            continue;
+         }
+         numbers.insert(position, number);
+      }
+      bytes += sizeof(uint32_t);
+   }
+   indexed++;
+}
+
+void Postings::remove(uint32_t number)
+{
+   if (!deleted.insert(number).second)
+   {
+      return;
+   }
+   bytes += TERM_OVERHEAD / 2;
+   if (deleted.size() * 2 >= indexed)
+   {
+      purge();
+   }
+}
+
+// takes the deleted messages out of every posting list
+void Postings::purge()
+{
+   bytes = 0;
+   for (auto term = terms.begin(); term != terms.end();)
+   {
+      vector<uint32_t> &numbers = term->second;
+      numbers.erase(remove_if(numbers.begin(), numbers.end(),
+                              [this](uint32_t number) { return deleted.count(number) > 0; }),
+                    numbers.end());
+      if (numbers.empty())
+      {
+         term = terms.erase(term);
+         continue;
+      }
+      numbers.shrink_to_fit();
+      bytes += term->first.size() + TERM_OVERHEAD + numbers.size() * sizeof(uint32_t);
+      ++term;
+   }
+   indexed = indexed > deleted.size() ? indexed - deleted.size() : 0;
+   deleted.clear();
+}
+
+// Intersects the posting lists, shortest first, so the work is bounded by
+// the rarest term; each further list is searched from where the last
+// candidate was found.
+void Postings::match(const vector<string> &query, vector<uint32_t> &numbers) const
+{
+   numbers.clear();
+   vector<const vector<uint32_t> *> lists;
+   for (const string &term : query)
+   {
+      auto found = terms.find(term);
+      if (found == terms.end())
+      {
+         return;
+      }
+      lists.push_back(&found->second);
+   }
+   if (lists.empty())
+   {
+      return;
+   }
+   sort(lists.begin(), lists.end(),
+        [](const vector<uint32_t> *a, const vector<uint32_t> *b) { return a->size() < b->size(); });
+
+   for (uint32_t number : *lists[0])
+   {
+      if (deleted.count(number) == 0)
+      {
+         numbers.push_back(number);
+      }
+   }
+   for (size_t i = 1; i < lists.size() && !numbers.empty(); ++i)
+   {
+      const vector<uint32_t> &list = *lists[i];
+      auto position = list.begin();
+      size_t kept = 0;
+      for (uint32_t number : numbers)
+      {
+         position = lower_bound(position, list.end(), number);
+         if (position == list.end())
+         {
+            break;
+         }
+         if (*position == number)
+         {
+            numbers[kept++] = number;
+         }
+      }
+      numbers.resize(kept);
+   }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SEARCH INDEX
+
+SearchIndex::SearchIndex(size_t capacity)
+   : capacity(capacity), bytes(0), builds(0), queries(0), evictions(0)
+{
+}
+
+shared_ptr<SearchIndex::Entry> SearchIndex::find(const string &username)
+{
+   lock_guard<mutex> lock(indexMutex);
+   auto entry = entries.find(username);
+   return entry == entries.end() ? nullptr : entry->second;
+}
+
+bool SearchIndex::loaded(const string &username)
+{
+   return find(username) != nullptr;
+}
+
+void SearchIndex::evict(unordered_map<string, shared_ptr<Entry>>::iterator entry)
+{
+   entry->second->evicted = true;
+   bytes -= entry->second->accounted;
+   lru.erase(entry->second->lru);
+   entries.erase(entry);
+}
+
+// updates what entry counts against the budget and evicts the least
+// recently searched indexes, possibly entry itself, until it fits
+void SearchIndex::account(const shared_ptr<Entry> &entry, size_t size)
+{
+   lock_guard<mutex> lock(indexMutex);
+   if (entry->evicted)
+   {
+      return;
+   }
+   bytes = bytes - entry->accounted + size;
+   entry->accounted = size;
+   while (bytes > capacity && !lru.empty())
+   {
+      evict(entries.find(lru.back()));
+      evictions++;
+   }
+}
+
+void SearchIndex::add(const string &username, uint32_t number, const vector<string> &terms)
+{
+   shared_ptr<Entry> entry = find(username);
+   if (entry == nullptr)
+   {
+      return;
+   }
+   size_t size;
+   {
+      lock_guard<mutex> lock(entry->mutex);
+      entry->postings.add(number, terms);
+      size = entry->postings.size();
+   }
+   account(entry, size);
+}
+
+void SearchIndex::remove(const string &username, uint32_t number)
+{
+   shared_ptr<Entry> entry = find(username);
+   if (entry == nullptr)
+   {
+      return;
+   }
+   size_t size;
+   {
+      lock_guard<mutex> lock(entry->mutex);
+      entry->postings.remove(number);
+      size = entry->postings.size();
+   }
+   account(entry, size);
+}
+
+void SearchIndex::drop(const string &username)
+{
+   lock_guard<mutex> lock(indexMutex);
+   auto entry = entries.find(username);
+   if (entry != entries.end())
+   {
+      evict(entry);
+   }
+}
+
+// The entry goes into the table before it is built, so appends that land
+// meanwhile are added to it instead of being missed by the build.
+int SearchIndex::search(const string &username, const vector<string> &terms, vector<uint32_t> &numbers,
+                        const function<int(Postings &)> &load)
+{
+   shared_ptr<Entry> entry;
+   {
+      lock_guard<mutex> lock(indexMutex);
+      queries++;
+      auto found = entries.find(username);
+      if (found != entries.end())
+      {
+         entry = found->second;
+         lru.splice(lru.begin(), lru, entry->lru);
+      }
+      else
+      {
+         entry = make_shared<Entry>();
+         lru.push_front(username);
+         entry->lru = lru.begin();
+         entries[username] = entry;
+      }
+   }
+
+   size_t size;
+   {
+      lock_guard<mutex> lock(entry->mutex);
+      if (!entry->ready)
+      {
+         if (load(entry->postings) == -1)
+         {
+            lock_guard<mutex> indexLock(indexMutex);
+            if (!entry->evicted)
+            {
+               evict(entries.find(username));
+            }
+            return -1;
+         }
+         entry->ready = true;
+         lock_guard<mutex> indexLock(indexMutex);
+         builds++;
+      }
+      entry->postings.match(terms, numbers);
+      size = entry->postings.size();
+   }
+   account(entry, size);
+   return 0;
+}
+
+void SearchIndex::printStats()
+{
+   lock_guard<mutex> lock(indexMutex);
+   printf("search index %zu mailboxes, %zu of %zu bytes, %ld builds, %ld queries, %ld evictions\n",
+          entries.size(), bytes, capacity, builds, queries, evictions);
+}
+
+void SearchIndex::usage(size_t &indexBytes, size_t &mailboxes)
+{
+   lock_guard<mutex> lock(indexMutex);
+   indexBytes = bytes;
+   mailboxes = entries.size();
+}
@@ -0,0 +1,118 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <set>
+#include <unordered_map>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+///////////////////////////////////////////////////////////////////////////////
+// SEARCH INDEX
+// An inverted index per mailbox, term -> ascending message numbers, for the
+// SEARCH command. A term is a run of letters and digits (ASCII, compared
+// without case) or of bytes >= 0x80, so UTF-8 words stay whole; it is cut
+// off after MAX_TERM bytes. Sender, subject and body are indexed.
+//
+// The index of a mailbox lives in memory. The first SEARCH of a mailbox
+// builds it from the stored messages, the backend then keeps it up to date:
+// it adds every message appended to a mailbox whose index is loaded and
+// marks deleted messages, which are purged from the postings once they make
+// up half of the indexed messages. A backend that finds a mailbox changed
+// behind its back drops its index. All indexes together stay within a
+// memory budget, the least recently searched go first.
+
+#define MAX_TERM 32
+
+// splits text into terms, also across several pieces of one text
+class TermScanner
+{
+public:
+   void feed(const char *data, size_t length);
+   // reads length bytes of fd from offset on; -1 on a read error
+   int feedFile(int fd, uint64_t offset, uint64_t length);
+   // the distinct terms fed since the last clear(), sorted
+   std::vector<std::string> &finish();
+   void clear();
+
+private:
+   std::string term;
+   std::vector<std::string> terms;
+};
+
+// the index of one mailbox
+class Postings
+{
+public:
+   Postings() : indexed(0), bytes(0) {}
+
+   // terms as returned by TermScanner::finish()
+   void add(uint32_t number, const std::vector<std::string> &terms);
+   void remove(uint32_t number);
+   // the numbers of the messages holding every term, ascending
+   void match(const std::vector<std::string> &terms, std::vector<uint32_t> &numbers) const;
+   size_t size() const { return bytes; }
+
+private:
+   void purge();
+
+   std::unordered_map<std::string, std::vector<uint32_t>> terms;
+   std::set<uint32_t> deleted;   // still in the postings
+   size_t indexed;               // messages added, deleted ones included
+   size_t bytes;                 // memory the index takes, roughly
+};
+
+class SearchIndex
+{
+public:
+   explicit SearchIndex(size_t capacity);
+
+   // whether appends to username have to be indexed
+   bool loaded(const std::string &username);
+   void add(const std::string &username, uint32_t number, const std::vector<std::string> &terms);
+   void remove(const std::string &username, uint32_t number);
+   // forgets the index of username, for a mailbox changed behind the store's back
+   void drop(const std::string &username);
+
+   // Finds the messages of username holding all terms. An index that is not
+   // loaded is built by load() first, which gets the empty postings to add
+   // every stored message to and returns -1 on error. Appends and deletes
+   // for username wait until the build is done.
+   int search(const std::string &username, const std::vector<std::string> &terms, std::vector<uint32_t> &numbers,
+              const std::function<int(Postings &)> &load);
+   // prints the index totals (SIGUSR1)
+   void printStats();
+   // the memory of the loaded indexes and their number (STATS)
+   void usage(size_t &indexBytes, size_t &mailboxes);
+
+private:
+   struct Entry
+   {
+      std::mutex mutex;          // guards postings and ready
+      Postings postings;
+      bool ready = false;        // built
+      size_t accounted = 0;      // bytes counted in the total, guarded by indexMutex
+      bool evicted = false;      // guarded by indexMutex
+      std::list<std::string>::iterator lru;
+   };
+
+   std::shared_ptr<Entry> find(const std::string &username);
+   void account(const std::shared_ptr<Entry> &entry, size_t size);
+   void evict(std::unordered_map<std::string, std::shared_ptr<Entry>>::iterator entry);
+
+   size_t capacity;
+   std::mutex indexMutex;        // guards everything below
+   std::unordered_map<std::string, std::shared_ptr<Entry>> entries;
+   std::list<std::string> lru;   // most recently searched first
+   size_t bytes;
+   long builds;
+   long queries;
+   long evictions;
+};
+
+#endif
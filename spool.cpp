@@ -0,0 +1,297 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "spool.h"
+#include "log.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define LAYOUT_FILE ".layout"
+#define SHARD_DIR ".shards"
+#define INDEX_DIR ".index"
+
+///////////////////////////////////////////////////////////////////////////////
+
+// FNV-1a; stable across builds, since it decides where users are stored
+static uint32_t hashName(const string &name)
+{
+   uint32_t hash = 2166136261u;
+   for (unsigned char c : name)
+   {
+      hash = (hash ^ c) * 16777619u;
+   }
+   return hash;
+}
+
+static int syncDirectory(const string &path)
+{
+   int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY);
+   if (fd == -1)
+   {
+      return -1;
+   }
+   int result = fsync(fd);
+   close(fd);
+   return result;
+}
+
+SpoolLayout::SpoolLayout(const string &root, int type)
+   : rootPath(root), layoutType(type), migratingFlag(false), stopping(false), movedUsers(0)
+{
+}
+
+SpoolLayout::~SpoolLayout()
+{
+   stopping = true;
+   if (migrator.joinable())
+   {
+      migrator.join();
+   }
+}
+
+bool SpoolLayout::validUser(const string &username)
+{
+   return !username.empty() && username.size() <= NAME_MAX && username[0] != '.' &&
+          username.find('/') == string::npos && username.find('\0') == string::npos;
+}
+
+string SpoolLayout::recordedLayout(const string &root)
+{
+   char recorded[32] = "flat";
+   int fd = ::open((root + "/" LAYOUT_FILE).c_str(), O_RDONLY);
+   if (fd != -1)
+   {
+      ssize_t size = read(fd, recorded, sizeof(recorded) - 1);
+      close(fd);
+      recorded[size > 0 ? size : 0] = '\0';
+      recorded[strcspn(recorded, "\n")] = '\0';
+   }
+   return recorded;
+}
+
+int SpoolLayout::open(bool background)
+{
+   string recorded = recordedLayout(rootPath);
+   if (layoutType == LAYOUT_FLAT)
+   {
+      if (recorded == "flat")
+      {
+         return 0;
+      }
+      fprintf(stderr, "%s uses the %s layout - it cannot be used as flat\n", rootPath.c_str(), recorded.c_str());
+      errno = EINVAL;
+      return -1;
+   }
+
+   if (recorded == "sharded")
+   {
+      return 0;
+   }
+   if (recorded == "flat")
+   {
+      if (writeMarker("migrating") == -1)
+      {
+         perror("record spool layout");
+         return -1;
+      }
+      LOG(LEVEL_INFO, "Migrating %s to the sharded layout", rootPath.c_str());
+   }
+   else if (recorded != "migrating")
+   {
+      fprintf(stderr, "%s: unknown spool layout %s\n", rootPath.c_str(), recorded.c_str());
+      errno = EINVAL;
+      return -1;
+   }
+
+   migratingFlag = true;
+   if (background)
+   {
+      migrator = thread([this]() {
+         long moved;
+         if (migrate(moved) == 0)
+         {
+            LOG(LEVEL_INFO, "Spool %s is sharded now, moved %ld users", rootPath.c_str(), movedUsers.load());
+         }
+      });
+   }
+   return 0;
+}
+
+// .shards/<xx>/<yy> from the top 16 bits of the hash
+string SpoolLayout::shardPath(const string &username) const
+{
+   static const char digits[] = "0123456789abcdef";
+   uint32_t hash = hashName(username);
+   char shard[7] = {digits[(hash >> 28) & 0xf], digits[(hash >> 24) & 0xf], '/',
+                    digits[(hash >> 20) & 0xf], digits[(hash >> 16) & 0xf], '/', '\0'};
+   return rootPath + "/" SHARD_DIR "/" + shard;
+}
+
+string SpoolLayout::userPath(const string &username)
+{
+   if (!validUser(username))
+   {
+      return "";
+   }
+   if (layoutType == LAYOUT_FLAT)
+   {
+      return rootPath + "/" + username;
+   }
+   resolve(username);
+   return shardPath(username) + username;
+}
+
+string SpoolLayout::indexPath(const string &username)
+{
+   if (!validUser(username))
+   {
+      return "";
+   }
+   if (layoutType == LAYOUT_FLAT)
+   {
+      return rootPath + "/" INDEX_DIR "/" + username;
+   }
+   resolve(username);
+   return shardPath(username) + INDEX_DIR "/" + username;
+}
+
+int SpoolLayout::prepare(const string &path) const
+{
+   size_t slash = rootPath.size();
+   while ((slash = path.find('/', slash + 1)) != string::npos)
+   {
+      if (mkdir(path.substr(0, slash).c_str(), 0777) == -1 && errno != EEXIST)
+      {
+         return -1;
+      }
+   }
+   return 0;
+}
+
+int SpoolLayout::syncParents(const string &path) const
+{
+   string directory = path;
+   do
+   {
+      directory.erase(directory.rfind('/'));
+      if (syncDirectory(directory) == -1)
+      {
+         return -1;
+      }
+   } while (directory.size() > rootPath.size());
+   return 0;
+}
+
+// Moves the files of username from their flat places into the shard, once:
+// while migrating, every path lookup comes through here first and waits for
+// a move of the same user in progress. True if anything was moved.
+bool SpoolLayout::resolve(const string &username)
+{
+   if (!migratingFlag)
+   {
+      return false;
+   }
+   lock_guard<mutex> lock(migrateLocks[hashName(username) % MIGRATE_STRIPES]);
+
+   string shard = shardPath(username);
+   string moves[2][2] = {{rootPath + "/" + username, shard + username},
+                         {rootPath + "/" INDEX_DIR "/" + username, shard + INDEX_DIR "/" + username}};
+   bool moved = false;
+   for (const auto &move : moves)
+   {
+      struct stat sb;
+      if (lstat(move[0].c_str(), &sb) == -1)
+      {
+         continue;
+      }
+      if (prepare(move[1]) == -1 || rename(move[0].c_str(), move[1].c_str()) == -1)
+      {
+         LOG(LEVEL_ERROR, "move %s into its shard: %s", move[0].c_str(), strerror(errno));
+         continue;
+      }
+      moved = true;
+   }
+   if (moved)
+   {
+      movedUsers++;
+   }
+   return moved;
+}
+
+int SpoolLayout::migrate(long &moved)
+{
+   long before = movedUsers;
+   const string directories[] = {rootPath, rootPath + "/" INDEX_DIR};
+   for (const string &path : directories)
+   {
+      DIR *dir = opendir(path.c_str());
+      if (dir == NULL)
+      {
+         if (errno == ENOENT)
+         {
+            continue;
+         }
+         return -1;
+      }
+      // entries renamed away meanwhile do not disturb the scan
+      struct dirent *entry;
+      while (!stopping && (entry = readdir(dir)) != NULL)
+      {
+         if (entry->d_name[0] != '.')
+         {
+            resolve(entry->d_name);
+         }
+      }
+      closedir(dir);
+   }
+   moved = movedUsers - before;
+   if (stopping)
+   {
+      return -1; // carried on at the next start
+   }
+
+   // left over temporary index files (hidden, so never taken for users) keep
+   // it, which does no harm
+   rmdir((rootPath + "/" INDEX_DIR).c_str());
+   if (writeMarker("sharded") == -1)
+   {
+      return -1;
+   }
+   migratingFlag = false;
+   return 0;
+}
+
+// replaces <spool>/.layout in one step
+int SpoolLayout::writeMarker(const char *marker)
+{
+   string path = rootPath + "/" LAYOUT_FILE;
+   string tempPath = path + ".tmp";
+   int fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+   if (fd == -1)
+   {
+      return -1;
+   }
+   string line = string(marker) + "\n";
+   int result = write(fd, line.data(), line.size()) == (ssize_t)line.size() && fsync(fd) == 0 ? 0 : -1;
+   close(fd);
+   if (result == -1 || rename(tempPath.c_str(), path.c_str()) == -1)
+   {
+      unlink(tempPath.c_str());
+      return -1;
+   }
+   return syncDirectory(rootPath);
+}
+
+void SpoolLayout::printStats()
+{
+   printf("spool layout %s%s, %ld users moved into shards\n",
+          typeName(layoutType), migratingFlag ? " (migrating)" : "", movedUsers.load());
+}
@@ -0,0 +1,88 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <string>
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+///////////////////////////////////////////////////////////////////////////////
+// SPOOL LAYOUT
+// Every path into the mail spool is built here. The flat layout keeps each
+// user directly in the spool directory: <spool>/<user>, and for the flat
+// store the index <spool>/.index/<user>. The sharded layout spreads users
+// over two levels of 256 directories picked by a hash of the name,
+// <spool>/.shards/<xx>/<yy>/<user> and <spool>/.shards/<xx>/<yy>/.index/<user>,
+// so no directory grows large even with millions of users.
+//
+// The layout of a spool is recorded in <spool>/.layout; a spool without one
+// is flat. Names starting with "." belong to the server. A user name that
+// cannot be a file name (empty, with a "/" or a NUL, or starting with ".")
+// gets an empty path, which every file operation rejects.
+//
+// A flat spool opened as sharded is migrated while the server runs: a
+// background thread moves the users into their shards, and a user that is
+// used before its turn is moved by the first path lookup. twmailer-spool
+// does the same offline.
+
+enum SpoolLayoutType
+{
+   LAYOUT_FLAT,
+   LAYOUT_SHARDED
+};
+
+#define MIGRATE_STRIPES 64
+
+class SpoolLayout
+{
+public:
+   SpoolLayout(const std::string &root, int type);
+   ~SpoolLayout();
+   SpoolLayout(const SpoolLayout &) = delete;
+   SpoolLayout &operator=(const SpoolLayout &) = delete;
+
+   // Checks the recorded layout against the wanted one, prepares a new spool
+   // and, for a flat spool wanted as sharded, starts migrating it (in a
+   // background thread if background is set). -1 if the spool cannot be
+   // used with this layout.
+   int open(bool background = true);
+
+   const std::string &root() const { return rootPath; }
+   int type() const { return layoutType; }
+   bool migrating() const { return migratingFlag; }
+
+   // mailbox file or maildir directory of username
+   std::string userPath(const std::string &username);
+   // index file of the flat store
+   std::string indexPath(const std::string &username);
+   // creates the missing directories between the spool and path
+   int prepare(const std::string &path) const;
+   // flushes the directories from the one holding path up to the spool,
+   // which makes a new user durable
+   int syncParents(const std::string &path) const;
+
+   // moves every user still in its flat place into its shard and records
+   // the spool as sharded; moved counts the users moved
+   int migrate(long &moved);
+   void printStats();
+
+   static bool validUser(const std::string &username);
+   // "flat", "sharded" or "migrating" as recorded in the spool
+   static std::string recordedLayout(const std::string &root);
+   static const char *typeName(int type) { return type == LAYOUT_SHARDED ? "sharded" : "flat"; }
+
+private:
+   std::string shardPath(const std::string &username) const;
+   bool resolve(const std::string &username);
+   int writeMarker(const char *marker);
+
+   std::string rootPath;
+   int layoutType;
+   std::atomic<bool> migratingFlag;
+   std::atomic<bool> stopping;
+   std::atomic<long> movedUsers;
+   std::mutex migrateLocks[MIGRATE_STRIPES];   // one user is moved once
+   std::thread migrator;
+};
+
+#endif
@@ -0,0 +1,100 @@
+#include <sys/types.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <iostream>
+#include <string>
+#include "spool.h"
+#include "log.h"
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+// twmailer-spool: offline maintenance of a mail spool. The server must not
+// run on the spool meanwhile.
+//
+//   status <spool>    the recorded layout and the users still in flat places
+//   migrate <spool>   moves every user into its shard, like a server started
+//                     with --layout sharded, and waits until it is done
+
+///////////////////////////////////////////////////////////////////////////////
+long countFlatUsers(const string &spool);
+
+int main(int argc, char **argv)
+{
+   const char *usage = "Usage: ./twmailer-spool status|migrate <spool>";
+   if (argc != 3)
+   {
+      cerr << usage << endl;
+      return EXIT_FAILURE;
+   }
+   string command = argv[1];
+   string spool = argv[2];
+
+   if (command == "status")
+   {
+      long users = countFlatUsers(spool);
+      if (users == -1)
+      {
+         perror(spool.c_str());
+         return EXIT_FAILURE;
+      }
+      printf("%s: %s layout, %ld users in flat places\n", spool.c_str(),
+             SpoolLayout::recordedLayout(spool).c_str(), users);
+      return EXIT_SUCCESS;
+   }
+   if (command != "migrate")
+   {
+      cerr << usage << endl;
+      return EXIT_FAILURE;
+   }
+
+   // failed moves are reported through the log
+   LogOptions logOptions = {LEVEL_INFO, "", 0, 0, 0, false};
+   if (startLogger(logOptions) == -1)
+   {
+      perror("start logger");
+      return EXIT_FAILURE;
+   }
+   long moved = 0;
+   int result;
+   {
+      SpoolLayout layout(spool, LAYOUT_SHARDED);
+      result = layout.open(false);
+      if (result == 0 && layout.migrating())
+      {
+         result = layout.migrate(moved);
+         if (result == -1)
+         {
+            perror("migrate spool");
+         }
+      }
+   }
+   stopLogger();
+   if (result == -1)
+   {
+      return EXIT_FAILURE;
+   }
+   printf("%s: sharded layout, %ld users moved\n", spool.c_str(), moved);
+   return EXIT_SUCCESS;
+}
+
+// users whose mailbox is directly in the spool; -1 if it cannot be read
+long countFlatUsers(const string &spool)
+{
+   DIR *dir = opendir(spool.c_str());
+   if (dir == NULL)
+   {
+      return -1;
+   }
+   long users = 0;
+   struct dirent *entry;
+   while ((entry = readdir(dir)) != NULL)
+   {
+      if (entry->d_name[0] != '.')
+      {
+         users++;
+      }
+   }
+   closedir(dir);
+   return users;
+}
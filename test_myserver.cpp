@@ -1,42 +1,1340 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <tuple>
+#include <thread>
+#include <functional>
 #include <gtest/gtest.h>
-#include "myserver.cpp"
-#include <gmock/gmock.h>
+#include "mailstore.h"
+#include "commands.h"
+#include "mailformat.h"
+#include "log.h"
+#include "twmailer.h"
 
-class MockClient {
-public:
-    MOCK_METHOD(int, send, (int, const void*, size_t, int), ());
-    MOCK_METHOD(int, recv, (int, void*, size_t, int), ());
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+// UNIT TESTS
+// The command functions the server runs (commands.cpp), on a store of each
+// backend in a temporary spool that is removed after every test. Nothing
+// drains the log queue here, so only errors are logged.
+//
+//   make test
+
+#define SERVER_BINARY "./twmailer-server"
+#define CONVERT_BINARY "./twmailer-convert"
+#define SERVER_START_MS 2000   // how long a started server may take to listen
+#define REPLY_TIMEOUT 5        // seconds to wait for a reply
+
+///////////////////////////////////////////////////////////////////////////////
+
+static int removeEntry(const char *path, const struct stat *, int, struct FTW *)
+{
+   return remove(path);
+}
+
+// a temporary spool and the commands on it, through the global mailStore
+class SpoolTest : public ::testing::Test
+{
+protected:
+   void SetUp() override
+   {
+      logLevel = LEVEL_ERROR;
+      char pattern[] = "/tmp/twmailer-test.XXXXXX";
+      ASSERT_NE(mkdtemp(pattern), nullptr);
+      root = pattern;
+      spool = root + "/spool";
+      ASSERT_EQ(mkdir(spool.c_str(), 0777), 0);
+      MessageBody::stagingDirectory = root;
+   }
+
+   void TearDown() override
+   {
+      delete mailStore;
+      mailStore = NULL;
+      nftw(root.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+   }
+
+   StoreOptions options()
+   {
+      StoreOptions options;
+      options.compactRatio = 0.5;
+      options.cacheBytes = 1024 * 1024;
+      options.lockStripes = 4;
+      options.durable = false;
+      options.layout = LAYOUT_FLAT;
+      options.searchBytes = 1024 * 1024;
+      return options;
+   }
+
+   int send(const string &receiver, const string &subject, const string &text)
+   {
+      MessageBody body;
+      body.append(text);
+      return processSend("sender", receiver, subject, body);
+   }
+
+   string list(const string &username, const string &arguments = "")
+   {
+      string reply;
+      EXPECT_EQ(processList(username, arguments, reply), 0);
+      return reply;
+   }
+
+   // the READ reply, "" if the command failed
+   string read(const string &username, const string &number)
+   {
+      string reply;
+      FileRange body;
+      return processRead(username, number, reply, body) == 0 ? reply : "";
+   }
+
+   int del(const string &username, const string &number)
+   {
+      string reply;
+      return processDel(username, number, reply);
+   }
+
+   string search(const string &username, const string &query)
+   {
+      string reply;
+      EXPECT_EQ(processSearch(username, query, reply), 0);
+      return reply;
+   }
+
+   // LIST SINCE token; the reply without its token line, which goes to next
+   string listSince(const string &username, const string &token, string &next)
+   {
+      string reply = list(username, "SINCE " + token);
+      size_t line = reply.rfind("Token: ");
+      EXPECT_NE(line, string::npos);
+      if (line == string::npos)
+      {
+         return reply;
+      }
+      next = reply.substr(line + 7, reply.size() - line - 8);
+      return reply.substr(0, line);
+   }
+
+   string root;
+   string spool;
 };
 
-TEST(ProcessSendTest, PositiveTest) {
-    MockClient mockClient;
-    EXPECT_CALL(mockClient, send(_, _, _, _)).Times(AnyNumber()); 
-    EXPECT_CALL(mockClient, recv(_, _, _, _)).Times(AnyNumber()); 
-    int result = processSend(mockClient);
+// every test on both backends, in both spool layouts
+class CommandTest : public SpoolTest, public ::testing::WithParamInterface<tuple<string, int>>
+{
+protected:
+   void SetUp() override
+   {
+      SpoolTest::SetUp();
+      openStore();
+   }
+
+   const string &backend() const { return get<0>(GetParam()); }
+
+   // (re)opens the store on the spool, as a server restart would
+   void openStore()
+   {
+      delete mailStore;
+      StoreOptions storeOptions = options();
+      storeOptions.layout = get<1>(GetParam());
+      mailStore = createMailStore(backend(), spool, storeOptions);
+      ASSERT_NE(mailStore, nullptr);
+      ASSERT_EQ(mailStore->open(), 0);
+   }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// COMMANDS
+
+TEST_P(CommandTest, SendThenList)
+{
+   EXPECT_EQ(send("alice", "first", "hello"), 1);
+   EXPECT_EQ(send("alice", "second", "world"), 1);
+   EXPECT_EQ(list("alice"), "1. Subject: first\n2. Subject: second\n");
+}
+
+TEST_P(CommandTest, ListUnknownUser)
+{
+   string reply;
+   EXPECT_EQ(processList("nobody", "", reply), -1);
+}
+
+TEST_P(CommandTest, ListPage)
+{
+   for (int i = 1; i <= 5; ++i)
+   {
+      send("alice", to_string(i), "body");
+   }
+   del("alice", "2");
+   EXPECT_EQ(list("alice", "1 2"), "3. Subject: 3\n4. Subject: 4\nTotal: 4\n");
+   EXPECT_EQ(list("alice", "9 2"), "Total: 4\n");
+   string reply;
+   EXPECT_EQ(processList("alice", "1", reply), -1);
+}
+
+TEST_P(CommandTest, ReadByNumber)
+{
+   send("alice", "first", "hello");
+   send("alice", "second", "line one\nline two\n");
+   EXPECT_EQ(read("alice", "1"), "sender\nfirst\nhello");
+   EXPECT_EQ(read("alice", "2"), "sender\nsecond\nline one\nline two\n");
+   EXPECT_EQ(read("alice", "3"), "");
+}
+
+TEST_P(CommandTest, ReadLargeBodyFromFile)
+{
+   string text(MIN_SENDFILE * 2, 'x');
+   send("alice", "large", text);
+   string reply;
+   FileRange body;
+   ASSERT_EQ(processRead("alice", "1", reply, body), 0);
+   ASSERT_TRUE(body.file || reply.size() > text.size());
+   if (body.file)
+   {
+      EXPECT_EQ(reply, "sender\nlarge\n");
+      EXPECT_EQ(body.length, text.size());
+   }
+}
+
+TEST_P(CommandTest, InvalidMessageNumbers)
+{
+   send("alice", "first", "hello");
+   EXPECT_EQ(read("alice", "0"), "");
+   EXPECT_EQ(read("alice", "-1"), "");
+   EXPECT_EQ(read("alice", "1x"), "");
+   EXPECT_EQ(read("alice", ""), "");
+   EXPECT_EQ(del("alice", "0"), -1);
+}
+
+TEST_P(CommandTest, DeleteKeepsOtherNumbers)
+{
+   send("alice", "first", "one");
+   send("alice", "second", "two");
+   send("alice", "third", "three");
+   EXPECT_EQ(del("alice", "2"), 0);
+   EXPECT_EQ(del("alice", "2"), -1);
+   EXPECT_EQ(list("alice"), "1. Subject: first\n3. Subject: third\n");
+   EXPECT_EQ(read("alice", "2"), "");
+   EXPECT_EQ(read("alice", "3"), "sender\nthird\nthree");
+}
 
-    // Assert the result
-    EXPECT_EQ(result, 1);
+// the numbers of deleted messages stay used, even the highest across a restart
+TEST_P(CommandTest, NumbersNotReusedAfterRestart)
+{
+   for (int i = 1; i <= 3; ++i)
+   {
+      ASSERT_EQ(send("alice", to_string(i), "body"), 1);
+   }
+   ASSERT_EQ(del("alice", "3"), 0);
+   ASSERT_EQ(del("alice", "1"), 0);
+   openStore();
+   ASSERT_EQ(send("alice", "4", "body"), 1);
+   EXPECT_EQ(list("alice"), "2. Subject: 2\n4. Subject: 4\n");
+   ASSERT_EQ(del("alice", "2"), 0);
+   ASSERT_EQ(del("alice", "4"), 0);
+   openStore();
+   ASSERT_EQ(send("alice", "5", "body"), 1);
+   EXPECT_EQ(list("alice"), "5. Subject: 5\n");
+   EXPECT_EQ(read("alice", "3"), "");
 }
 
-TEST(ProcessSendTest, NegativeTest) {
-    MockClient mockClient;
+TEST_P(CommandTest, Search)
+{
+   send("alice", "lunch", "pizza at noon");
+   send("alice", "dinner", "pizza tonight");
+   send("alice", "other", "nothing");
+   EXPECT_EQ(search("alice", "pizza"), "1. Subject: lunch\n2. Subject: dinner\n");
+   del("alice", "1");
+   EXPECT_EQ(search("alice", "PIZZA tonight"), "2. Subject: dinner\n");
+   send("alice", "late", "more pizza");
+   EXPECT_EQ(search("alice", "pizza"), "2. Subject: dinner\n4. Subject: late\n");
+}
+
+TEST_P(CommandTest, ListSinceDeltas)
+{
+   send("alice", "first", "one");
+   string token, next;
+   EXPECT_EQ(listSince("alice", "0", token), "Reset\n1. Subject: first\n");
+   EXPECT_EQ(listSince("alice", token, next), "");
+   EXPECT_EQ(next, token);
+   send("alice", "second", "two");
+   del("alice", "1");
+   EXPECT_EQ(listSince("alice", token, next), "2. Subject: second\n1. Deleted\n");
+   EXPECT_EQ(listSince("alice", next, token), "");
+}
 
-    EXPECT_CALL(mockClient, send(_, _, _, _)).Times(AnyNumber());  
-    EXPECT_CALL(mockClient, recv(_, _, _, _)).Times(AnyNumber());
-    int result = processSend(mockClient);
+TEST_P(CommandTest, ListSinceInvalidToken)
+{
+   send("alice", "first", "one");
+   string reply;
+   EXPECT_EQ(processList("alice", "SINCE x.1", reply), -1);
+   EXPECT_EQ(processList("alice", "SINCE 1", reply), -1);
+   EXPECT_EQ(processList("alice", "SINCE 1.-1", reply), -1);
+}
 
-    // Assert the result
-    EXPECT_EQ(result, -1);
+// A restart loses the maildir change log, so its tokens start a new
+// generation; the flat index survives and keeps answering them.
+TEST_P(CommandTest, ListSinceAfterRestart)
+{
+   send("alice", "first", "one");
+   string token, next;
+   listSince("alice", "0", token);
+   openStore();
+   send("alice", "second", "two");
+   if (backend() == "maildir")
+   {
+      EXPECT_EQ(listSince("alice", token, next), "Reset\n1. Subject: first\n2. Subject: second\n");
+      EXPECT_NE(next.substr(0, next.find('.')), token.substr(0, token.find('.')));
+   }
+   else
+   {
+      EXPECT_EQ(listSince("alice", token, next), "2. Subject: second\n");
+   }
+   EXPECT_EQ(listSince("alice", next, token), "");
 }
 
-TEST(ProcessSendTest, AnotherTest) {
-    MockClient mockClient;
+INSTANTIATE_TEST_CASE_P(Backends, CommandTest,
+                        ::testing::Combine(::testing::Values("flat", "maildir"),
+                                           ::testing::Values(LAYOUT_FLAT, LAYOUT_SHARDED)));
+
+///////////////////////////////////////////////////////////////////////////////
+// SPOOL MIGRATION
+// A flat spool opened as sharded is migrated in the background; a user is
+// moved on first use if the migration has not got to it yet. Either way the
+// messages keep their numbers.
 
-    EXPECT_CALL(mockClient, send(_, _, _, _)).Times(AnyNumber());
-    EXPECT_CALL(mockClient, recv(_, _, _, _)).Times(AnyNumber());
+class MigrationTest : public SpoolTest, public ::testing::WithParamInterface<string>
+{
+protected:
+   void openStore(int layout)
+   {
+      delete mailStore;
+      StoreOptions storeOptions = options();
+      storeOptions.layout = layout;
+      mailStore = createMailStore(GetParam(), spool, storeOptions);
+      ASSERT_NE(mailStore, nullptr);
+      ASSERT_EQ(mailStore->open(), 0);
+   }
+};
+
+TEST_P(MigrationTest, NumbersSurviveMigration)
+{
+   openStore(LAYOUT_FLAT);
+   for (int i = 1; i <= 3; ++i)
+   {
+      ASSERT_EQ(send("alice", to_string(i), "alice" + to_string(i)), 1);
+      ASSERT_EQ(send("bob", to_string(i), "bob" + to_string(i)), 1);
+   }
+   ASSERT_EQ(del("alice", "2"), 0);
+
+   openStore(LAYOUT_SHARDED);
+   EXPECT_EQ(list("alice"), "1. Subject: 1\n3. Subject: 3\n");
+   EXPECT_EQ(read("alice", "3"), "sender\n3\nalice3");
+   EXPECT_EQ(read("alice", "2"), "");
+   EXPECT_EQ(read("bob", "2"), "sender\n2\nbob2");
+
+   for (int waited = 0; waited < 5000 && SpoolLayout::recordedLayout(spool) != "sharded"; waited += 10)
+   {
+      usleep(10 * 1000);
+   }
+   ASSERT_EQ(SpoolLayout::recordedLayout(spool), "sharded");
+   EXPECT_NE(access((spool + "/alice").c_str(), F_OK), 0);
+   EXPECT_NE(access((spool + "/bob").c_str(), F_OK), 0);
+
+   openStore(LAYOUT_SHARDED);
+   EXPECT_EQ(list("bob"), "1. Subject: 1\n2. Subject: 2\n3. Subject: 3\n");
+   EXPECT_EQ(del("alice", "2"), -1);
+   ASSERT_EQ(send("alice", "4", "alice4"), 1);
+   EXPECT_EQ(list("alice"), "1. Subject: 1\n3. Subject: 3\n4. Subject: 4\n");
 }
 
-int main(int argc, char** argv) {
-    ::testing::InitGoogleTest(&argc, argv);
-    return RUN_ALL_TESTS();
-}
\ No newline at end of file
+INSTANTIATE_TEST_CASE_P(Backends, MigrationTest, ::testing::Values("flat", "maildir"));
+
+///////////////////////////////////////////////////////////////////////////////
+// FLAT COMPACTION
+// A compacted mailbox has to answer every number a client may hold exactly
+// as before.
+
+// the flat backend without the header cache, compacted when a test says so
+class CompactionTest : public SpoolTest
+{
+protected:
+   void SetUp() override
+   {
+      SpoolTest::SetUp();
+      StoreOptions flatOptions = options();
+      flatOptions.compactRatio = 1;   // only mailboxes without live messages on their own
+      flat = new FlatStore(spool, flatOptions);
+      mailStore = flat;
+      ASSERT_EQ(flat->open(), 0);
+   }
+
+   off_t mailboxSize(const string &username)
+   {
+      struct stat sb;
+      return stat((spool + "/" + username).c_str(), &sb) == 0 ? sb.st_size : -1;
+   }
+
+   // sends subjects 1..count with bodies "body<n>", deletes numbers and compacts
+   void sendDeleteCompact(int count, const vector<int> &numbers)
+   {
+      for (int i = 1; i <= count; ++i)
+      {
+         ASSERT_EQ(send("alice", to_string(i), "body" + to_string(i)), 1);
+      }
+      for (int number : numbers)
+      {
+         ASSERT_EQ(del("alice", to_string(number)), 0);
+      }
+      off_t before = mailboxSize("alice");
+      ASSERT_EQ(flat->compact("alice"), 0);
+      ASSERT_LT(mailboxSize("alice"), before);
+   }
+
+   FlatStore *flat;
+};
+
+TEST_F(CompactionTest, ReadAndDeleteByNumber)
+{
+   sendDeleteCompact(5, {2, 3, 4});
+   EXPECT_EQ(list("alice"), "1. Subject: 1\n5. Subject: 5\n");
+   EXPECT_EQ(read("alice", "1"), "sender\n1\nbody1");
+   EXPECT_EQ(read("alice", "5"), "sender\n5\nbody5");
+   for (const char *number : {"2", "3", "4", "6"})
+   {
+      EXPECT_EQ(read("alice", number), "");
+      EXPECT_EQ(del("alice", number), -1);
+   }
+   EXPECT_EQ(list("alice"), "1. Subject: 1\n5. Subject: 5\n");
+
+   EXPECT_EQ(del("alice", "5"), 0);
+   EXPECT_EQ(send("alice", "6", "body6"), 1);
+   EXPECT_EQ(list("alice"), "1. Subject: 1\n6. Subject: 6\n");
+   EXPECT_EQ(read("alice", "6"), "sender\n6\nbody6");
+}
+
+TEST_F(CompactionTest, RepeatedCompaction)
+{
+   sendDeleteCompact(4, {1, 2});
+   ASSERT_EQ(del("alice", "3"), 0);
+   ASSERT_EQ(flat->compact("alice"), 0);
+   EXPECT_EQ(list("alice"), "4. Subject: 4\n");
+   EXPECT_EQ(read("alice", "4"), "sender\n4\nbody4");
+}
+
+TEST_F(CompactionTest, NumbersSurviveIndexRebuild)
+{
+   sendDeleteCompact(5, {1, 3});
+   ASSERT_EQ(unlink((spool + "/.index/alice").c_str()), 0);
+   EXPECT_EQ(list("alice"), "2. Subject: 2\n4. Subject: 4\n5. Subject: 5\n");
+   EXPECT_EQ(read("alice", "4"), "sender\n4\nbody4");
+   EXPECT_EQ(del("alice", "3"), -1);
+}
+
+TEST_F(CompactionTest, SearchKeepsNumbers)
+{
+   for (int i = 1; i <= 4; ++i)
+   {
+      send("alice", to_string(i), i % 2 == 0 ? "even" : "odd");
+   }
+   EXPECT_EQ(search("alice", "even"), "2. Subject: 2\n4. Subject: 4\n");
+   del("alice", "1");
+   del("alice", "2");
+   ASSERT_EQ(flat->compact("alice"), 0);
+   EXPECT_EQ(search("alice", "even"), "4. Subject: 4\n");
+   EXPECT_EQ(search("alice", "odd"), "3. Subject: 3\n");
+}
+
+// compaction keeps the generation, so a token from before it still works
+TEST_F(CompactionTest, ListSinceAcrossCompaction)
+{
+   string token, next;
+   for (int i = 1; i <= 5; ++i)
+   {
+      send("alice", to_string(i), "body");
+   }
+   listSince("alice", "0", token);
+   del("alice", "2");
+   del("alice", "3");
+   del("alice", "4");
+   ASSERT_EQ(flat->compact("alice"), 0);
+   send("alice", "6", "body");
+   EXPECT_EQ(listSince("alice", token, next), "6. Subject: 6\n2. Deleted\n3. Deleted\n4. Deleted\n");
+   EXPECT_EQ(next.substr(0, next.find('.')), token.substr(0, token.find('.')));
+   EXPECT_EQ(listSince("alice", next, token), "");
+}
+
+// a rebuilt index starts a new generation: older tokens get a reset
+TEST_F(CompactionTest, ListSinceAcrossIndexRebuild)
+{
+   string token, next;
+   send("alice", "1", "body");
+   send("alice", "2", "body");
+   listSince("alice", "0", token);
+   del("alice", "1");
+   ASSERT_EQ(unlink((spool + "/.index/alice").c_str()), 0);
+   send("alice", "3", "body");
+   EXPECT_EQ(listSince("alice", token, next), "Reset\n2. Subject: 2\n3. Subject: 3\n");
+   EXPECT_NE(next.substr(0, next.find('.')), token.substr(0, token.find('.')));
+   EXPECT_EQ(listSince("alice", next, token), "");
+   del("alice", "2");
+   EXPECT_EQ(listSince("alice", token, next), "2. Deleted\n");
+}
+
+// The temporary file of a compaction must not be the index of another user,
+// which compacting would truncate and could rename over the mailbox.
+TEST_F(CompactionTest, TempFileIsNoUsersIndex)
+{
+   ASSERT_EQ(send("alice.compact", "other", "other body"), 1);
+   EXPECT_EQ(list("alice.compact"), "1. Subject: other\n");
+   struct stat before, after;
+   string otherIndex = spool + "/.index/alice.compact";
+   ASSERT_EQ(stat(otherIndex.c_str(), &before), 0);
+
+   sendDeleteCompact(3, {2});
+   ASSERT_EQ(stat(otherIndex.c_str(), &after), 0);
+   EXPECT_EQ(after.st_ino, before.st_ino);
+   EXPECT_EQ(after.st_size, before.st_size);
+   EXPECT_EQ(list("alice"), "1. Subject: 1\n3. Subject: 3\n");
+   EXPECT_EQ(read("alice", "3"), "sender\n3\nbody3");
+   EXPECT_EQ(read("alice.compact", "1"), "sender\nother\nother body");
+}
+
+// Rebuilding an index writes it to a temporary file named after the thread;
+// a user with that name keeps the index of its own.
+TEST_F(CompactionTest, RebuildTempFileIsNoUsersIndex)
+{
+   string other = "alice.tmp." + to_string(hash<thread::id>()(this_thread::get_id()));
+   ASSERT_EQ(send(other, "other", "other body"), 1);
+   sendDeleteCompact(3, {2});
+   struct stat before, after;
+   string otherIndex = spool + "/.index/" + other;
+   ASSERT_EQ(stat(otherIndex.c_str(), &before), 0);
+
+   ASSERT_EQ(unlink((spool + "/.index/alice").c_str()), 0);
+   EXPECT_EQ(list("alice"), "1. Subject: 1\n3. Subject: 3\n");
+   ASSERT_EQ(stat(otherIndex.c_str(), &after), 0);
+   EXPECT_EQ(after.st_ino, before.st_ino);
+   EXPECT_EQ(list(other), "1. Subject: other\n");
+   EXPECT_EQ(read(other, "1"), "sender\nother\nother body");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LEGACY SCANNER
+// Every scanner has to split a legacy mailbox exactly like the scalar one,
+// wherever the markers fall relative to its blocks.
+
+// a message as offsets into the mailbox, comparable between scans
+struct ScannedMessage
+{
+   size_t sender, senderLength, subject, subjectLength, body, bodyLength;
+   bool deleted;
+
+   bool operator==(const ScannedMessage &other) const
+   {
+      return sender == other.sender && senderLength == other.senderLength && subject == other.subject &&
+             subjectLength == other.subjectLength && body == other.body && bodyLength == other.bodyLength &&
+             deleted == other.deleted;
+   }
+};
+
+static vector<ScannedMessage> scanLegacy(const string &mailbox, int scanner)
+{
+   vector<ScannedMessage> messages;
+   const char *data = mailbox.data();
+   scanLegacyMailbox(data, mailbox.size(), [&](const LegacyMessage &message) {
+      messages.push_back({(size_t)(message.sender - data), message.senderLength, (size_t)(message.subject - data),
+                          message.subjectLength, (size_t)(message.body - data), message.bodyLength, message.deleted});
+   }, scanner);
+   return messages;
+}
+
+// Three messages. The first body holds lines that are no markers: a
+// MESSAGE line without the blank line in front, which restarts the search
+// behind it, newlines 8 bytes apart and a run of blank lines. The padding
+// behind them (shift) and in the second body (tail) moves the next markers
+// across the 16, 32 and 64 byte blocks, and the last ones into the bytes
+// left to the scalar search.
+static string legacyMailboxText(size_t shift, size_t tail)
+{
+   return "\nMESSAGE\nalice\nfirst\ntext\nMESSAGE\nquoted\n\nMESSAGX\n\nDELETE\n\n\n\n\n\n\n\n\n\n\nMESSAGEE\n" +
+          string(shift, 'a') + "\n"
+          "\n\nDELETED\nbob\nsecond\n" + string(tail, 'b') + "\n"
+          "\n\nMESSAGE\ncarol\nthird\nbody\n";
+}
+
+TEST(LegacyScannerTest, ScalarSplitsMessages)
+{
+   string mailbox = legacyMailboxText(0, 0);
+   vector<ScannedMessage> messages = scanLegacy(mailbox, SCANNER_SCALAR);
+   ASSERT_EQ(messages.size(), 3u);
+   EXPECT_EQ(mailbox.substr(messages[0].sender, messages[0].senderLength), "alice");
+   EXPECT_EQ(mailbox.substr(messages[0].body, messages[0].bodyLength),
+             "text\nMESSAGE\nquoted\n\nMESSAGX\n\nDELETE\n\n\n\n\n\n\n\n\n\n\nMESSAGEE\n\n");
+   EXPECT_FALSE(messages[0].deleted);
+   EXPECT_EQ(mailbox.substr(messages[1].subject, messages[1].subjectLength), "second");
+   EXPECT_EQ(mailbox.substr(messages[1].body, messages[1].bodyLength), "\n");
+   EXPECT_TRUE(messages[1].deleted);
+   EXPECT_EQ(mailbox.substr(messages[2].sender, messages[2].senderLength), "carol");
+   EXPECT_EQ(mailbox.substr(messages[2].body, messages[2].bodyLength), "body");
+}
+
+TEST(LegacyScannerTest, ScannersAgree)
+{
+   vector<int> scanners;
+   for (int scanner : {SCANNER_BEST, SCANNER_SSE2, SCANNER_AVX2})
+   {
+      if (scannerSupported(scanner))
+      {
+         scanners.push_back(scanner);
+      }
+   }
+   for (size_t shift = 0; shift <= 130; ++shift)
+   {
+      for (size_t tail = 0; tail <= 80; ++tail)
+      {
+         string mailbox = legacyMailboxText(shift, tail);
+         vector<ScannedMessage> expected = scanLegacy(mailbox, SCANNER_SCALAR);
+         ASSERT_EQ(expected.size(), 3u);
+         for (int scanner : scanners)
+         {
+            ASSERT_EQ(scanLegacy(mailbox, scanner), expected) << "scanner " << scanner << ", shift " << shift
+                                                          << ", tail " << tail;
+         }
+      }
+   }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CONVERTER
+// twmailer-convert on a legacy text mailbox and the index the server kept
+// for it, then the commands on the converted mailbox.
+
+// the legacy index as convert.cpp reads it
+struct LegacyIndexHeader
+{
+   char magic[4];
+   uint32_t recordCount;
+   uint64_t mailboxSize;
+   uint64_t mailboxInode;
+   uint64_t mailboxMtime;
+   uint64_t deadBytes;
+   uint64_t generation;
+   uint64_t sequence;
+   uint64_t deletionCount;
+   char deletions[64 * 16];
+};
+
+struct LegacyIndexRecord
+{
+   uint64_t offset;
+   uint32_t length;
+   uint32_t subjectOffset;
+   uint32_t bodyOffset;
+   uint32_t flags;
+   uint64_t sequence;
+};
+
+class ConvertTest : public SpoolTest
+{
+protected:
+   // appends a message in the legacy format and its index record
+   void appendLegacy(const string &sender, const string &subject, const string &body, bool deleted)
+   {
+      LegacyIndexRecord record = {};
+      record.offset = mailbox.size() + 1;
+      record.subjectOffset = 8 + sender.size() + 1;
+      record.bodyOffset = record.subjectOffset + subject.size() + 1;
+      record.length = record.bodyOffset + body.size() + 1;
+      record.flags = deleted ? 1 : 0;
+      record.sequence = records.size() + 1;
+      records.push_back(record);
+      mailbox += string("\n") + (deleted ? "DELETED" : "MESSAGE") + "\n" + sender + "\n" + subject + "\n" + body + "\n";
+   }
+
+   // writes the mailbox of alice and an index that matches it
+   void writeLegacy()
+   {
+      string path = spool + "/alice";
+      int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      ASSERT_NE(fd, -1);
+      ASSERT_EQ(write(fd, mailbox.data(), mailbox.size()), (ssize_t)mailbox.size());
+      close(fd);
+      struct stat sb;
+      ASSERT_EQ(stat(path.c_str(), &sb), 0);
+
+      LegacyIndexHeader header = {};
+      memcpy(header.magic, "TWI3", 4);
+      header.recordCount = records.size();
+      header.mailboxSize = sb.st_size;
+      header.mailboxInode = sb.st_ino;
+      header.mailboxMtime = (uint64_t)sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec;
+      header.sequence = records.size();
+      ASSERT_EQ(mkdir((spool + "/.index").c_str(), 0777), 0);
+      fd = open((spool + "/.index/alice").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      ASSERT_NE(fd, -1);
+      ASSERT_EQ(write(fd, &header, sizeof(header)), (ssize_t)sizeof(header));
+      size_t size = records.size() * sizeof(LegacyIndexRecord);
+      ASSERT_EQ(write(fd, records.data(), size), (ssize_t)size);
+      close(fd);
+   }
+
+   // the exit status of twmailer-convert on the spool
+   int convert()
+   {
+      ::testing::internal::CaptureStdout();
+      fflush(stdout);
+      pid_t child = fork();
+      if (child == 0)
+      {
+         execl(CONVERT_BINARY, CONVERT_BINARY, spool.c_str(), (char *)NULL);
+         _exit(127);
+      }
+      int status = -1;
+      waitpid(child, &status, 0);
+      ::testing::internal::GetCapturedStdout();
+      return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+   }
+
+   static string contents(const string &path)
+   {
+      string data;
+      char buffer[4096];
+      int fd = open(path.c_str(), O_RDONLY);
+      ssize_t size;
+      while (fd != -1 && (size = ::read(fd, buffer, sizeof(buffer))) > 0)
+      {
+         data.append(buffer, size);
+      }
+      if (fd != -1)
+      {
+         close(fd);
+      }
+      return data;
+   }
+
+   string mailbox;
+   vector<LegacyIndexRecord> records;
+};
+
+// The index keeps the MESSAGE line in the first body from being taken for
+// a message, and the deleted message keeps its number.
+TEST_F(ConvertTest, KeepsNumbersBodiesAndDeletions)
+{
+   ASSERT_EQ(access(CONVERT_BINARY, X_OK), 0) << CONVERT_BINARY << " not built";
+   appendLegacy("bob", "first", "quoted:\n\nMESSAGE\nnot a message\n", false);
+   appendLegacy("carol", "second", "gone\n", true);
+   appendLegacy("dave", "third", "last\n", false);
+   writeLegacy();
+   ASSERT_EQ(convert(), 0);
+
+   mailStore = createMailStore("flat", spool, options());
+   ASSERT_NE(mailStore, nullptr);
+   ASSERT_EQ(mailStore->open(), 0);
+   EXPECT_EQ(list("alice"), "1. Subject: first\n3. Subject: third\n");
+   EXPECT_EQ(read("alice", "1"), "bob\nfirst\nquoted:\n\nMESSAGE\nnot a message\n");
+   EXPECT_EQ(read("alice", "2"), "");
+   EXPECT_EQ(del("alice", "2"), -1);
+   EXPECT_EQ(read("alice", "3"), "dave\nthird\nlast\n");
+   delete mailStore;
+   mailStore = NULL;
+
+   // a second run finds nothing left to do
+   string converted = contents(spool + "/alice");
+   struct stat before, after;
+   ASSERT_EQ(stat((spool + "/alice").c_str(), &before), 0);
+   ASSERT_EQ(convert(), 0);
+   ASSERT_EQ(stat((spool + "/alice").c_str(), &after), 0);
+   EXPECT_EQ(after.st_ino, before.st_ino);
+   EXPECT_EQ(contents(spool + "/alice"), converted);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SERVER
+// What needs the event loop is tested against a twmailer-server of its own,
+// ./twmailer-server unless TWMAILER_SERVER names another binary, started
+// on a free localhost port with a spool below the test's directory.
+
+class ServerTest : public SpoolTest
+{
+protected:
+   void SetUp() override
+   {
+      SpoolTest::SetUp();
+      server = -1;
+   }
+
+   void TearDown() override
+   {
+      for (int fd : clients)
+      {
+         close(fd);
+      }
+      if (server > 0)
+      {
+         kill(server, SIGTERM);
+         waitpid(server, NULL, 0);
+      }
+      SpoolTest::TearDown();
+   }
+
+   // starts the server with one worker and options in front of its arguments
+   void startServer(const vector<string> &options = vector<string>())
+   {
+      // a free port; the server binds it with SO_REUSEPORT right after
+      int probe = socket(AF_INET, SOCK_STREAM, 0);
+      address = sockaddr_in();
+      address.sin_family = AF_INET;
+      address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      socklen_t length = sizeof(address);
+      ASSERT_EQ(bind(probe, (struct sockaddr *)&address, sizeof(address)), 0);
+      ASSERT_EQ(getsockname(probe, (struct sockaddr *)&address, &length), 0);
+      close(probe);
+
+      const char *binary = getenv("TWMAILER_SERVER") != NULL ? getenv("TWMAILER_SERVER") : SERVER_BINARY;
+      ASSERT_EQ(access(binary, X_OK), 0) << binary << " not built";
+      // the server creates its spool itself
+      vector<string> arguments = {binary, "--workers", "1", "--log-level", "error"};
+      arguments.insert(arguments.end(), options.begin(), options.end());
+      arguments.push_back(to_string(ntohs(address.sin_port)));
+      arguments.push_back(root + "/server");
+      vector<char *> argv;
+      for (string &argument : arguments)
+      {
+         argv.push_back(&argument[0]);
+      }
+      argv.push_back(NULL);
+      server = fork();
+      ASSERT_NE(server, -1);
+      if (server == 0)
+      {
+         execv(binary, argv.data());
+         _exit(127);
+      }
+
+      int fd = -1;
+      for (int waited = 0; fd == -1 && waited < SERVER_START_MS; waited += 10)
+      {
+         fd = socket(AF_INET, SOCK_STREAM, 0);
+         if (connect(fd, (const struct sockaddr *)&address, sizeof(address)) == -1)
+         {
+            close(fd);
+            fd = -1;
+            usleep(10 * 1000);
+         }
+      }
+      ASSERT_NE(fd, -1) << "server did not start";
+      close(fd);
+   }
+
+   // a new connection past the welcome message, -1 on failure
+   int connectClient()
+   {
+      int fd = socket(AF_INET, SOCK_STREAM, 0);
+      if (connect(fd, (const struct sockaddr *)&address, sizeof(address)) == -1)
+      {
+         ADD_FAILURE() << "connect: " << strerror(errno);
+         close(fd);
+         return -1;
+      }
+      clients.push_back(fd);
+      struct timeval timeout = {REPLY_TIMEOUT, 0};
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      // the welcome ends with the protocols line
+      EXPECT_NE(readUntil(fd, "Protocols: LINE FRAMED/1\r\n"), "");
+      return fd;
+   }
+
+   // a new connection switched to FRAMED/1, which is acknowledged in lines
+   int connectFramed()
+   {
+      int fd = connectClient();
+      writeAll(fd, "PROTO FRAMED/1\n");
+      EXPECT_EQ(readUntil(fd, "<< OK\n"), "<< OK\n");
+      return fd;
+   }
+
+   static void writeAll(int fd, const string &data)
+   {
+      ASSERT_EQ(write(fd, data.data(), data.size()), (ssize_t)data.size());
+   }
+
+   // the received bytes up to and including the first end, "" on timeout
+   static string readUntil(int fd, const string &end)
+   {
+      string received;
+      char c;
+      while (received.size() < end.size() || received.compare(received.size() - end.size(), end.size(), end) != 0)
+      {
+         if (recv(fd, &c, 1, 0) != 1)
+         {
+            return "";
+         }
+         received += c;
+      }
+      return received;
+   }
+
+   // sends a line protocol request and returns its answer up to and
+   // including "<< OK\n", "" on timeout
+   static string command(int fd, const string &request)
+   {
+      writeAll(fd, request);
+      return readUntil(fd, "<< OK\n");
+   }
+
+   // false if the server closed the connection or did not answer
+   static bool readExactly(int fd, string &data, size_t length)
+   {
+      data.resize(length);
+      for (size_t done = 0; done < length;)
+      {
+         ssize_t got = recv(fd, &data[done], length - done, 0);
+         if (got <= 0)
+         {
+            return false;
+         }
+         done += got;
+      }
+      return true;
+   }
+
+   static void appendUint32(string &out, uint32_t value)
+   {
+      out += (char)(value >> 24);
+      out += (char)(value >> 16);
+      out += (char)(value >> 8);
+      out += (char)value;
+   }
+
+   static string frame(const vector<string> &fields)
+   {
+      string body;
+      body += (char)(fields.size() >> 8);
+      body += (char)fields.size();
+      for (const string &field : fields)
+      {
+         appendUint32(body, field.size());
+         body += field;
+      }
+      string out;
+      appendUint32(out, body.size());
+      return out + body;
+   }
+
+   // the fields of the next reply frame; empty if none arrived
+   static vector<string> readFrame(int fd)
+   {
+      vector<string> fields;
+      string header;
+      if (!readExactly(fd, header, 6))
+      {
+         return fields;
+      }
+      const unsigned char *bytes = (const unsigned char *)header.data();
+      uint16_t count = (bytes[4] << 8) | bytes[5];
+      for (uint16_t i = 0; i < count; ++i)
+      {
+         string length, field;
+         if (!readExactly(fd, length, 4))
+         {
+            return vector<string>();
+         }
+         bytes = (const unsigned char *)length.data();
+         if (!readExactly(fd, field, ((uint32_t)bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3]))
+         {
+            return vector<string>();
+         }
+         fields.push_back(field);
+      }
+      return fields;
+   }
+
+   // whether the server hung up instead of answering
+   static bool dropped(int fd)
+   {
+      char c;
+      return recv(fd, &c, 1, 0) == 0;
+   }
+
+   pid_t server;
+   struct sockaddr_in address;
+   vector<int> clients;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// FRAMED PROTOCOL
+// Byte streams a client may send after "PROTO FRAMED/1": frames cut into
+// pieces or run together, binary fields, and the malformed frames that have
+// to cost the client its connection.
+
+class FramedTest : public ServerTest
+{
+protected:
+   void SetUp() override
+   {
+      ServerTest::SetUp();
+      startServer();
+      client = connectFramed();
+   }
+
+   int client;
+};
+
+TEST_F(FramedTest, RoundTrip)
+{
+   writeAll(client, frame({"SEND", "bob", "alice", "hello", "a body"}));
+   EXPECT_EQ(readFrame(client), vector<string>({"OK", ""}));
+   writeAll(client, frame({"LIST", "alice"}));
+   EXPECT_EQ(readFrame(client), vector<string>({"OK", "1. Subject: hello\n"}));
+   writeAll(client, frame({"READ", "alice", "1"}));
+   EXPECT_EQ(readFrame(client), vector<string>({"OK", "bob\nhello\na body"}));
+}
+
+TEST_F(FramedTest, FrameInSingleBytes)
+{
+   string request = frame({"SEND", "bob", "alice", "split", "byte by byte"}) + frame({"READ", "alice", "1"});
+   for (char c : request)
+   {
+      ASSERT_EQ(write(client, &c, 1), 1);
+      usleep(100);
+   }
+   EXPECT_EQ(readFrame(client), vector<string>({"OK", ""}));
+   EXPECT_EQ(readFrame(client), vector<string>({"OK", "bob\nsplit\nbyte by byte"}));
+}
+
+TEST_F(FramedTest, PipelinedFramesWithRequestIds)
+{
+   writeAll(client, frame({"#1 SEND", "bob", "alice", "one", "1"}) + frame({"#2 SEND", "bob", "alice", "two", "2"}) +
+                    frame({"#3 LIST", "alice"}) + frame({"#4 DEL", "alice", "1"}) + frame({"#5 READ", "alice", "1"}));
+   EXPECT_EQ(readFrame(client), vector<string>({"OK", "", "1"}));
+   EXPECT_EQ(readFrame(client), vector<string>({"OK", "", "2"}));
+   EXPECT_EQ(readFrame(client), vector<string>({"OK", "1. Subject: one\n2. Subject: two\n", "3"}));
+   EXPECT_EQ(readFrame(client), vector<string>({"OK", "Message 1 deleted successfully.\n", "4"}));
+   EXPECT_EQ(readFrame(client), vector<string>({"ERR", "Message nr. 1 doesn't exist!\n", "5"}));
+}
+
+// lines of "." and NUL bytes mean nothing in a field
+TEST_F(FramedTest, BinaryFields)
+{
+   string body("line\n.\n\0\r\n\xff end", 15);
+   writeAll(client, frame({"SEND", "bob", "alice", "", body}));
+   EXPECT_EQ(readFrame(client), vector<string>({"OK", ""}));
+   writeAll(client, frame({"READ", "alice", "1"}));
+   EXPECT_EQ(readFrame(client), vector<string>({"OK", "bob\n\n" + body}));
+}
+
+TEST_F(FramedTest, EmptyBody)
+{
+   writeAll(client, frame({"SEND", "bob", "alice", "nothing", ""}));
+   EXPECT_EQ(readFrame(client), vector<string>({"OK", ""}));
+   writeAll(client, frame({"READ", "alice", "1"}));
+   EXPECT_EQ(readFrame(client), vector<string>({"OK", "bob\nnothing\n"}));
+}
+
+// a well-formed frame with the wrong fields is answered, not dropped
+TEST_F(FramedTest, WrongFieldCount)
+{
+   writeAll(client, frame({"READ", "alice"}));
+   EXPECT_EQ(readFrame(client)[0], "ERR");
+   writeAll(client, frame({"LIST", "alice", "extra"}));
+   EXPECT_EQ(readFrame(client)[0], "ERR");
+   writeAll(client, frame({"BOGUS"}));
+   EXPECT_EQ(readFrame(client)[0], "ERR");
+   writeAll(client, frame({"SEND", "bob", "alice", "ok", "still here"}));
+   EXPECT_EQ(readFrame(client), vector<string>({"OK", ""}));
+}
+
+TEST_F(FramedTest, NoFields)
+{
+   string request;
+   appendUint32(request, 2);
+   request += string("\0\0", 2);
+   writeAll(client, request);
+   EXPECT_TRUE(dropped(client));
+}
+
+TEST_F(FramedTest, FrameLengthTooShort)
+{
+   string request;
+   appendUint32(request, 1);
+   request += string("\0\1", 2);
+   writeAll(client, request);
+   EXPECT_TRUE(dropped(client));
+}
+
+TEST_F(FramedTest, FieldExceedsFrame)
+{
+   string request = frame({"LIST", "alice"});
+   request[request.size() - 6] = 100;   // the length of "alice"
+   writeAll(client, request);
+   EXPECT_TRUE(dropped(client));
+}
+
+// the frame length counts bytes that no field covers
+TEST_F(FramedTest, FrameLengthMismatch)
+{
+   string request = frame({"LIST", "alice"}) + "xx";
+   request[3] += 2;
+   writeAll(client, request);
+   EXPECT_TRUE(dropped(client));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GROUP COMMIT
+// With --durability group a SEND is answered once its fsync is done, and the
+// answers behind it wait for it, so a pipeline is still answered in order.
+
+TEST_F(ServerTest, GroupCommitPipelinedSends)
+{
+   startServer({"--durability", "group"});
+   int client = connectClient();
+   const int count = 40;
+   string requests, expected, listed;
+   for (int i = 1; i <= count; ++i)
+   {
+      string receiver = i % 2 == 0 ? "alice" : "bob";
+      requests += "#" + to_string(i) + " SEND\nsender\n" + receiver + "\nsubject " + to_string(i) + "\nbody " +
+                  to_string(i) + "\n.\n";
+      expected += "<< OK #" + to_string(i) + "\n";
+      if (receiver == "alice")
+      {
+         listed += to_string(i / 2) + ". Subject: subject " + to_string(i) + "\n";
+      }
+   }
+   // answered behind the SENDs, though it does not wait for a commit
+   requests += "#list LIST\nalice\n";
+   expected += listed + "<< OK #list\n";
+   writeAll(client, requests);
+   string replies;
+   ASSERT_TRUE(readExactly(client, replies, expected.size()));
+   EXPECT_EQ(replies, expected);
+
+   int reader = connectClient();
+   for (int i = 1; i <= count; ++i)
+   {
+      string receiver = i % 2 == 0 ? "alice" : "bob";
+      int number = (i + 1) / 2;
+      EXPECT_EQ(command(reader, "READ\n" + receiver + "\n" + to_string(number) + "\n"),
+                "sender\nsubject " + to_string(i) + "\nbody " + to_string(i) + "\n<< OK\n");
+   }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SIZE LIMITS
+// A SEND body past --max-message-mb is refused as soon as it is too large,
+// the rest of it is skipped, and the session goes on with the next request.
+
+#define OVERSIZED_BODY (1024 * 1024 + 100 * 1024)   // past --max-message-mb 1
+
+TEST_F(ServerTest, OversizedLineBodyRefused)
+{
+   startServer({"--max-message-mb", "1"});
+   int client = connectClient();
+   string line = string(1023, 'x') + "\n";
+   string request = "SEND\nbob\nalice\nlarge\n";
+   while (request.size() < OVERSIZED_BODY)
+   {
+      request += line;
+   }
+   writeAll(client, request + ".\n");
+   EXPECT_EQ(readUntil(client, "<< ERR\n"), "Message too large!\n<< ERR\n");
+
+   EXPECT_EQ(command(client, "SEND\nbob\nalice\nsmall\nbody\n.\n"), "<< OK\n");
+   EXPECT_EQ(command(client, "LIST\nalice\n"), "1. Subject: small\n<< OK\n");
+}
+
+TEST_F(ServerTest, OversizedFramedBodyRefused)
+{
+   startServer({"--max-message-mb", "1"});
+   int client = connectFramed();
+   writeAll(client, frame({"SEND", "bob", "alice", "large", string(OVERSIZED_BODY, 'x')}));
+   EXPECT_EQ(readFrame(client), vector<string>({"ERR", "Message too large!\n"}));
+
+   writeAll(client, frame({"SEND", "bob", "alice", "small", "body"}));
+   EXPECT_EQ(readFrame(client), vector<string>({"OK", ""}));
+   writeAll(client, frame({"LIST", "alice"}));
+   EXPECT_EQ(readFrame(client), vector<string>({"OK", "1. Subject: small\n"}));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// STATS
+
+// the store counters are in both formats: one LIST from the mailbox, one
+// from the header cache, and the search index SEARCH has loaded
+TEST_F(ServerTest, StatsIncludeStore)
+{
+   startServer({"--cache-mb", "1", "--search-mb", "1"});
+   int client = connectClient();
+   ASSERT_EQ(command(client, "SEND\nbob\nalice\nhello\nbody\n.\n"), "<< OK\n");
+   ASSERT_EQ(command(client, "LIST\nalice\n"), "1. Subject: hello\n<< OK\n");
+   ASSERT_EQ(command(client, "LIST\nalice\n"), "1. Subject: hello\n<< OK\n");
+   ASSERT_EQ(command(client, "SEARCH\nalice\nbody\n"), "1. Subject: hello\n<< OK\n");
+
+   string json = command(client, "STATS JSON\n");
+   EXPECT_NE(json.find(",\"store\":{\"compactions\":0,\"reclaimedBytes\":0,\"cacheHits\":1,\"cacheMisses\":1,"
+                       "\"lockAcquisitions\":"), string::npos) << json;
+   EXPECT_NE(json.find(",\"searchMailboxes\":1}}\n"), string::npos) << json;
+   EXPECT_EQ(json.find("\"searchBytes\":0,"), string::npos) << json;
+
+   string text = command(client, "STATS\n");
+   string header = "compactions  reclaimed bytes  cache hits  cache misses  lock acquisitions  lock waits  "
+                   "search bytes  search mailboxes\n";
+   size_t row = text.find(header);
+   ASSERT_NE(row, string::npos) << text;
+   long compactions, reclaimed, hits, misses, acquisitions, waits, searchBytes, mailboxes;
+   ASSERT_EQ(sscanf(text.c_str() + row + header.size(), "%ld %ld %ld %ld %ld %ld %ld %ld", &compactions, &reclaimed,
+                    &hits, &misses, &acquisitions, &waits, &searchBytes, &mailboxes), 8);
+   EXPECT_EQ(hits, 1);
+   EXPECT_EQ(misses, 1);
+   EXPECT_GT(acquisitions, 0);
+   EXPECT_GT(searchBytes, 0);
+   EXPECT_EQ(mailboxes, 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CLIENT LIBRARY
+
+// What the line protocol cannot carry is refused before it is sent, so the
+// connection stays in step; FRAMED/1 carries the same mail unchanged.
+TEST_F(ServerTest, LineClientRefusesUnsafeFields)
+{
+   startServer();
+   twmailer::ClientOptions lines;
+   lines.framed = false;
+   twmailer::Client client("127.0.0.1", ntohs(address.sin_port), lines);
+   ASSERT_EQ(client.connect(), 0);
+   ASSERT_FALSE(client.framed());
+
+   twmailer::Mail mail = {"sender", "alice", "subject", "first\n.\nLIST\nalice\n"};
+   vector<twmailer::Mail> unsafe = {mail, mail, mail, mail};
+   unsafe[1].body = "first\n.\r\n";
+   unsafe[2].subject = "two\nlines";
+   unsafe[3].receiver = "alice\nbob";
+   for (const twmailer::Mail &request : unsafe)
+   {
+      errno = 0;
+      EXPECT_EQ(client.send(request), -1);
+      EXPECT_EQ(errno, EINVAL);
+   }
+   EXPECT_EQ(client.submit({"READ", "alice\n", "1"}), -1);
+   EXPECT_EQ(client.submit({"LIST", "alice"}, "1\n"), -1);
+   EXPECT_EQ(client.pending(), 0u);
+   EXPECT_EQ(client.queuedBytes(), 0u);
+
+   mail.body = ".first\n..\n";
+   ASSERT_EQ(client.send(mail), 0);
+   vector<twmailer::Summary> messages;
+   ASSERT_EQ(client.list("alice", messages), 0);
+   ASSERT_EQ(messages.size(), 1u);
+   twmailer::Mail stored;
+   ASSERT_EQ(client.read("alice", 1, stored), 0);
+   EXPECT_EQ(stored.body, mail.body);
+
+   twmailer::Client framed("127.0.0.1", ntohs(address.sin_port));
+   ASSERT_EQ(framed.connect(), 0);
+   ASSERT_TRUE(framed.framed());
+   ASSERT_EQ(framed.send(unsafe[0]), 0);
+   ASSERT_EQ(framed.read("alice", 2, stored), 0);
+   EXPECT_EQ(stored.body, unsafe[0].body);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WAIT
+// Sessions parked in WAIT, in the line protocol, against a server with one
+// worker; STATS tells when a WAIT is parked, so no test has to sleep.
+
+class WaitTest : public ServerTest
+{
+protected:
+   // returns once the server has count sessions parked
+   static void waitParked(int fd, int count)
+   {
+      string parked = "\"total\":{\"active\":";
+      for (int waited = 0; waited < REPLY_TIMEOUT * 1000; waited += 10)
+      {
+         string stats = command(fd, "STATS JSON\n");
+         size_t total = stats.find(parked);
+         ASSERT_NE(total, string::npos) << stats;
+         if (stats.find(",\"waiting\":" + to_string(count) + ",", total) != string::npos)
+         {
+            return;
+         }
+         usleep(10 * 1000);
+      }
+      FAIL() << "no WAIT parked";
+   }
+};
+
+TEST_F(WaitTest, WokenBySend)
+{
+   startServer();
+   int waiter = connectClient();
+   int sender = connectClient();
+   writeAll(waiter, "WAIT\nalice\n" + to_string(REPLY_TIMEOUT * 2) + "\n");
+   waitParked(sender, 1);
+   EXPECT_EQ(command(sender, "SEND\nbob\nalice\nhello\nbody\n.\n"), "<< OK\n");
+   EXPECT_EQ(readUntil(waiter, "<< OK\n"), "New mail\n<< OK\n");
+   EXPECT_EQ(command(waiter, "LIST\nalice\n"), "1. Subject: hello\n<< OK\n");
+}
+
+TEST_F(WaitTest, TimesOut)
+{
+   startServer();
+   int waiter = connectClient();
+   struct timeval start, end;
+   gettimeofday(&start, NULL);
+   EXPECT_EQ(command(waiter, "WAIT\nalice\n1\n"), "No new mail\n<< OK\n");
+   gettimeofday(&end, NULL);
+   EXPECT_GE((end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000, 900);
+}
+
+// mail that came after the LIST SINCE answers a WAIT with its token at once;
+// without any, the WAIT parks until its timeout
+TEST_F(WaitTest, TokenReturnsAtOnce)
+{
+   startServer();
+   int client = connectClient();
+   ASSERT_EQ(command(client, "SEND\nbob\nalice\nfirst\nbody\n.\n"), "<< OK\n");
+   string listed = command(client, "LIST SINCE 0\nalice\n");
+   size_t line = listed.find("Token: ");
+   ASSERT_NE(line, string::npos) << listed;
+   string token = listed.substr(line + 7, listed.find('\n', line) - line - 7);
+
+   EXPECT_EQ(command(client, "WAIT\nalice\n1 " + token + "\n"), "No new mail\n<< OK\n");
+   ASSERT_EQ(command(client, "SEND\nbob\nalice\nsecond\nbody\n.\n"), "<< OK\n");
+   // far longer than a reply may take, so only an answer at once passes
+   EXPECT_EQ(command(client, "WAIT\nalice\n3600 " + token + "\n"), "New mail\n<< OK\n");
+}
+
+// With the group commit the waiter hears of the mail only once it is on
+// disk, when the sender's OK is released: by the time "New mail" arrives,
+// that OK has been sent.
+TEST_F(WaitTest, GroupDurabilityWakesAfterCommit)
+{
+   startServer({"--durability", "group"});
+   int waiter = connectClient();
+   int sender = connectClient();
+   writeAll(waiter, "WAIT\nalice\n" + to_string(REPLY_TIMEOUT * 2) + "\n");
+   waitParked(sender, 1);
+   writeAll(sender, "SEND\nbob\nalice\nhello\nbody\n.\n");
+   EXPECT_EQ(readUntil(waiter, "<< OK\n"), "New mail\n<< OK\n");
+   char reply[16];
+   EXPECT_EQ(recv(sender, reply, sizeof(reply), MSG_DONTWAIT), 6);
+   EXPECT_EQ(string(reply, 6), "<< OK\n");
+}
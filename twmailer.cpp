@@ -0,0 +1,704 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "twmailer.h"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define BUF (16 * 1024)
+#define PROTO_FRAMED "FRAMED/1"
+
+namespace twmailer
+{
+
+static void appendUint32(string &out, uint32_t value)
+{
+   uint32_t network = htonl(value);
+   out.append((const char *)&network, sizeof(network));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CLIENT
+
+Client::Client(const string &host, int port, const ClientOptions &options)
+   : host(host), port(port), options(options), fd(-1), framedProtocol(false), inStart(0), inFlight(0)
+{
+}
+
+Client::~Client()
+{
+   if (fd != -1)
+   {
+      // best effort: let the server end the session cleanly
+      out.clear();
+      submit({"QUIT"});
+      flush();
+      close();
+   }
+}
+
+int Client::connect()
+{
+   struct addrinfo hints, *addresses;
+   string line;
+
+   if (fd != -1)
+   {
+      return 0;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // CREATE A CONNECTION
+   // https://man7.org/linux/man-pages/man3/getaddrinfo.3.html
+   // a host name or an IPv4/IPv6 address; every address is tried in turn
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   int result = getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &addresses);
+   if (result != 0)
+   {
+      errno = result == EAI_SYSTEM ? errno : EHOSTUNREACH;
+      return -1;
+   }
+   for (struct addrinfo *address = addresses; address != NULL && fd == -1; address = address->ai_next)
+   {
+      fd = socket(address->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (fd != -1 && ::connect(fd, address->ai_addr, address->ai_addrlen) == -1)
+      {
+         int error = errno;
+         ::close(fd);
+         fd = -1;
+         errno = error;
+      }
+   }
+   freeaddrinfo(addresses);
+   if (fd == -1)
+   {
+      return -1;
+   }
+   // requests are single writes that should not wait for delayed ACKs
+   int on = 1;
+   setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+   /////////////////////////////////////////////////////////////////////////////
+   // WELCOME
+   // the welcome message ends with the "Protocols:" line, which tells
+   // whether the server speaks the framed protocol
+   welcomeText.clear();
+   do
+   {
+      if (takeLine(line) == -1)
+      {
+         close();
+         return -1;
+      }
+      if (!line.empty() && line.back() == '\r')
+      {
+         line.pop_back();
+      }
+      welcomeText += line + "\n";
+   } while (line.compare(0, 10, "Protocols:") != 0);
+
+   if (options.framed && welcomeText.find(" " PROTO_FRAMED) != string::npos)
+   {
+      // acknowledged in the line protocol, everything after it is framed
+      out = "PROTO " PROTO_FRAMED "\n";
+      if (flush() == -1 || takeLine(line) == -1)
+      {
+         close();
+         return -1;
+      }
+      if (line != "<< OK")
+      {
+         close();
+         errno = EPROTO;
+         return -1;
+      }
+      framedProtocol = true;
+   }
+   return 0;
+}
+
+void Client::close()
+{
+   if (fd != -1)
+   {
+      ::close(fd);
+      fd = -1;
+   }
+   framedProtocol = false;
+   out.clear();
+   in.clear();
+   inStart = 0;
+   inFlight = 0;
+}
+
+// An idle connection the server has something to say on was closed or
+// reset by it (restart, crash), so a request sent on it would be lost.
+bool Client::stale()
+{
+   if (fd == -1 || inFlight > 0 || inStart < in.size())
+   {
+      return false;
+   }
+   struct pollfd pfd = {fd, POLLIN, 0};
+   return poll(&pfd, 1, 0) > 0;
+}
+
+// whether the line protocol can carry request: a line break in a field or a
+// body line "." (or ".\r", the server drops the "\r") would end it early and
+// the rest would be read as further commands
+static bool fitsLines(const vector<string> &request, const string &id)
+{
+   if (id.find('\n') != string::npos)
+   {
+      return false;
+   }
+   bool isSend = request[0] == "SEND";
+   for (size_t i = 0; i < request.size(); ++i)
+   {
+      const string &field = request[i];
+      if (!isSend || i < request.size() - 1)
+      {
+         if (field.find('\n') != string::npos)
+         {
+            return false;
+         }
+         continue;
+      }
+      for (size_t start = 0; start < field.size();)
+      {
+         size_t end = field.find('\n', start);
+         if (end == string::npos)
+         {
+            end = field.size();
+         }
+         size_t length = end - start;
+         if (field[start] == '.' && (length == 1 || (length == 2 && field[start + 1] == '\r')))
+         {
+            return false;
+         }
+         start = end + 1;
+      }
+   }
+   return true;
+}
+
+int Client::submit(const vector<string> &request, const string &id)
+{
+   const string &command = request[0];
+   size_t idLength = id.empty() ? 0 : id.size() + 2;   // "#<id> "
+
+   if (!framedProtocol && !fitsLines(request, id))
+   {
+      errno = EINVAL;
+      return -1;
+   }
+
+   if (framedProtocol)
+   {
+      // uint32 length, uint16 field count, (uint32 length, bytes) per field
+      uint32_t length = 2 + 4 + idLength + command.size();
+      for (size_t i = 1; i < request.size(); ++i)
+      {
+         length += 4 + request[i].size();
+      }
+      appendUint32(out, length);
+      out += (char)(request.size() >> 8);
+      out += (char)(request.size() & 0xff);
+      appendUint32(out, idLength + command.size());
+   }
+   if (idLength > 0)
+   {
+      out += "#" + id + " ";
+   }
+   out += command;
+
+   bool isSend = command == "SEND";
+   for (size_t i = 1; i < request.size(); ++i)
+   {
+      if (framedProtocol)
+      {
+         appendUint32(out, request[i].size());
+         out += request[i];
+         continue;
+      }
+      // line protocol: the SEND body is a list of lines ended by "."
+      out += "\n";
+      out += request[i];
+      if (isSend && i == request.size() - 1)
+      {
+         if (!request[i].empty() && request[i].back() != '\n')
+         {
+            out += "\n";
+         }
+         out += ".";
+      }
+   }
+   if (!framedProtocol)
+   {
+      out += "\n";
+   }
+   // QUIT is never answered
+   if (command != "QUIT")
+   {
+      inFlight++;
+   }
+   return 0;
+}
+
+int Client::flush()
+{
+   size_t sent = 0;
+   while (sent < out.size())
+   {
+      ssize_t size = ::send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+      if (size == -1 && errno == EINTR)
+      {
+         continue;
+      }
+      if (size == -1)
+      {
+         int error = errno;
+         close();
+         errno = error;
+         return -1;
+      }
+      sent += size;
+   }
+   out.clear();
+   return 0;
+}
+
+// receives more bytes into in; -1 if the connection broke
+int Client::fill()
+{
+   char buffer[BUF];
+   if (inStart > 0 && inStart >= in.size() / 2)
+   {
+      in.erase(0, inStart);
+      inStart = 0;
+   }
+   while (true)
+   {
+      ssize_t size = recv(fd, buffer, sizeof(buffer), 0);
+      if (size == -1 && errno == EINTR)
+      {
+         continue;
+      }
+      if (size <= 0)
+      {
+         if (size == 0)
+         {
+            errno = ECONNRESET;
+         }
+         return -1;
+      }
+      in.append(buffer, size);
+      return 0;
+   }
+}
+
+// one line without its "\n"
+int Client::takeLine(string &line)
+{
+   size_t end;
+   while ((end = in.find('\n', inStart)) == string::npos)
+   {
+      if (fill() == -1)
+      {
+         return -1;
+      }
+   }
+   line.assign(in, inStart, end - inStart);
+   inStart = end + 1;
+   return 0;
+}
+
+int Client::takeBytes(char *dst, size_t n)
+{
+   while (in.size() - inStart < n)
+   {
+      if (fill() == -1)
+      {
+         return -1;
+      }
+   }
+   memcpy(dst, in.data() + inStart, n);
+   inStart += n;
+   return 0;
+}
+
+int Client::receiveFrame(vector<string> &frame)
+{
+   unsigned char header[6];
+   if (takeBytes((char *)header, sizeof(header)) == -1)
+   {
+      return -1;
+   }
+   uint16_t count = (header[4] << 8) | header[5];
+   frame.resize(count);
+   for (string &field : frame)
+   {
+      uint32_t length;
+      if (takeBytes((char *)&length, sizeof(length)) == -1)
+      {
+         return -1;
+      }
+      field.resize(ntohl(length));
+      if (takeBytes(&field[0], field.size()) == -1)
+      {
+         return -1;
+      }
+   }
+   return 0;
+}
+
+int Client::receive(Reply &reply)
+{
+   if (inFlight == 0)
+   {
+      errno = EINVAL;
+      return -1;
+   }
+   if (!out.empty() && flush() == -1)
+   {
+      return -1;
+   }
+
+   reply.text.clear();
+   reply.id.clear();
+   if (framedProtocol)
+   {
+      if (receiveFrame(fields) == -1 || fields.empty())
+      {
+         int error = errno;
+         close();
+         errno = error;
+         return -1;
+      }
+      reply.ok = fields[0] == "OK";
+      if (fields.size() >= 2)
+      {
+         reply.text.swap(fields[1]);
+      }
+      if (fields.size() >= 3)
+      {
+         reply.id.swap(fields[2]);
+      }
+      inFlight--;
+      return 0;
+   }
+
+   // line protocol: the text lines, then "<< OK" or "<< ERR", maybe " #id"
+   if (fields.empty())
+   {
+      fields.resize(1);
+   }
+   string &line = fields[0];
+   while (true)
+   {
+      if (takeLine(line) == -1)
+      {
+         int error = errno;
+         close();
+         errno = error;
+         return -1;
+      }
+      bool ok = line.compare(0, 5, "<< OK") == 0;
+      if (ok || line.compare(0, 6, "<< ERR") == 0)
+      {
+         reply.ok = ok;
+         size_t hash = line.find(" #");
+         if (hash != string::npos)
+         {
+            reply.id.assign(line, hash + 2, string::npos);
+         }
+         inFlight--;
+         return 0;
+      }
+      reply.text += line;
+      reply.text += "\n";
+   }
+}
+
+// answers arrive in order and the socket is read ahead, so buffered bytes
+// are the next answer or its start
+bool Client::replyReady()
+{
+   if (inFlight == 0)
+   {
+      return false;
+   }
+   if (inStart < in.size())
+   {
+      return true;
+   }
+   struct pollfd pfd = {fd, POLLIN, 0};
+   return poll(&pfd, 1, 0) > 0;
+}
+
+// Sends one request and waits for its answer. A repeatable request that
+// lost its connection is sent again on a new one, up to options.retries
+// times.
+int Client::request(const vector<string> &request, bool repeatable, Reply &reply)
+{
+   if (inFlight > 0)
+   {
+      errno = EBUSY; // answers of pipelined requests are still due
+      return -1;
+   }
+   for (int attempt = 0;; ++attempt)
+   {
+      if (stale())
+      {
+         close();
+      }
+      if (connect() == 0)
+      {
+         if (submit(request) == -1)
+         {
+            return -1; // not sent, so repeating it is no use
+         }
+         if (receive(reply) == 0)
+         {
+            return reply.ok ? 0 : TWMAILER_REFUSED;
+         }
+      }
+      if (!repeatable || attempt >= options.retries)
+      {
+         return -1;
+      }
+   }
+}
+
+int Client::send(const Mail &mail)
+{
+   outgoing.resize(5);
+   outgoing[0] = "SEND";
+   outgoing[1] = mail.sender;
+   outgoing[2] = mail.receiver;
+   outgoing[3] = mail.subject;
+   outgoing[4] = mail.body;
+   return request(outgoing, false, scratch);
+}
+
+int Client::list(const string &user, vector<Summary> &messages)
+{
+   outgoing.resize(2);
+   outgoing[0] = "LIST";
+   outgoing[1] = user;
+   messages.clear();
+   int result = request(outgoing, true, scratch);
+   return result == 0 ? summaries(messages) : result;
+}
+
+// the page is followed by "Total: <messages>"
+int Client::listPage(const string &user, size_t offset, size_t count, vector<Summary> &messages, size_t &total)
+{
+   outgoing.resize(2);
+   outgoing[0] = "LIST " + to_string(offset) + " " + to_string(count);
+   outgoing[1] = user;
+   messages.clear();
+   int result = request(outgoing, true, scratch);
+   if (result != 0)
+   {
+      return result;
+   }
+   size_t line = scratch.text.rfind("Total: ");
+   total = line != string::npos ? strtoul(scratch.text.c_str() + line + 7, NULL, 10) : 0;
+   return summaries(messages);
+}
+
+// LIST lines for the added messages, "<number>. Deleted" for the deleted
+// ones, "Token: <token>" last and "Reset" first if the server started over
+int Client::listSince(const string &user, const string &token, Changes &changes)
+{
+   outgoing.resize(2);
+   outgoing[0] = "LIST SINCE " + token;
+   outgoing[1] = user;
+   changes.added.clear();
+   changes.deleted.clear();
+   int result = request(outgoing, true, scratch);
+   if (result != 0)
+   {
+      return result;
+   }
+   const string &text = scratch.text;
+   changes.reset = text.compare(0, 6, "Reset\n") == 0;
+   for (size_t start = 0, end; start < text.size(); start = end + 1)
+   {
+      end = text.find('\n', start);
+      if (end == string::npos)
+      {
+         end = text.size();
+      }
+      const char *line = text.c_str() + start;
+      char *after;
+      unsigned long number = strtoul(line, &after, 10);
+      if (text.compare(start, 7, "Token: ") == 0)
+      {
+         changes.token = text.substr(start + 7, end - start - 7);
+      }
+      else if (after > line && after + 9 == text.c_str() + end && strncmp(after, ". Deleted", 9) == 0)
+      {
+         changes.deleted.push_back(number);
+      }
+   }
+   return summaries(changes.added);
+}
+
+int Client::search(const string &user, const string &query, vector<Summary> &messages)
+{
+   outgoing.resize(3);
+   outgoing[0] = "SEARCH";
+   outgoing[1] = user;
+   outgoing[2] = query;
+   messages.clear();
+   int result = request(outgoing, true, scratch);
+   return result == 0 ? summaries(messages) : result;
+}
+
+// every line of a LIST or SEARCH answer is "<number>. Subject: <subject>"
+int Client::summaries(vector<Summary> &messages)
+{
+   const string &text = scratch.text;
+   for (size_t start = 0, end; start < text.size(); start = end + 1)
+   {
+      end = text.find('\n', start);
+      if (end == string::npos)
+      {
+         end = text.size();
+      }
+      size_t subject = text.find(". Subject: ", start);
+      if (subject == string::npos || subject > end)
+      {
+         continue;
+      }
+      messages.push_back({(uint32_t)strtoul(text.c_str() + start, NULL, 10),
+                          text.substr(subject + 11, end - subject - 11)});
+   }
+   return 0;
+}
+
+// the answer is the sender line, the subject line and the body
+int Client::read(const string &user, uint32_t number, Mail &mail)
+{
+   outgoing.resize(3);
+   outgoing[0] = "READ";
+   outgoing[1] = user;
+   outgoing[2] = to_string(number);
+   int result = request(outgoing, true, scratch);
+   if (result != 0)
+   {
+      return result;
+   }
+   const string &text = scratch.text;
+   size_t sender = text.find('\n');
+   size_t subject = sender == string::npos ? string::npos : text.find('\n', sender + 1);
+   if (subject == string::npos)
+   {
+      errno = EPROTO;
+      return -1;
+   }
+   mail.sender.assign(text, 0, sender);
+   mail.receiver = user;
+   mail.subject.assign(text, sender + 1, subject - sender - 1);
+   mail.body.assign(text, subject + 1, string::npos);
+   return 0;
+}
+
+int Client::del(const string &user, uint32_t number)
+{
+   outgoing.resize(3);
+   outgoing[0] = "DEL";
+   outgoing[1] = user;
+   outgoing[2] = to_string(number);
+   return request(outgoing, false, scratch);
+}
+
+// the answer is "New mail" or "No new mail"
+int Client::wait(const string &user, int seconds, bool &newMail, const string &token)
+{
+   outgoing.resize(3);
+   outgoing[0] = "WAIT";
+   outgoing[1] = user;
+   outgoing[2] = token.empty() ? to_string(seconds) : to_string(seconds) + " " + token;
+   int result = request(outgoing, true, scratch);
+   newMail = result == 0 && scratch.text.compare(0, 8, "New mail") == 0;
+   return result;
+}
+
+int Client::stats(string &text, bool json)
+{
+   outgoing.assign(1, json ? "STATS JSON" : "STATS");
+   int result = request(outgoing, true, scratch);
+   text.swap(scratch.text);
+   return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CONNECTION POOL
+
+ClientPool::ClientPool(const string &host, int port, size_t size, const ClientOptions &options)
+   : host(host), port(port), size(size), options(options), created(0)
+{
+}
+
+ClientPool::~ClientPool()
+{
+   for (Client *client : idle)
+   {
+      delete client;
+   }
+}
+
+ClientPool::Lease ClientPool::acquire()
+{
+   unique_lock<std::mutex> lock(idleMutex);
+   available.wait(lock, [this]() { return !idle.empty() || created < size; });
+   if (!idle.empty())
+   {
+      // the most recently used one, whose connection is most likely alive
+      Client *client = idle.back();
+      idle.pop_back();
+      return Lease(this, client);
+   }
+   created++;
+   lock.unlock();
+   return Lease(this, new Client(host, port, options));
+}
+
+void ClientPool::release(Client *client)
+{
+   // answers still due would go to the next holder
+   if (client->pending() > 0 || client->queuedBytes() > 0)
+   {
+      client->close();
+   }
+   {
+      lock_guard<std::mutex> lock(idleMutex);
+      idle.push_back(client);
+   }
+   available.notify_one();
+}
+
+ClientPool::Lease::~Lease()
+{
+   if (client != NULL)
+   {
+      pool->release(client);
+   }
+}
+
+}
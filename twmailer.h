@@ -0,0 +1,192 @@
+#ifndef TWMAILER_H
+#define TWMAILER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+///////////////////////////////////////////////////////////////////////////////
+// LIBTWMAILER
+// The client side of the TwMailer protocol as a library (libtwmailer.a),
+// shared by twmailer-client, twmailer-bench and anything else that talks to
+// the server. A Client is one connection: it reads the welcome message,
+// switches to FRAMED/1 when the server offers it and reconnects on its own.
+// Requests can be answered one at a time (send, list, listPage, listSince,
+// read, del, search, wait, stats) or pipelined (submit, flush, receive).
+// Its buffers live as long as the Client, so a long-lived connection does
+// not allocate per request beyond the answers it hands out. A ClientPool
+// shares a bounded number of clients between threads.
+//
+// Results: 0 for OK, TWMAILER_REFUSED if the server answered ERR, -1 if the
+// connection failed (errno tells why).
+
+#define TWMAILER_REFUSED -2
+
+namespace twmailer
+{
+
+struct Mail
+{
+   std::string sender;
+   std::string receiver;
+   std::string subject;
+   std::string body;   // "\n"-terminated lines
+};
+
+// one line of a LIST answer
+struct Summary
+{
+   uint32_t number;
+   std::string subject;
+};
+
+// the answer to LIST SINCE
+struct Changes
+{
+   bool reset;                      // the server started over: added holds every message
+   std::vector<Summary> added;
+   std::vector<uint32_t> deleted;
+   std::string token;               // for the next listSince()
+};
+
+struct Reply
+{
+   bool ok;
+   std::string text;   // what the server printed before OK/ERR
+   std::string id;     // the request id, if the request had one
+};
+
+struct ClientOptions
+{
+   bool framed = true;   // use FRAMED/1 if the server offers it
+   // Reconnects for LIST, READ and STATS that failed with the connection.
+   // SEND and DEL are never repeated: the server may have run them.
+   int retries = 1;
+};
+
+class Client
+{
+public:
+   Client(const std::string &host, int port, const ClientOptions &options = ClientOptions());
+   ~Client();
+
+   // connects and reads the welcome message unless connected; -1 on error
+   int connect();
+   void close();
+   bool connected() const { return fd != -1; }
+   bool framed() const { return framedProtocol; }
+   const std::string &welcome() const { return welcomeText; }
+
+   // one request each, connecting first if necessary
+   int send(const Mail &mail);
+   int list(const std::string &user, std::vector<Summary> &messages);
+   // at most count messages from the offset-th on; total gets the number of
+   // messages in the mailbox
+   int listPage(const std::string &user, size_t offset, size_t count, std::vector<Summary> &messages, size_t &total);
+   // what changed since token, "0" for a first call; applying the same
+   // change twice does no harm
+   int listSince(const std::string &user, const std::string &token, Changes &changes);
+   int read(const std::string &user, uint32_t number, Mail &mail);
+   int del(const std::string &user, uint32_t number);
+   // the messages holding every word of query
+   int search(const std::string &user, const std::string &query, std::vector<Summary> &messages);
+   // Waits up to seconds for mail to user; newMail tells whether it came.
+   // With a token from listSince() it returns at once if mail came since.
+   int wait(const std::string &user, int seconds, bool &newMail, const std::string &token = "");
+   int stats(std::string &text, bool json = false);
+
+   // Pipelining: submit() queues a request (command and fields, a SEND body
+   // last), flush() sends everything queued, receive() returns the answers
+   // in order. A request id is echoed in its reply. The line protocol cannot
+   // carry a field or id with a line break, nor a body line "."; submit()
+   // queues nothing then and returns -1 with errno EINVAL.
+   int submit(const std::vector<std::string> &request, const std::string &id = "");
+   int flush();
+   int receive(Reply &reply);
+   size_t pending() const { return inFlight; }        // submitted, not yet received
+   size_t queuedBytes() const { return out.size(); }  // submitted, not yet flushed
+   bool replyReady();                                 // receive() would not wait long
+
+private:
+   int request(const std::vector<std::string> &fields, bool repeatable, Reply &reply);
+   int summaries(std::vector<Summary> &messages);
+   bool stale();
+   int fill();
+   int takeLine(std::string &line);
+   int takeBytes(char *dst, size_t n);
+   int receiveFrame(std::vector<std::string> &fields);
+
+   std::string host;
+   int port;
+   ClientOptions options;
+   int fd;
+   bool framedProtocol;
+   std::string welcomeText;
+   std::string out;       // encoded requests not yet sent
+   std::string in;        // received bytes, parsed from inStart on
+   size_t inStart;
+   size_t inFlight;
+   std::vector<std::string> fields;     // reused by receive()
+   std::vector<std::string> outgoing;   // reused by the one-request calls
+   Reply scratch;
+};
+
+// A bounded set of clients for many threads. acquire() hands out an idle
+// client, creates one if fewer than size exist, or waits for a release.
+// Clients connect lazily and keep their connection between leases. The pool
+// must outlive its leases.
+class ClientPool
+{
+public:
+   class Lease
+   {
+   public:
+      Lease(Lease &&other) : pool(other.pool), client(other.client) { other.client = NULL; }
+      ~Lease();
+      Client *operator->() const { return client; }
+      Client &operator*() const { return *client; }
+
+   private:
+      friend class ClientPool;
+      Lease(ClientPool *pool, Client *client) : pool(pool), client(client) {}
+      Lease(const Lease &) = delete;
+      Lease &operator=(const Lease &) = delete;
+
+      ClientPool *pool;
+      Client *client;
+   };
+
+   ClientPool(const std::string &host, int port, size_t size, const ClientOptions &options = ClientOptions());
+   ~ClientPool();
+
+   Lease acquire();
+
+   // one request on a leased client
+   int send(const Mail &mail) { return acquire()->send(mail); }
+   int list(const std::string &user, std::vector<Summary> &messages) { return acquire()->list(user, messages); }
+   int listPage(const std::string &user, size_t offset, size_t count, std::vector<Summary> &messages, size_t &total) { return acquire()->listPage(user, offset, count, messages, total); }
+   int listSince(const std::string &user, const std::string &token, Changes &changes) { return acquire()->listSince(user, token, changes); }
+   int read(const std::string &user, uint32_t number, Mail &mail) { return acquire()->read(user, number, mail); }
+   int del(const std::string &user, uint32_t number) { return acquire()->del(user, number); }
+   int search(const std::string &user, const std::string &query, std::vector<Summary> &messages) { return acquire()->search(user, query, messages); }
+   int wait(const std::string &user, int seconds, bool &newMail, const std::string &token = "") { return acquire()->wait(user, seconds, newMail, token); }
+
+private:
+   void release(Client *client);
+
+   std::string host;
+   int port;
+   size_t size;
+   ClientOptions options;
+   std::mutex idleMutex;   // guards idle and created
+   std::condition_variable available;
+   std::vector<Client *> idle;
+   size_t created;
+};
+
+}
+
+#endif